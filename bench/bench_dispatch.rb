@@ -0,0 +1,63 @@
+# frozen_string_literal: true
+
+# Compares the ways of dispatching completions: a callback given when the op
+# is prepped, a block given to #process_completions, #wait_for_completion,
+# and the different completion modes. Also compares the cost of prepping using
+# kwargs, a recycled spec, and the positional fast-path API.
+
+Bench.suite('dispatch') do
+  ring = IOU::Ring.new
+  # the file is kept referenced, so it's not closed by the GC
+  null = File.open('/dev/null', 'w')
+  fd = null.fileno
+  buffer = 'foobar'
+  spec = { fd: fd, buffer: buffer }
+  count = 200_000
+
+  Bench.measure('callback', count: count) do
+    ring.prep_write(fd: fd, buffer: buffer) { |c| c }
+    ring.process_completions(true)
+  end
+
+  Bench.measure('process_completions block', count: count) do
+    ring.prep_write(fd: fd, buffer: buffer)
+    ring.process_completions(true) { |c| c }
+  end
+
+  Bench.measure('wait_for_completion', count: count) do
+    ring.prep_write(fd: fd, buffer: buffer)
+    ring.submit
+    ring.wait_for_completion
+  end
+
+  # prepping variants, reported side by side
+  Bench.measure('prep_write (kwargs)', count: count) do
+    ring.prep_write(fd: fd, buffer: buffer)
+    ring.process_completions(true)
+  end
+
+  Bench.measure('prep_write (recycled spec)', count: count) do
+    ring.prep_write(spec)
+    ring.process_completions(true)
+  end
+
+  Bench.measure('prep_write_fast', count: count) do
+    ring.prep_write_fast(fd, buffer)
+    ring.process_completions(true)
+  end
+
+  ring.completion_mode = :object
+  Bench.measure('completion_mode :object', count: count) do
+    ring.prep_write_fast(fd, buffer)
+    ring.process_completions(true) { |c| c }
+  end
+
+  ring.completion_mode = :args
+  Bench.measure('completion_mode :args', count: count) do
+    ring.prep_write_fast(fd, buffer)
+    ring.process_completions(true) { |id, result, flags| result }
+  end
+
+  ring.close
+  null.close
+end
@@ -0,0 +1,25 @@
+# frozen_string_literal: true
+
+# Measures round trip latency and throughput for an echo server over loopback
+# TCP, using a single connection and multiple concurrent connections.
+
+require_relative 'servers'
+
+Bench.suite('echo') do
+  msg = ('*' * 64).freeze
+  round_trip = ->(sock) {
+    sock.write(msg)
+    sock.read(msg.bytesize)
+  }
+
+  BenchServers.kinds.each do |kind|
+    BenchServers.with_server(kind, BenchServers::ECHO) do |port|
+      [1, 8].each do |concurrency|
+        BenchServers.run_clients(
+          "#{kind} (#{concurrency} conn)", port,
+          count: 50_000, concurrency: concurrency, &round_trip
+        )
+      end
+    end
+  end
+end
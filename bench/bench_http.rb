@@ -0,0 +1,26 @@
+# frozen_string_literal: true
+
+# Measures requests per second and latency for a minimal HTTP/1.1 keep-alive
+# server over loopback TCP.
+
+require_relative 'servers'
+
+Bench.suite('http') do
+  request = "GET / HTTP/1.1\r\nHost: localhost\r\n\r\n"
+  response_size = BenchServers::HTTP_RESPONSE.bytesize
+  round_trip = ->(sock) {
+    sock.write(request)
+    sock.read(response_size)
+  }
+
+  BenchServers.kinds.each do |kind|
+    BenchServers.with_server(kind, BenchServers::HTTP) do |port|
+      [1, 16].each do |concurrency|
+        BenchServers.run_clients(
+          "#{kind} (#{concurrency} conn)", port,
+          count: 50_000, concurrency: concurrency, &round_trip
+        )
+      end
+    end
+  end
+end
@@ -0,0 +1,24 @@
+# frozen_string_literal: true
+
+# Measures the raw cost of a prep + submit + complete cycle using nops, one op
+# per submission and in batches.
+
+Bench.suite('nop') do
+  ring = IOU::Ring.new
+
+  Bench.measure('prep_nop + wait_for_completion', count: 200_000) do
+    ring.prep_nop
+    ring.submit
+    ring.wait_for_completion
+  end
+
+  [16, 256].each do |batch|
+    Bench.measure("prep_nop x#{batch} + process_completions", count: 400_000 / batch, batch: batch) do
+      batch.times { ring.prep_nop }
+      done = 0
+      done += ring.process_completions(true) while done < batch
+    end
+  end
+
+  ring.close
+end
@@ -0,0 +1,39 @@
+# frozen_string_literal: true
+
+# Compares reading from a pipe using single-shot reads, a multishot read with
+# a buffer ring, and IO.select + read_nonblock as a baseline. Each iteration
+# writes a chunk to the pipe and reads it back.
+
+Bench.suite('read') do
+  chunk = ('*' * 1024).freeze
+  count = 100_000
+
+  r, w = IO.pipe
+  ring = IOU::Ring.new
+  buffer = +''
+  Bench.measure('single-shot prep_read', count: count) do
+    w.write(chunk)
+    ring.prep_read(fd: r.fileno, buffer: buffer, len: 4096)
+    ring.submit
+    ring.wait_for_completion
+  end
+  ring.close
+
+  ring = IOU::Ring.new
+  bg_id = ring.setup_buffer_ring(count: 64, size: 4096)
+  ring.prep_read(fd: r.fileno, multishot: true, buffer_group: bg_id)
+  Bench.measure('multishot prep_read (buffer ring)', count: count) do
+    w.write(chunk)
+    ring.process_completions(true) { |c| c[:buffer] }
+  end
+  ring.close
+
+  Bench.measure('IO.select + read_nonblock', count: count) do
+    w.write(chunk)
+    IO.select([r])
+    r.read_nonblock(4096, buffer)
+  end
+
+  r.close
+  w.close
+end
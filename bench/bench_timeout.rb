@@ -0,0 +1,24 @@
+# frozen_string_literal: true
+
+# Measures timeout churn: timeouts that are armed and then cancelled before
+# expiring (as with I/O deadlines), and short timeouts that expire.
+
+Bench.suite('timeout') do
+  ring = IOU::Ring.new
+
+  Bench.measure('prep_timeout + prep_cancel', count: 100_000) do
+    id = ring.prep_timeout(interval: 10)
+    ring.prep_cancel(id)
+    done = 0
+    done += ring.process_completions(true) while done < 2
+  end
+
+  batch = 64
+  Bench.measure("prep_timeout(0) x#{batch} (expired)", count: 200_000 / batch, batch: batch) do
+    batch.times { ring.prep_timeout(interval: 0) }
+    done = 0
+    done += ring.process_completions(true) while done < batch
+  end
+
+  ring.close
+end
@@ -0,0 +1,136 @@
+# frozen_string_literal: true
+
+require 'bundler/setup'
+require_relative '../lib/iou'
+require 'json'
+require 'etc'
+require 'time'
+
+# A minimal benchmark harness. Each benchmark records the number of ops
+# performed, the elapsed time and optionally the latency of each op. Results
+# are printed as they are recorded, and written as JSON at the end of the run,
+# so runs can be compared between versions.
+module Bench
+  # Multiplies the iteration count of all benchmarks. Use BENCH_SCALE=0.1 for
+  # a quick run, or a larger value for longer runs.
+  SCALE = (ENV['BENCH_SCALE'] || 1).to_f
+
+  PERCENTILES = [50, 90, 99, 99.9].freeze
+
+  Result = Struct.new(:suite, :name, :count, :elapsed, :latencies) do
+    def ops_per_sec
+      count / elapsed
+    end
+
+    # Returns the latency percentiles in microseconds.
+    def latency
+      return nil if !latencies || latencies.empty?
+
+      sorted = latencies.sort
+      h = PERCENTILES.to_h do |p|
+        idx = ((p / 100.0) * (sorted.size - 1)).round
+        ["p#{p}".to_sym, (sorted[idx] * 1_000_000).round(1)]
+      end
+      h[:max] = (sorted.last * 1_000_000).round(1)
+      h
+    end
+
+    def to_h
+      {
+        suite: suite,
+        name: name,
+        count: count,
+        elapsed: elapsed.round(6),
+        ops_per_sec: ops_per_sec.round(1),
+        latency: latency
+      }.compact
+    end
+  end
+
+  @results = []
+
+  class << self
+    attr_reader :results
+
+    def clock
+      Process.clock_gettime(Process::CLOCK_MONOTONIC)
+    end
+
+    def iterations(count)
+      [(count * SCALE).to_i, 1].max
+    end
+
+    # Runs the given block with the given suite name, under which all
+    # benchmarks run in the block are recorded.
+    def suite(name)
+      @suite = name
+      puts "#{name}:"
+      yield
+      puts
+    ensure
+      @suite = nil
+    end
+
+    # Measures the throughput of the given block. The block is called count
+    # times (after a short warmup), each call performing batch ops.
+    def measure(name, count:, batch: 1, &block)
+      count = iterations(count)
+      [count / 10, 1].max.times(&block)
+
+      t0 = clock
+      count.times(&block)
+      record(name, count * batch, clock - t0)
+    end
+
+    # Measures the latency of each call to the given block, as well as the
+    # overall throughput.
+    def measure_latency(name, count:)
+      count = iterations(count)
+      [count / 10, 1].max.times { yield }
+
+      latencies = Array.new(count)
+      t0 = clock
+      count.times do |i|
+        t = clock
+        yield
+        latencies[i] = clock - t
+      end
+      record(name, count, clock - t0, latencies)
+    end
+
+    def record(name, count, elapsed, latencies = nil)
+      result = Result.new(@suite, name, count, elapsed, latencies)
+      @results << result
+      print_result(result)
+      result
+    end
+
+    def print_result(result)
+      line = format('  %-44s %12.1f ops/s', result.name, result.ops_per_sec)
+      if (latency = result.latency)
+        line << format('  p50 %7.1fus  p99 %7.1fus  max %8.1fus',
+          latency[:p50], latency[:p99], latency[:max])
+      end
+      puts line
+    end
+
+    def environment
+      {
+        iou_version: IOU::VERSION,
+        ruby_version: RUBY_DESCRIPTION,
+        kernel: Etc.uname[:release],
+        cpus: Etc.nprocessors,
+        scale: SCALE,
+        time: Time.now.utc.iso8601
+      }
+    end
+
+    def write_json(path)
+      dir = File.dirname(path)
+      Dir.mkdir(dir) if !File.directory?(dir)
+      data = environment.merge(results: @results.map(&:to_h))
+      File.write(path, JSON.pretty_generate(data))
+      puts "Results written to #{path}"
+    end
+  end
+end
@@ -0,0 +1,23 @@
+# frozen_string_literal: true
+
+# Runs the benchmark suite, or only the given benchmarks, e.g.:
+#
+#   ruby bench/run.rb           # all benchmarks
+#   ruby bench/run.rb nop echo  # bench/bench_nop.rb and bench/bench_echo.rb
+#
+# Results are written as JSON to the path given in BENCH_OUTPUT, by default
+# bench/results/iou-<version>-<timestamp>.json.
+
+require_relative 'helper'
+
+files = Dir[File.join(__dir__, 'bench_*.rb')].sort
+if !ARGV.empty?
+  files = files.select { |fn| ARGV.include?(File.basename(fn, '.rb').delete_prefix('bench_')) }
+  abort "No benchmarks found for #{ARGV.inspect}" if files.empty?
+end
+
+files.each { |fn| load fn }
+
+path = ENV['BENCH_OUTPUT'] ||
+  File.join(__dir__, 'results', "iou-#{IOU::VERSION}-#{Time.now.strftime('%Y%m%d-%H%M%S')}.json")
+Bench.write_json(path)
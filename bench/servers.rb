@@ -0,0 +1,165 @@
+# frozen_string_literal: true
+
+require 'socket'
+
+begin
+  require 'nio'
+rescue LoadError
+  # nio4r baselines are skipped
+end
+
+# Servers used by the network benchmarks. Each server runs in a forked process,
+# so it doesn't contend with the client for the GVL. A server is given a
+# protocol, a lambda that takes the data received so far on a connection and
+# returns the data to send back (or nil if a full request was not received
+# yet), consuming the requests it responds to.
+module BenchServers
+  ECHO = ->(buf) {
+    out = buf.dup
+    buf.clear
+    out
+  }
+
+  HTTP_RESPONSE = "HTTP/1.1 200 OK\r\nContent-Length: 14\r\n\r\nHello, world!\n"
+
+  HTTP = ->(buf) {
+    count = 0
+    while (idx = buf.index("\r\n\r\n"))
+      buf.slice!(0, idx + 4)
+      count += 1
+    end
+    count > 0 ? HTTP_RESPONSE * count : nil
+  }
+
+  class << self
+    def kinds
+      defined?(NIO) ? [:iou, :select, :nio4r] : [:iou, :select]
+    end
+
+    # Starts a server of the given kind, yields its port, and stops it once
+    # the block returns.
+    def with_server(kind, protocol)
+      server = TCPServer.new('127.0.0.1', 0)
+      port = server.local_address.ip_port
+      pid = fork do
+        send(:"#{kind}_server", server, protocol)
+      end
+      server.close
+      yield port
+    ensure
+      if pid
+        Process.kill(:KILL, pid)
+        Process.wait(pid)
+      end
+    end
+
+    # Runs count round trips over the given number of concurrent connections,
+    # recording the latency of each round trip. The given block performs a
+    # single round trip on the given socket.
+    def run_clients(name, port, count:, concurrency:, &round_trip)
+      count = Bench.iterations(count)
+      per_client = [count / concurrency, 1].max
+      sockets = concurrency.times.map do
+        TCPSocket.new('127.0.0.1', port).tap do |s|
+          s.setsockopt(Socket::IPPROTO_TCP, Socket::TCP_NODELAY, 1)
+        end
+      end
+      sockets.each { |s| [per_client / 10, 1].max.times { round_trip.(s) } }
+
+      t0 = Bench.clock
+      threads = sockets.map do |s|
+        Thread.new do
+          per_client.times.map do
+            t = Bench.clock
+            round_trip.(s)
+            Bench.clock - t
+          end
+        end
+      end
+      latencies = threads.flat_map(&:value)
+      Bench.record(name, latencies.size, Bench.clock - t0, latencies)
+    ensure
+      sockets&.each(&:close)
+    end
+
+    def iou_server(server, protocol)
+      ring = IOU::Ring.new
+      bg_id = ring.setup_buffer_ring(count: 256, size: 16384)
+      ring.prep_accept(fd: server.fileno, multishot: true) do |c|
+        fd = c[:result]
+        next if fd < 0
+
+        buf = +''
+        ring.prep_recv(fd: fd, buffer_group: bg_id, multishot: true) do |rc|
+          if rc[:result] > 0
+            buf << rc[:buffer]
+            out = protocol.(buf)
+            ring.prep_send(fd: fd, buffer: out) if out
+          else
+            ring.prep_close(fd: fd)
+          end
+        end
+      end
+      ring.process_completions_loop
+    end
+
+    def select_server(server, protocol)
+      conns = {}
+      loop do
+        readable, = IO.select([server, *conns.keys])
+        readable.each do |io|
+          if io == server
+            conns[server.accept] = +''
+            next
+          end
+
+          data = io.read_nonblock(16384, exception: false)
+          case data
+          when :wait_readable
+            next
+          when nil
+            conns.delete(io)
+            io.close
+          else
+            buf = conns[io]
+            buf << data
+            out = protocol.(buf)
+            io.write(out) if out
+          end
+        end
+      end
+    end
+
+    def nio4r_server(server, protocol)
+      selector = NIO::Selector.new
+      selector.register(server, :r)
+      conns = {}
+      loop do
+        selector.select do |monitor|
+          io = monitor.io
+          if io == server
+            conn = server.accept
+            conns[conn] = +''
+            selector.register(conn, :r)
+            next
+          end
+
+          data = io.read_nonblock(16384, exception: false)
+          case data
+          when :wait_readable
+            next
+          when nil
+            selector.deregister(io)
+            conns.delete(io)
+            io.close
+          else
+            buf = conns[io]
+            buf << data
+            out = protocol.(buf)
+            io.write(out) if out
+          end
+        end
+      end
+    end
+  end
+end
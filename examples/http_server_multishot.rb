@@ -13,8 +13,13 @@ log 'Listening on port 1234... (multishot read)'
 @ring = IOU::Ring.new
 @bg_id = @ring.setup_buffer_ring(count: 1024, size: 4096)
 
-@ring.prep_accept(fd: socket.fileno, multishot: true) do |c|
-  setup_connection(c[:result]) if c[:result] > 0
+# Connections are accepted as direct descriptors, i.e. slots in the ring's
+# registered file table, which are used for all subsequent I/O.
+@ring.register_files(4096)
+listen_fd = @ring.register_file(socket.fileno)
+
+@ring.prep_accept(fixed_fd: listen_fd, multishot: true, direct: true) do |c|
+  setup_connection(c[:result]) if c[:result] >= 0
 end
 
 def setup_connection(fd)
@@ -22,23 +27,24 @@ def setup_connection(fd)
 
   parser = Http::Parser.new
   parser.on_message_complete = -> {
-    http_send_response(fd, "Hello, world!\n")
+    http_send_response(fd)
   }
 
   http_prep_read(fd, parser)
 end
 
 def http_prep_read(fd, parser)
-  id = @ring.prep_read(fd: fd, multishot: true, buffer_group: @bg_id) do |c|
+  id = @ring.prep_read(fixed_fd: fd, multishot: true, buffer_group: @bg_id) do |c|
     if c[:result] > 0
       parser << c[:buffer]
-    elsif c[:result] == 0
-      log "Connection closed by client on fd #{fd}"
     else
-      if c[:result] != -Errno::ECANCELED::Errno
+      if c[:result] == 0
+        log "Connection closed by client on fd #{fd}"
+      elsif c[:result] != -Errno::ECANCELED::Errno
         log "Got error #{c[:result]} on fd #{fd}, closing connection..."
       end
-      @ring.prep_close(fd: fd) do |c|
+      # closing the direct descriptor frees its slot in the file table
+      @ring.prep_close(fixed_fd: fd) do |c|
         log "Connection closed on fd #{fd}, result #{c[:result]}"
       end
     end
@@ -48,9 +54,14 @@ def http_prep_read(fd, parser)
   end
 end
 
-def http_send_response(fd, body)
-  msg = "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nConnection: keep-alive\r\nContent-Length: #{body.bytesize}\r\n\r\n#{body}"
-  @ring.prep_write(fd: fd, buffer: msg)
+RESPONSE_BODY = "Hello, world!\n".freeze
+RESPONSE_HEADERS = "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nConnection: keep-alive\r\nContent-Length: #{RESPONSE_BODY.bytesize}\r\n\r\n".freeze
+RESPONSE_BUFFERS = [RESPONSE_HEADERS, RESPONSE_BODY].freeze
+
+# The headers and body are written using a single writev, without
+# concatenating them for each response.
+def http_send_response(fd)
+  @ring.prep_writev(fixed_fd: fd, buffers: RESPONSE_BUFFERS)
 end
 
 trap('SIGINT') { exit! }
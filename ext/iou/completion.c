@@ -0,0 +1,102 @@
+#include "iou.h"
+
+VALUE cCompletion;
+
+static void Completion_mark(void *ptr) {
+  Completion_t *c = ptr;
+  rb_gc_mark_movable(c->op);
+  rb_gc_mark_movable(c->spec);
+  rb_gc_mark_movable(c->buffer);
+}
+
+static void Completion_compact(void *ptr) {
+  Completion_t *c = ptr;
+  c->op = rb_gc_location(c->op);
+  c->spec = rb_gc_location(c->spec);
+  c->buffer = rb_gc_location(c->buffer);
+}
+
+static size_t Completion_size(const void *ptr) {
+  return sizeof(Completion_t);
+}
+
+static const rb_data_type_t Completion_type = {
+    "Completion",
+    {Completion_mark, RUBY_TYPED_DEFAULT_FREE, Completion_size, Completion_compact},
+    0, 0, RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_WB_PROTECTED
+};
+
+static VALUE Completion_allocate(VALUE klass) {
+  Completion_t *c = ALLOC(Completion_t);
+  c->id = 0;
+  c->result = 0;
+  c->flags = 0;
+  c->op = Qnil;
+  c->spec = Qnil;
+  c->buffer = Qnil;
+
+  return TypedData_Wrap_Struct(klass, &Completion_type, c);
+}
+
+VALUE Completion_new(void) {
+  return Completion_allocate(cCompletion);
+}
+
+inline void Completion_update(VALUE self, unsigned id, VALUE op, int result, unsigned flags, VALUE spec, VALUE buffer) {
+  Completion_t *c = RTYPEDDATA_DATA(self);
+  c->id = id;
+  c->result = result;
+  c->flags = flags;
+  RB_OBJ_WRITE(self, &c->op, op);
+  RB_OBJ_WRITE(self, &c->spec, spec);
+  RB_OBJ_WRITE(self, &c->buffer, buffer);
+}
+
+VALUE Completion_id(VALUE self) {
+  Completion_t *c = RTYPEDDATA_DATA(self);
+  return UINT2NUM(c->id);
+}
+
+VALUE Completion_op(VALUE self) {
+  Completion_t *c = RTYPEDDATA_DATA(self);
+  return c->op;
+}
+
+VALUE Completion_result(VALUE self) {
+  Completion_t *c = RTYPEDDATA_DATA(self);
+  return INT2NUM(c->result);
+}
+
+VALUE Completion_flags(VALUE self) {
+  Completion_t *c = RTYPEDDATA_DATA(self);
+  return UINT2NUM(c->flags);
+}
+
+VALUE Completion_buffer(VALUE self) {
+  Completion_t *c = RTYPEDDATA_DATA(self);
+  return c->buffer;
+}
+
+VALUE Completion_spec(VALUE self) {
+  Completion_t *c = RTYPEDDATA_DATA(self);
+  return c->spec;
+}
+
+VALUE Completion_more_p(VALUE self) {
+  Completion_t *c = RTYPEDDATA_DATA(self);
+  return (c->flags & IORING_CQE_F_MORE) ? Qtrue : Qfalse;
+}
+
+void Init_Completion(void) {
+  mIOU = rb_define_module("IOU");
+  cCompletion = rb_define_class_under(mIOU, "Completion", rb_cObject);
+  rb_define_alloc_func(cCompletion, Completion_allocate);
+
+  rb_define_method(cCompletion, "id", Completion_id, 0);
+  rb_define_method(cCompletion, "op", Completion_op, 0);
+  rb_define_method(cCompletion, "result", Completion_result, 0);
+  rb_define_method(cCompletion, "flags", Completion_flags, 0);
+  rb_define_method(cCompletion, "buffer", Completion_buffer, 0);
+  rb_define_method(cCompletion, "spec", Completion_spec, 0);
+  rb_define_method(cCompletion, "more?", Completion_more_p, 0);
+}
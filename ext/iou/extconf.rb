@@ -29,6 +29,7 @@ def get_config
   config[:submit_all_flag]    = combined_version >= 518
   config[:coop_taskrun_flag]  = combined_version >= 519
   config[:single_issuer_flag] = combined_version >= 600
+  config[:defer_taskrun_flag] = combined_version >= 601
 
   config
 end
@@ -64,6 +65,8 @@ $defs << '-DHAVE_IO_URING_PREP_RECVMSG_MULTISHOT' if config[:multishot_recvmsg]
 $defs << '-DHAVE_IO_URING_TIMEOUT_MULTISHOT'      if config[:multishot_timeout]
 $defs << '-DHAVE_IORING_SETUP_SUBMIT_ALL'         if config[:submit_all_flag]
 $defs << '-DHAVE_IORING_SETUP_COOP_TASKRUN'       if config[:coop_taskrun_flag]
+$defs << '-DHAVE_IORING_SETUP_SINGLE_ISSUER'      if config[:single_issuer_flag]
+$defs << '-DHAVE_IORING_SETUP_DEFER_TASKRUN'      if config[:defer_taskrun_flag]
 $CFLAGS << ' -Wno-pointer-arith'
 
 CONFIG['optflags'] << ' -fno-strict-aliasing'
@@ -22,70 +22,314 @@
 
 struct buf_ring_descriptor {
   struct io_uring_buf_ring *br;
-  size_t br_size;
-  // struct io_uring_buf_ring *buf_ring;
   unsigned buf_count;
   unsigned buf_size;
 	char *buf_base;
-  // size_t buf_ring_size;
+  size_t buf_mem_size;
+
+  // ring position of the next buffer to be consumed by the kernel, used for
+  // locating the buffers of a bundle
+  unsigned head;
+
+  // send buffer rings start empty, with free buffers kept in a stack
+  int send;
+  unsigned *free_bids;
+  unsigned free_count;
+
+  // number of buffers held by IO::Buffer views, which are added back to the
+  // ring when released
+  unsigned views;
+
+  // with incremental consumption, the kernel may use a buffer for multiple
+  // completions. The offset of the next completion's data is kept per buffer.
+  int incremental;
+  unsigned *buf_offsets;
+
+  // multishot ops that ran out of buffers, waiting to be re-armed
+  __u64 *parked;
+  unsigned parked_count;
+  unsigned parked_capacity;
+
+  unsigned enobufs;
+
+  // number of pending ops using the buffer ring
+  unsigned ops;
+};
+
+// Buffer rings are kept in an array of pointers indexed by buffer group id,
+// which grows as needed. The id of a freed buffer ring is reused.
+#define BUFFER_RING_INITIAL_CAPACITY  16
+#define BUFFER_RING_MAX_COUNT         65536
+#define HUGE_PAGE_SIZE                (2UL << 20)
+
+// Registered (fixed) buffers are slices of a single page-aligned IO::Buffer,
+// which is kept alive both by the ring and by the slices.
+struct fixed_buffers {
+  VALUE backing;
+  char *base;
+  unsigned count;
+  unsigned size;
+};
+
+// Pending ops are kept in a slab of slots, each holding the op's OpCtx. The
+// user_data of each submitted SQE holds the op id in its upper 32 bits and the
+// slot index in its lower 32 bits. The op id doubles as the slot generation,
+// so a CQE for a slot that has since been reused is detected as stale.
+struct op_slot {
+  VALUE ctx;
+  unsigned id;
+  unsigned next_free;
+};
+
+struct op_table {
+  struct op_slot *slots;
+  unsigned capacity;
+  unsigned count;
+  unsigned free_head;
 };
 
-#define BUFFER_RING_MAX_COUNT 10
+#define OP_TABLE_INITIAL_CAPACITY 256
+#define OP_SLOT_NONE              0xFFFFFFFFU
+
+// Slots used in the user_data of messages sent from other rings using
+// IORING_OP_MSG_RING. The id is the id of the op on the sending ring.
+#define OP_SLOT_MSG               0xFFFFFFFEU
+#define OP_SLOT_MSG_FD            0xFFFFFFFDU
+
+#define OP_USER_DATA(id, slot)        (((__u64)(id) << 32) | (__u64)(slot))
+#define OP_USER_DATA_ID(user_data)    ((unsigned)((user_data) >> 32))
+#define OP_USER_DATA_SLOT(user_data)  ((unsigned)((user_data) & 0xFFFFFFFFU))
+
+// user_data for internal SQEs (e.g. linked timeouts), whose CQEs are not
+// yielded. Op ids start at 1, so this never matches an op.
+#define OP_USER_DATA_INTERNAL         OP_USER_DATA(0, OP_SLOT_NONE)
+
+// SQEs that don't fit in the SQ are kept in a queue of fixed size chunks, so
+// pointers to queued SQEs remain valid as the queue grows.
+#define SQE_CHUNK_SIZE 256
+
+struct sqe_chunk {
+  struct sqe_chunk *next;
+  unsigned head;
+  unsigned tail;
+  struct io_uring_sqe sqes[SQE_CHUNK_SIZE];
+};
+
+struct sqe_queue {
+  struct sqe_chunk *first;
+  struct sqe_chunk *last;
+  unsigned count;
+};
+
+// Determines what happens when the SQ is full: raise an error, submit the SQ
+// and retry, or put the SQE in a queue that is drained on submission.
+enum sq_overflow {
+  SQ_OVERFLOW_raise,
+  SQ_OVERFLOW_submit,
+  SQ_OVERFLOW_queue
+};
+
+// Determines how completions are yielded: as op spec hashes (the default), as
+// IOU::Completion objects, or as (id, result, flags) values.
+enum completion_mode {
+  CM_hash,
+  CM_object,
+  CM_args
+};
+
+#define STATS_BATCH_BUCKETS 8
+
+// Ring performance counters, returned by Ring#stats. The number of CQEs
+// processed in a single batch is counted in power of two buckets: 1, 2-3,
+// 4-7, ..., 128 and up.
+struct ring_stats {
+  unsigned long long sqes_prepped;
+  unsigned long long sqes_submitted;
+  unsigned long long enter_calls;
+  unsigned long long cqes_processed;
+  unsigned long long cq_batches[STATS_BATCH_BUCKETS];
+  unsigned long long cq_overflow_flushes;
+  unsigned long long enobufs;
+  unsigned long long sq_full;
+  unsigned long long wait_ns;
+};
 
 typedef struct IOURing_t {
+  VALUE           self;
   struct io_uring ring;
   unsigned int    ring_initialized;
+  unsigned int    ring_fd_registered;
   unsigned int    op_counter;
   unsigned int    unsubmitted_sqes;
-  VALUE           pending_ops;
+  struct op_table ops;
+
+  enum sq_overflow sq_overflow;
+  struct sqe_queue sqe_queue;
 
-  struct buf_ring_descriptor brs[BUFFER_RING_MAX_COUNT];
+  enum completion_mode completion_mode;
+
+  struct buf_ring_descriptor **brs;
+  unsigned int br_capacity;
   unsigned int br_counter;
+  // set when a view finalizer returns a buffer to a ring with parked ops
+  unsigned int rearm_pending;
+
+  // completions posted from userspace (for cancelled parked ops), processed
+  // ahead of CQEs
+  struct io_uring_cqe *posted_cqes;
+  unsigned int posted_count;
+  unsigned int posted_capacity;
+
+  unsigned int    file_table_size;
+  struct fixed_buffers fbs;
+
+  struct ring_stats stats;
 } IOURing_t;
 
 struct sa_data {
-  struct sockaddr addr;
+  struct sockaddr_storage addr;
   socklen_t len;
 };
 
+// message header for recvmsg and sendmsg ops. The control buffer is used for
+// control messages added to sent messages (e.g. UDP_SEGMENT).
+struct msg_data {
+  struct msghdr hdr;
+  struct sockaddr_storage addr;
+  union {
+    char buf[CMSG_SPACE(sizeof(uint16_t))];
+    struct cmsghdr align;
+  } control;
+};
+
 struct read_data {
   VALUE buffer;
   int buffer_offset;
   unsigned bg_id;
   int utf8_encoding;
+  int bundle;
+  int view;
+  int multishot;
+  int fd;
+  int fixed;
+  int uses_bg;
 };
 
 enum op_type {
   OP_accept,
   OP_cancel,
   OP_close,
+  OP_connect,
   OP_emit,
+  OP_fallocate,
+  OP_fsync,
   OP_nop,
+  OP_openat,
+  OP_poll,
   OP_read,
+  OP_readv,
+  OP_recv,
+  OP_recvmsg,
+  OP_send,
+  OP_send_fd,
+  OP_send_msg,
+  OP_sendmsg,
+  OP_shutdown,
+  OP_socket,
+  OP_splice,
+  OP_statx,
+  OP_tee,
   OP_timeout,
-  OP_write
+  OP_unlinkat,
+  OP_write,
+  OP_writev
 };
 
 typedef struct OpCtx_t {
   enum op_type type;
   VALUE spec;
   VALUE proc;
+  VALUE completion;
   union {
     struct __kernel_timespec ts;
     struct sa_data sa;
     struct read_data rd;
   } data;
+  struct __kernel_timespec link_ts;
   int stop_signal;
+
+  // iovecs for vectored ops, kept for reuse by subsequent ops
+  struct iovec *iovecs;
+  unsigned iov_count;
+  unsigned iov_capacity;
+
+  // statx result buffer, kept for reuse by subsequent ops
+  struct statx *stx;
+
+  // message header for recvmsg and sendmsg ops, kept for reuse as well
+  struct msg_data *msg;
 } OpCtx_t;
 
+typedef struct Completion_t {
+  unsigned id;
+  int result;
+  unsigned flags;
+  VALUE op;
+  VALUE spec;
+  VALUE buffer;
+} Completion_t;
+
+typedef struct Scheduler_t {
+  VALUE     ring;
+  IOURing_t *iour;
+  VALUE     thread;
+
+  // runnable fibers, stored as (fiber, value) pairs
+  VALUE     runqueue;
+
+  // fibers waiting for an op completion or for #unblock
+  VALUE     waiting;
+
+  // eventfd used for waking up the scheduler from other threads
+  int       wakeup_fd;
+  __u64     wakeup_value;
+} Scheduler_t;
+
 extern VALUE mIOU;
+extern VALUE cRing;
 extern VALUE cOpCtx;
+extern VALUE cCompletion;
+extern VALUE cScheduler;
+
+IOURing_t *get_iou(VALUE self);
+struct io_uring_sqe *IOURing_get_sqes(IOURing_t *iour, unsigned count);
+void IOURing_link_timeout(IOURing_t *iour, VALUE ctx, struct io_uring_sqe *sqe, VALUE timeout);
+VALUE IOURing_track_op(IOURing_t *iour, enum op_type type, VALUE proc, __u64 *user_data);
+VALUE IOURing_op_proc(IOURing_t *iour, __u64 user_data);
+void IOURing_release_op(IOURing_t *iour, __u64 user_data);
+void IOURing_cancel_op(IOURing_t *iour, __u64 user_data);
+void IOURing_submit_and_wait(IOURing_t *iour, unsigned wait_nr);
+void IOURing_count_cqes(IOURing_t *iour, unsigned count);
+
+// Handles a single CQE, returning non-zero to stop handling further CQEs.
+typedef int (*cqe_handler_t)(IOURing_t *iour, struct io_uring_cqe *cqe, void *arg);
+unsigned IOURing_drain_cqes(IOURing_t *iour, unsigned max, cqe_handler_t handler, void *arg);
+
+VALUE Completion_new(void);
+void Completion_update(VALUE self, unsigned id, VALUE op, int result, unsigned flags, VALUE spec, VALUE buffer);
+
+VALUE OpCtx_new(VALUE spec, VALUE proc);
+VALUE OpCtx_initialize(VALUE self, VALUE spec, VALUE proc);
+void OpCtx_release(VALUE self);
 
 enum op_type OpCtx_type_get(VALUE self);
 void OpCtx_type_set(VALUE self, enum op_type type);
 
 VALUE OpCtx_spec_get(VALUE self);
 VALUE OpCtx_proc_get(VALUE self);
+VALUE OpCtx_completion_get(VALUE self);
+
+struct __kernel_timespec value_to_timespec(VALUE value);
 
 struct __kernel_timespec *OpCtx_ts_get(VALUE self);
 void OpCtx_ts_set(VALUE self, VALUE value);
@@ -95,6 +339,14 @@ struct sa_data *OpCtx_sa_get(VALUE self);
 struct read_data *OpCtx_rd_get(VALUE self);
 void OpCtx_rd_set(VALUE self, VALUE buffer, int buffer_offset, unsigned bg_id, int utf8_encoding);
 
+struct __kernel_timespec *OpCtx_link_ts_get(VALUE self);
+
+struct iovec *OpCtx_iovecs_alloc(VALUE self, unsigned count);
+struct iovec *OpCtx_iovecs_get(VALUE self, unsigned *count);
+
+struct statx *OpCtx_statx_get(VALUE self);
+struct msg_data *OpCtx_msg_get(VALUE self);
+
 int OpCtx_stop_signal_p(VALUE self);
 void OpCtx_stop_signal_set(VALUE self);
 
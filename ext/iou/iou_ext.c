@@ -2,8 +2,12 @@
 
 void Init_IOURing();
 void Init_OpCtx();
+void Init_Completion();
+void Init_Scheduler();
 
 void Init_iou_ext(void) {
   Init_IOURing();
   Init_OpCtx();
+  Init_Completion();
+  Init_Scheduler();
 }
@@ -2,9 +2,23 @@
 
 VALUE cOpCtx;
 
-inline int is_read_op_p(OpCtx_t *ctx) {
+// read, recv, send and write ops hold a reference to their buffer in
+// ctx->data.rd. For vectored ops and sendmsg, this is the array of buffers.
+// For ops on
+// paths (openat, statx, unlinkat), this is the path.
+inline int is_buffer_op_p(OpCtx_t *ctx) {
   switch (ctx->type) {
+    case OP_openat:
     case OP_read:
+    case OP_readv:
+    case OP_recv:
+    case OP_recvmsg:
+    case OP_send:
+    case OP_sendmsg:
+    case OP_statx:
+    case OP_unlinkat:
+    case OP_write:
+    case OP_writev:
       return 1;
     default:
       return 0;
@@ -15,30 +29,60 @@ static void OpCtx_mark(void *ptr) {
   OpCtx_t *ctx = ptr;
   rb_gc_mark_movable(ctx->spec);
   rb_gc_mark_movable(ctx->proc);
-  if (is_read_op_p(ctx))
-    rb_gc_mark_movable(ctx->data.rd.buffer);
+  rb_gc_mark_movable(ctx->completion);
+  // the buffer is pinned, since the kernel holds a pointer to its contents
+  // (for zero-copy sends, until the notification CQE is received)
+  if (is_buffer_op_p(ctx))
+    rb_gc_mark(ctx->data.rd.buffer);
+
+  // the buffers of vectored ops are pinned as well
+  if ((ctx->type == OP_readv || ctx->type == OP_writev || ctx->type == OP_sendmsg) && RB_TYPE_P(ctx->data.rd.buffer, T_ARRAY)) {
+    long len = RARRAY_LEN(ctx->data.rd.buffer);
+    for (long i = 0; i < len; i++)
+      rb_gc_mark(RARRAY_AREF(ctx->data.rd.buffer, i));
+  }
 }
 
 static void OpCtx_compact(void *ptr) {
   OpCtx_t *ctx = ptr;
   ctx->spec = rb_gc_location(ctx->spec);
   ctx->proc = rb_gc_location(ctx->proc);
-  if (is_read_op_p(ctx))
+  ctx->completion = rb_gc_location(ctx->completion);
+  if (is_buffer_op_p(ctx))
     ctx->data.rd.buffer = rb_gc_location(ctx->data.rd.buffer);
 }
 
+static void OpCtx_free(void *ptr) {
+  OpCtx_t *ctx = ptr;
+  xfree(ctx->iovecs);
+  xfree(ctx->stx);
+  xfree(ctx->msg);
+  xfree(ctx);
+}
+
 static size_t OpCtx_size(const void *ptr) {
-  return sizeof(OpCtx_t);
+  const OpCtx_t *ctx = ptr;
+  return sizeof(OpCtx_t) + ctx->iov_capacity * sizeof(struct iovec) +
+    (ctx->stx ? sizeof(struct statx) : 0) + (ctx->msg ? sizeof(struct msg_data) : 0);
 }
 
 static const rb_data_type_t OpCtx_type = {
     "OpCtx",
-    {OpCtx_mark, 0, OpCtx_size, OpCtx_compact},
+    {OpCtx_mark, OpCtx_free, OpCtx_size, OpCtx_compact},
     0, 0, RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_WB_PROTECTED
 };
 
 static VALUE OpCtx_allocate(VALUE klass) {
   OpCtx_t *ctx = ALLOC(OpCtx_t);
+  ctx->type = OP_nop;
+  ctx->spec = Qnil;
+  ctx->proc = Qnil;
+  ctx->completion = Qnil;
+  ctx->iovecs = NULL;
+  ctx->iov_count = 0;
+  ctx->iov_capacity = 0;
+  ctx->stx = NULL;
+  ctx->msg = NULL;
 
   return TypedData_Wrap_Struct(klass, &OpCtx_type, ctx);
 }
@@ -52,6 +96,22 @@ VALUE OpCtx_initialize(VALUE self, VALUE spec, VALUE proc) {
   return self;
 }
 
+VALUE OpCtx_new(VALUE spec, VALUE proc) {
+  VALUE self = OpCtx_allocate(cOpCtx);
+  return OpCtx_initialize(self, spec, proc);
+}
+
+// Clears references held by a ctx of a completed op, so it can be kept around
+// for reuse without retaining the op's spec, proc, buffer or completion object.
+inline void OpCtx_release(VALUE self) {
+  OpCtx_t *ctx = RTYPEDDATA_DATA(self);
+  if (is_buffer_op_p(ctx))
+    ctx->data.rd.buffer = Qnil;
+  ctx->spec = Qnil;
+  ctx->proc = Qnil;
+  ctx->completion = Qnil;
+}
+
 VALUE OpCtx_spec(VALUE self) {
   OpCtx_t *ctx = RTYPEDDATA_DATA(self);
   return ctx->spec;
@@ -77,11 +137,58 @@ inline VALUE OpCtx_proc_get(VALUE self) {
   return ctx->proc;
 }
 
+// The completion object is created on demand and kept until the op is done, so
+// it's reused for all completions of a multishot op, but never handed out for a
+// subsequent op reusing the same ctx.
+VALUE OpCtx_completion_get(VALUE self) {
+  OpCtx_t *ctx = RTYPEDDATA_DATA(self);
+  if (NIL_P(ctx->completion))
+    RB_OBJ_WRITE(self, &ctx->completion, Completion_new());
+  return ctx->completion;
+}
+
 struct __kernel_timespec *OpCtx_ts_get(VALUE self) {
   OpCtx_t *ctx = RTYPEDDATA_DATA(self);
   return &ctx->data.ts;
 }
 
+struct __kernel_timespec *OpCtx_link_ts_get(VALUE self) {
+  OpCtx_t *ctx = RTYPEDDATA_DATA(self);
+  return &ctx->link_ts;
+}
+
+// Returns an iovec array for the given number of buffers, growing the ctx's
+// iovec array if needed.
+struct iovec *OpCtx_iovecs_alloc(VALUE self, unsigned count) {
+  OpCtx_t *ctx = RTYPEDDATA_DATA(self);
+  if (count > ctx->iov_capacity) {
+    REALLOC_N(ctx->iovecs, struct iovec, count);
+    ctx->iov_capacity = count;
+  }
+  ctx->iov_count = count;
+  return ctx->iovecs;
+}
+
+struct iovec *OpCtx_iovecs_get(VALUE self, unsigned *count) {
+  OpCtx_t *ctx = RTYPEDDATA_DATA(self);
+  *count = ctx->iov_count;
+  return ctx->iovecs;
+}
+
+// Returns the statx buffer of the ctx, allocating it if needed.
+struct statx *OpCtx_statx_get(VALUE self) {
+  OpCtx_t *ctx = RTYPEDDATA_DATA(self);
+  if (!ctx->stx) ctx->stx = ALLOC(struct statx);
+  return ctx->stx;
+}
+
+// Returns the message header of the ctx, allocating it if needed.
+struct msg_data *OpCtx_msg_get(VALUE self) {
+  OpCtx_t *ctx = RTYPEDDATA_DATA(self);
+  if (!ctx->msg) ctx->msg = ALLOC(struct msg_data);
+  return ctx->msg;
+}
+
 inline struct __kernel_timespec double_to_timespec(double value) {
   double integral;
   double fraction = modf(value, &integral);
@@ -116,6 +223,10 @@ inline void OpCtx_rd_set(VALUE self, VALUE buffer, int buffer_offset, unsigned b
   ctx->data.rd.buffer_offset = buffer_offset;
   ctx->data.rd.bg_id = bg_id;
   ctx->data.rd.utf8_encoding = utf8_encoding;
+  ctx->data.rd.bundle = 0;
+  ctx->data.rd.view = 0;
+  ctx->data.rd.multishot = 0;
+  ctx->data.rd.uses_bg = 0;
 }
 
 inline int OpCtx_stop_signal_p(VALUE self) {
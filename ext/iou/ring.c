@@ -1,64 +1,242 @@
 #include "iou.h"
 #include "ruby/thread.h"
+#include "ruby/io/buffer.h"
 #include <sys/mman.h>
+#include <poll.h>
+#include <netinet/udp.h>
+
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
 
 VALUE mIOU;
 VALUE cRing;
 
 VALUE SYM_accept;
+VALUE SYM_address;
+VALUE SYM_args;
+VALUE SYM_atime;
+VALUE SYM_blksize;
 VALUE SYM_block;
+VALUE SYM_blocks;
+VALUE SYM_btime;
 VALUE SYM_buffer;
 VALUE SYM_buffer_group;
+VALUE SYM_buffer_index;
 VALUE SYM_buffer_offset;
+VALUE SYM_buffers;
+VALUE SYM_bundle;
 VALUE SYM_close;
+VALUE SYM_cmsgs;
+VALUE SYM_connect;
+VALUE SYM_control_len;
+VALUE SYM_coop_taskrun;
 VALUE SYM_count;
+VALUE SYM_cq_batches;
+VALUE SYM_cq_entries;
+VALUE SYM_cq_overflow_flushes;
+VALUE SYM_cqes_processed;
+VALUE SYM_ctime;
+VALUE SYM_data;
+VALUE SYM_datasync;
+VALUE SYM_defer_taskrun;
+VALUE SYM_dir;
+VALUE SYM_dir_fd;
+VALUE SYM_direct;
+VALUE SYM_domain;
 VALUE SYM_emit;
+VALUE SYM_enobufs;
+VALUE SYM_enter_calls;
+VALUE SYM_entries;
+VALUE SYM_err;
+VALUE SYM_events;
+VALUE SYM_fallocate;
 VALUE SYM_fd;
+VALUE SYM_fd_in;
+VALUE SYM_fd_out;
+VALUE SYM_fixed_fd;
+VALUE SYM_fixed_fd_in;
+VALUE SYM_fixed_fd_out;
+VALUE SYM_flags;
+VALUE SYM_free;
+VALUE SYM_fsync;
+VALUE SYM_gid;
+VALUE SYM_gro_size;
+VALUE SYM_hash;
+VALUE SYM_how;
+VALUE SYM_hugepages;
+VALUE SYM_hup;
 VALUE SYM_id;
+VALUE SYM_in;
+VALUE SYM_in_flight;
+VALUE SYM_incremental;
+VALUE SYM_ino;
 VALUE SYM_interval;
+VALUE SYM_kernel_mapped;
 VALUE SYM_len;
 VALUE SYM_link;
+VALUE SYM_mask;
+VALUE SYM_mlock;
+VALUE SYM_mode;
+VALUE SYM_msg;
+VALUE SYM_msg_fd;
+VALUE SYM_mtime;
 VALUE SYM_multishot;
+VALUE SYM_nlink;
+VALUE SYM_object;
+VALUE SYM_off_in;
+VALUE SYM_off_out;
+VALUE SYM_offset;
+VALUE SYM_on_release;
 VALUE SYM_op;
+VALUE SYM_openat;
+VALUE SYM_out;
+VALUE SYM_parked;
+VALUE SYM_path;
+VALUE SYM_pending_ops;
+VALUE SYM_poll;
+VALUE SYM_pri;
+VALUE SYM_protocol;
+VALUE SYM_queue;
+VALUE SYM_raise;
+VALUE SYM_rdhup;
 VALUE SYM_read;
+VALUE SYM_readv;
+VALUE SYM_recv;
+VALUE SYM_recvmsg;
+VALUE SYM_register_ring_fd;
 VALUE SYM_result;
+VALUE SYM_revents;
+VALUE SYM_segment_size;
+VALUE SYM_send;
+VALUE SYM_send_fd;
+VALUE SYM_send_msg;
+VALUE SYM_sendmsg;
+VALUE SYM_shutdown;
 VALUE SYM_signal;
+VALUE SYM_single_issuer;
 VALUE SYM_size;
+VALUE SYM_socket;
 VALUE SYM_spec_data;
+VALUE SYM_splice;
+VALUE SYM_sq_full;
+VALUE SYM_sq_overflow;
+VALUE SYM_sq_thread_cpu;
+VALUE SYM_sq_thread_idle;
+VALUE SYM_sqes_prepped;
+VALUE SYM_sqes_submitted;
+VALUE SYM_sqpoll;
+VALUE SYM_stat;
+VALUE SYM_statx;
 VALUE SYM_stop;
+VALUE SYM_submit;
+VALUE SYM_submit_all;
+VALUE SYM_target;
+VALUE SYM_tee;
 VALUE SYM_timeout;
+VALUE SYM_timestamp;
+VALUE SYM_type;
+VALUE SYM_uid;
+VALUE SYM_unlinkat;
 VALUE SYM_utf8;
+VALUE SYM_view;
+VALUE SYM_wait_nr;
+VALUE SYM_wait_time;
 VALUE SYM_write;
+VALUE SYM_writev;
+VALUE SYM_zc;
 
 static void IOURing_mark(void *ptr) {
   IOURing_t *iour = ptr;
-  rb_gc_mark_movable(iour->pending_ops);
+  rb_gc_mark_movable(iour->fbs.backing);
+  for (unsigned i = 0; i < iour->ops.capacity; i++)
+    rb_gc_mark_movable(iour->ops.slots[i].ctx);
 }
 
 static void IOURing_compact(void *ptr) {
   IOURing_t *iour = ptr;
-  iour->pending_ops = rb_gc_location(iour->pending_ops);
+  iour->self = rb_gc_location(iour->self);
+  iour->fbs.backing = rb_gc_location(iour->fbs.backing);
+  for (unsigned i = 0; i < iour->ops.capacity; i++)
+    iour->ops.slots[i].ctx = rb_gc_location(iour->ops.slots[i].ctx);
+}
+
+static void sqe_queue_free(struct sqe_queue *queue) {
+  struct sqe_chunk *chunk = queue->first;
+  while (chunk) {
+    struct sqe_chunk *next = chunk->next;
+    xfree(chunk);
+    chunk = next;
+  }
+  queue->first = queue->last = NULL;
+  queue->count = 0;
+}
+
+static inline void buffer_ring_free_buffers(struct buf_ring_descriptor *desc) {
+  if (desc->buf_base)
+    munmap(desc->buf_base, desc->buf_mem_size);
+  desc->buf_base = NULL;
+}
+
+// Unregisters the given buffer ring and frees it. If buffers are still held by
+// views, the descriptor and buffers are kept until the last view is released.
+static void buffer_ring_free(IOURing_t *iour, unsigned bg_id) {
+  struct buf_ring_descriptor *desc = iour->brs[bg_id];
+  if (desc->br)
+    io_uring_free_buf_ring(&iour->ring, desc->br, desc->buf_count, bg_id);
+  desc->br = NULL;
+  xfree(desc->free_bids);
+  desc->free_bids = NULL;
+  xfree(desc->buf_offsets);
+  desc->buf_offsets = NULL;
+  xfree(desc->parked);
+  desc->parked = NULL;
+  desc->parked_count = desc->parked_capacity = 0;
+  if (desc->views) return;
+
+  buffer_ring_free_buffers(desc);
+  xfree(desc);
+  iour->brs[bg_id] = NULL;
 }
 
 void cleanup_iour(IOURing_t *iour) {
+  sqe_queue_free(&iour->sqe_queue);
+  xfree(iour->posted_cqes);
+  iour->posted_cqes = NULL;
+  iour->posted_count = iour->posted_capacity = 0;
   if (!iour->ring_initialized) return;
 
-  for (unsigned i = 0; i < iour->br_counter; i++) {
-    struct buf_ring_descriptor *desc = iour->brs + i;
-    io_uring_free_buf_ring(&iour->ring, desc->br, desc->buf_count, i);
-    free(desc->buf_base);
-  }
-  iour->br_counter = 0;
+  for (unsigned i = 0; i < iour->br_counter; i++)
+    if (iour->brs[i]) buffer_ring_free(iour, i);
+  iour->file_table_size = 0;
+  iour->fbs.count = 0;
   io_uring_queue_exit(&iour->ring);
   iour->ring_initialized = 0;
 }
 
 static void IOU_free(void *ptr) {
-  cleanup_iour((IOURing_t *)ptr);
+  IOURing_t *iour = ptr;
+  cleanup_iour(iour);
+  for (unsigned i = 0; i < iour->br_counter; i++) {
+    if (!iour->brs[i]) continue;
+    buffer_ring_free_buffers(iour->brs[i]);
+    xfree(iour->brs[i]);
+  }
+  xfree(iour->brs);
+  xfree(iour->ops.slots);
+  xfree(iour);
 }
 
 static size_t IOURing_size(const void *ptr) {
-  return sizeof(IOURing_t);
+  const IOURing_t *iour = ptr;
+  return sizeof(IOURing_t) + iour->ops.capacity * sizeof(struct op_slot) +
+    iour->posted_capacity * sizeof(struct io_uring_cqe);
 }
 
 static const rb_data_type_t IOURing_type = {
@@ -68,42 +246,223 @@ static const rb_data_type_t IOURing_type = {
 };
 
 static VALUE IOURing_allocate(VALUE klass) {
-  IOURing_t *iour = ALLOC(IOURing_t);
+  IOURing_t *iour = ZALLOC(IOURing_t);
+
+  VALUE self = TypedData_Wrap_Struct(klass, &IOURing_type, iour);
+  iour->self = self;
+  return self;
+}
 
-  return TypedData_Wrap_Struct(klass, &IOURing_type, iour);
+static void op_table_grow(struct op_table *table, unsigned capacity) {
+  REALLOC_N(table->slots, struct op_slot, capacity);
+  for (unsigned i = table->capacity; i < capacity; i++) {
+    table->slots[i].ctx = Qnil;
+    table->slots[i].id = 0;
+    table->slots[i].next_free = (i + 1 < capacity) ? i + 1 : table->free_head;
+  }
+  table->free_head = table->capacity;
+  table->capacity = capacity;
 }
 
-VALUE IOURing_initialize(VALUE self) {
-  IOURing_t *iour = RTYPEDDATA_DATA(self);
+static void op_table_init(struct op_table *table) {
+  xfree(table->slots);
+  table->slots = NULL;
+  table->capacity = 0;
+  table->count = 0;
+  table->free_head = OP_SLOT_NONE;
+  op_table_grow(table, OP_TABLE_INITIAL_CAPACITY);
+}
 
-  iour->ring_initialized = 0;
-  iour->op_counter = 0;
-  iour->unsubmitted_sqes = 0;
-  iour->br_counter = 0;
+// Takes a slot off the free list. The slot's ctx, if not nil, is an OpCtx left
+// over from a previously completed op, and may be reused.
+static inline struct op_slot *op_table_acquire(struct op_table *table) {
+  if (unlikely(table->free_head == OP_SLOT_NONE))
+    op_table_grow(table, table->capacity * 2);
+
+  struct op_slot *slot = table->slots + table->free_head;
+  table->free_head = slot->next_free;
+  table->count++;
+  return slot;
+}
+
+// Returns the slot for the given user_data, or NULL if the op is not tracked
+// or the slot has since been reused for another op.
+static inline struct op_slot *op_table_get(struct op_table *table, __u64 user_data) {
+  unsigned id = OP_USER_DATA_ID(user_data);
+  unsigned idx = OP_USER_DATA_SLOT(user_data);
+  if (unlikely(idx >= table->capacity)) return NULL;
+
+  struct op_slot *slot = table->slots + idx;
+  return likely(id && slot->id == id) ? slot : NULL;
+}
+
+// Returns the slot to the free list. The ctx is kept in the slot for reuse, but
+// its references to the op spec, proc and buffer are cleared.
+static inline void op_table_release(struct op_table *table, struct op_slot *slot) {
+  slot->id = 0;
+  OpCtx_release(slot->ctx);
+  slot->next_free = table->free_head;
+  table->free_head = slot - table->slots;
+  table->count--;
+}
 
-  RB_OBJ_WRITE(self, &iour->pending_ops, rb_hash_new());
+// Returns the user_data for a pending op given its id. This is a linear scan
+// over the op table (O(capacity)), but it's only used for cancelling and
+// updating ops by id.
+static inline __u64 op_table_user_data_for_id(struct op_table *table, unsigned id) {
+  if (id)
+    for (unsigned i = 0; i < table->capacity; i++)
+      if (table->slots[i].id == id) return OP_USER_DATA(id, i);
 
-  unsigned prepared_limit = 1024;
-  int flags = 0;
+  return OP_USER_DATA(id, OP_SLOT_NONE);
+}
+
+// Returns the next op id. When the counter wraps around, 0 is skipped, since
+// it marks free op slots and untracked completions.
+static inline unsigned next_op_id(IOURing_t *iour) {
+  if (unlikely(!++iour->op_counter)) iour->op_counter = 1;
+  return iour->op_counter;
+}
+
+// Optional setup flags, in the order in which they are dropped if the kernel
+// rejects them.
+static const unsigned optional_setup_flags[] = {
+  IORING_SETUP_DEFER_TASKRUN,
+  IORING_SETUP_SINGLE_ISSUER,
+  IORING_SETUP_SQ_AFF,
+  IORING_SETUP_SQPOLL,
+  IORING_SETUP_COOP_TASKRUN,
+  IORING_SETUP_SUBMIT_ALL,
+  IORING_SETUP_CQSIZE
+};
+
+#define OPTIONAL_SETUP_FLAGS_COUNT (sizeof(optional_setup_flags) / sizeof(unsigned))
+
+static inline unsigned get_setup_opts(VALUE opts, unsigned *entries, struct io_uring_params *params) {
+  unsigned flags = 0;
   #ifdef HAVE_IORING_SETUP_SUBMIT_ALL
   flags |= IORING_SETUP_SUBMIT_ALL;
   #endif
+  if (NIL_P(opts)) goto coop;
+
+  VALUE entries_v = rb_hash_aref(opts, SYM_entries);
+  if (!NIL_P(entries_v))
+    *entries = NUM2UINT(entries_v);
+
+  VALUE cq_entries = rb_hash_aref(opts, SYM_cq_entries);
+  if (!NIL_P(cq_entries)) {
+    flags |= IORING_SETUP_CQSIZE;
+    params->cq_entries = NUM2UINT(cq_entries);
+  }
+
+  int sqpoll = RTEST(rb_hash_aref(opts, SYM_sqpoll));
+  if (sqpoll) {
+    flags |= IORING_SETUP_SQPOLL;
+
+    VALUE cpu = rb_hash_aref(opts, SYM_sq_thread_cpu);
+    if (!NIL_P(cpu)) {
+      flags |= IORING_SETUP_SQ_AFF;
+      params->sq_thread_cpu = NUM2UINT(cpu);
+    }
+
+    VALUE idle = rb_hash_aref(opts, SYM_sq_thread_idle);
+    if (!NIL_P(idle))
+      params->sq_thread_idle = NUM2UINT(idle);
+  }
+
+  #ifdef HAVE_IORING_SETUP_SINGLE_ISSUER
+  if (RTEST(rb_hash_aref(opts, SYM_single_issuer)))
+    flags |= IORING_SETUP_SINGLE_ISSUER;
+  #endif
+
+  // task run flags are not compatible with SQPOLL
+  if (sqpoll) return flags;
+
+  #ifdef HAVE_IORING_SETUP_DEFER_TASKRUN
+  if (RTEST(rb_hash_aref(opts, SYM_defer_taskrun))) {
+    // DEFER_TASKRUN requires SINGLE_ISSUER, and is exclusive with COOP_TASKRUN
+    flags |= IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    return flags;
+  }
+  #endif
+
+coop:
   #ifdef HAVE_IORING_SETUP_COOP_TASKRUN
   flags |= IORING_SETUP_COOP_TASKRUN;
   #endif
+  return flags;
+}
+
+static inline enum sq_overflow get_sq_overflow_opt(VALUE opts) {
+  VALUE policy = NIL_P(opts) ? Qnil : rb_hash_aref(opts, SYM_sq_overflow);
+  if (NIL_P(policy) || policy == SYM_submit)
+    return SQ_OVERFLOW_submit;
+  if (policy == SYM_queue)
+    return SQ_OVERFLOW_queue;
+  if (policy == SYM_raise)
+    return SQ_OVERFLOW_raise;
+
+  rb_raise(rb_eArgError, "Invalid SQ overflow policy %"PRIsVALUE, policy);
+}
+
+VALUE IOURing_initialize(int argc, VALUE *argv, VALUE self) {
+  IOURing_t *iour = RTYPEDDATA_DATA(self);
+  VALUE opts;
+
+  rb_scan_args(argc, argv, "0:", &opts);
+
+  iour->ring_initialized = 0;
+  iour->ring_fd_registered = 0;
+  iour->op_counter = 0;
+  iour->unsubmitted_sqes = 0;
+  iour->br_counter = 0;
+  iour->file_table_size = 0;
+  memset(&iour->fbs, 0, sizeof(iour->fbs));
+  RB_OBJ_WRITE(self, &iour->fbs.backing, Qnil);
+
+  op_table_init(&iour->ops);
+  sqe_queue_free(&iour->sqe_queue);
+  iour->sq_overflow = get_sq_overflow_opt(opts);
+  iour->completion_mode = CM_hash;
+
+  unsigned entries = 1024;
+  struct io_uring_params base_params;
+  memset(&base_params, 0, sizeof(base_params));
+  unsigned flags = get_setup_opts(opts, &entries, &base_params);
+  unsigned dropped = 0;
 
   while (1) {
-    int ret = io_uring_queue_init(prepared_limit, &iour->ring, flags);
+    struct io_uring_params params = base_params;
+    params.flags = flags;
+    int ret = io_uring_queue_init_params(entries, &iour->ring, &params);
     if (likely(!ret)) break;
 
     // if ENOMEM is returned, try with half as much entries
-    if (unlikely(ret == -ENOMEM && prepared_limit > 64))
-      prepared_limit = prepared_limit / 2;
-    else
-      rb_syserr_fail(-ret, strerror(-ret));
+    if (unlikely(ret == -ENOMEM && entries > 64)) {
+      entries = entries / 2;
+      continue;
+    }
+
+    // if the kernel rejects the given flags, drop optional flags one by one
+    if (ret == -EINVAL || ret == -EPERM) {
+      while (dropped < OPTIONAL_SETUP_FLAGS_COUNT && !(flags & optional_setup_flags[dropped]))
+        dropped++;
+      if (dropped < OPTIONAL_SETUP_FLAGS_COUNT) {
+        unsigned flag = optional_setup_flags[dropped++];
+        flags &= ~flag;
+        // without DEFER_TASKRUN, fall back to COOP_TASKRUN
+        if (flag == IORING_SETUP_DEFER_TASKRUN && !(flags & IORING_SETUP_SQPOLL))
+          flags |= IORING_SETUP_COOP_TASKRUN;
+        continue;
+      }
+    }
+    rb_syserr_fail(-ret, strerror(-ret));
   }
   iour->ring_initialized = 1;
 
+  if (!NIL_P(opts) && RTEST(rb_hash_aref(opts, SYM_register_ring_fd)))
+    iour->ring_fd_registered = io_uring_register_ring_fd(&iour->ring) == 1;
+
   return self;
 }
 
@@ -113,6 +472,11 @@ VALUE IOURing_close(VALUE self) {
   return self;
 }
 
+VALUE IOURing_sq_queue_depth(VALUE self) {
+  IOURing_t *iour = RTYPEDDATA_DATA(self);
+  return UINT2NUM(iour->sqe_queue.count);
+}
+
 VALUE IOURing_closed_p(VALUE self) {
   IOURing_t *iour = RTYPEDDATA_DATA(self);
   return iour->ring_initialized ? Qfalse : Qtrue;
@@ -120,7 +484,71 @@ VALUE IOURing_closed_p(VALUE self) {
 
 VALUE IOURing_pending_ops(VALUE self) {
   IOURing_t *iour = RTYPEDDATA_DATA(self);
-  return iour->pending_ops;
+  VALUE ops = rb_hash_new();
+  for (unsigned i = 0; i < iour->ops.capacity; i++) {
+    struct op_slot *slot = iour->ops.slots + i;
+    if (slot->id)
+      rb_hash_aset(ops, UINT2NUM(slot->id), slot->ctx);
+  }
+  RB_GC_GUARD(ops);
+  return ops;
+}
+
+// Returns a hash with the ring's performance counters. :cq_batches holds the
+// number of CQE batches processed by size, in power of two buckets (1, 2-3,
+// 4-7, ..., 128 and up). :wait_time is the time in seconds spent waiting for
+// completions without holding the GVL.
+VALUE IOURing_stats(VALUE self) {
+  IOURing_t *iour = RTYPEDDATA_DATA(self);
+  struct ring_stats *s = &iour->stats;
+
+  VALUE batches = rb_ary_new_capa(STATS_BATCH_BUCKETS);
+  for (int i = 0; i < STATS_BATCH_BUCKETS; i++)
+    rb_ary_push(batches, ULL2NUM(s->cq_batches[i]));
+
+  VALUE stats = rb_hash_new();
+  rb_hash_aset(stats, SYM_sqes_prepped, ULL2NUM(s->sqes_prepped));
+  rb_hash_aset(stats, SYM_sqes_submitted, ULL2NUM(s->sqes_submitted));
+  rb_hash_aset(stats, SYM_enter_calls, ULL2NUM(s->enter_calls));
+  rb_hash_aset(stats, SYM_cqes_processed, ULL2NUM(s->cqes_processed));
+  rb_hash_aset(stats, SYM_cq_batches, batches);
+  rb_hash_aset(stats, SYM_cq_overflow_flushes, ULL2NUM(s->cq_overflow_flushes));
+  rb_hash_aset(stats, SYM_enobufs, ULL2NUM(s->enobufs));
+  rb_hash_aset(stats, SYM_sq_full, ULL2NUM(s->sq_full));
+  rb_hash_aset(stats, SYM_pending_ops, UINT2NUM(iour->ops.count));
+  rb_hash_aset(stats, SYM_wait_time, DBL2NUM(s->wait_ns / 1e9));
+  RB_GC_GUARD(batches);
+  RB_GC_GUARD(stats);
+  return stats;
+}
+
+// Resets the ring's performance counters.
+VALUE IOURing_reset_stats(VALUE self) {
+  IOURing_t *iour = RTYPEDDATA_DATA(self);
+  memset(&iour->stats, 0, sizeof(iour->stats));
+  return self;
+}
+
+VALUE IOURing_completion_mode(VALUE self) {
+  IOURing_t *iour = RTYPEDDATA_DATA(self);
+  switch (iour->completion_mode) {
+    case CM_object: return SYM_object;
+    case CM_args:   return SYM_args;
+    default:        return SYM_hash;
+  }
+}
+
+VALUE IOURing_completion_mode_set(VALUE self, VALUE mode) {
+  IOURing_t *iour = RTYPEDDATA_DATA(self);
+  if (mode == SYM_hash)
+    iour->completion_mode = CM_hash;
+  else if (mode == SYM_object)
+    iour->completion_mode = CM_object;
+  else if (mode == SYM_args)
+    iour->completion_mode = CM_args;
+  else
+    rb_raise(rb_eArgError, "Invalid completion mode %"PRIsVALUE, mode);
+  return mode;
 }
 
 inline IOURing_t *get_iou(VALUE self) {
@@ -130,23 +558,211 @@ inline IOURing_t *get_iou(VALUE self) {
   return iour;
 }
 
-static inline struct io_uring_sqe *get_sqe(IOURing_t *iour) {
-  struct io_uring_sqe *sqe;
-  sqe = io_uring_get_sqe(&iour->ring);
-  if (likely(sqe)) goto done;
+VALUE IOURing_features(VALUE self) {
+  IOURing_t *iour = get_iou(self);
+  unsigned flags = iour->ring.flags;
+
+  VALUE features = rb_hash_new();
+  rb_hash_aset(features, SYM_entries, UINT2NUM(iour->ring.sq.ring_entries));
+  rb_hash_aset(features, SYM_cq_entries, UINT2NUM(iour->ring.cq.ring_entries));
+  rb_hash_aset(features, SYM_sqpoll, (flags & IORING_SETUP_SQPOLL) ? Qtrue : Qfalse);
+  rb_hash_aset(features, SYM_sq_thread_cpu, (flags & IORING_SETUP_SQ_AFF) ? Qtrue : Qfalse);
+  rb_hash_aset(features, SYM_single_issuer, (flags & IORING_SETUP_SINGLE_ISSUER) ? Qtrue : Qfalse);
+  rb_hash_aset(features, SYM_defer_taskrun, (flags & IORING_SETUP_DEFER_TASKRUN) ? Qtrue : Qfalse);
+  rb_hash_aset(features, SYM_coop_taskrun, (flags & IORING_SETUP_COOP_TASKRUN) ? Qtrue : Qfalse);
+  rb_hash_aset(features, SYM_submit_all, (flags & IORING_SETUP_SUBMIT_ALL) ? Qtrue : Qfalse);
+  rb_hash_aset(features, SYM_register_ring_fd, iour->ring_fd_registered ? Qtrue : Qfalse);
+  RB_GC_GUARD(features);
+  return features;
+}
+
+static inline struct io_uring_sqe *sqe_queue_push(struct sqe_queue *queue) {
+  struct sqe_chunk *chunk = queue->last;
+  if (!chunk || chunk->tail == SQE_CHUNK_SIZE) {
+    chunk = ALLOC(struct sqe_chunk);
+    chunk->next = NULL;
+    chunk->head = chunk->tail = 0;
+    if (queue->last)
+      queue->last->next = chunk;
+    else
+      queue->first = chunk;
+    queue->last = chunk;
+  }
+  queue->count++;
+  struct io_uring_sqe *sqe = chunk->sqes + chunk->tail++;
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  return sqe;
+}
+
+static inline struct io_uring_sqe *sqe_queue_peek(struct sqe_queue *queue) {
+  struct sqe_chunk *chunk = queue->first;
+  return chunk->sqes + chunk->head;
+}
+
+static inline void sqe_queue_shift(struct sqe_queue *queue) {
+  struct sqe_chunk *chunk = queue->first;
+  queue->count--;
+  if (++chunk->head < chunk->tail) return;
+
+  queue->first = chunk->next;
+  if (!queue->first) queue->last = NULL;
+  xfree(chunk);
+}
+
+#define SQE_LINK_FLAGS (IOSQE_IO_LINK | IOSQE_IO_HARDLINK)
+
+// Returns the number of SQEs in the link chain at the head of the queue, or 1
+// if the SQE at the head is not linked.
+static inline unsigned sqe_queue_chain_len(struct sqe_queue *queue) {
+  unsigned len = 0;
+  for (struct sqe_chunk *chunk = queue->first; chunk; chunk = chunk->next) {
+    for (unsigned i = chunk->head; i < chunk->tail; i++) {
+      len++;
+      if (!(chunk->sqes[i].flags & SQE_LINK_FLAGS)) return len;
+    }
+  }
+  return len;
+}
+
+static inline unsigned long long monotonic_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Returns true if io_uring_submit makes an io_uring_enter call, following the
+// same logic as liburing: the kernel is entered to submit SQEs (with SQPOLL,
+// only to wake up the SQ thread), or if the CQ needs flushing or task work is
+// pending.
+static inline bool submit_needs_enter(IOURing_t *iour, unsigned ready) {
+  unsigned kflags = IO_URING_READ_ONCE(*iour->ring.sq.kflags);
+  if (kflags & (IORING_SQ_CQ_OVERFLOW | IORING_SQ_TASKRUN)) return true;
+  if (!ready) return false;
+  if (!(iour->ring.flags & IORING_SETUP_SQPOLL)) return true;
+  return kflags & IORING_SQ_NEED_WAKEUP;
+}
+
+// Submits the SQEs in the SQ, updating the submission counters.
+static inline int ring_submit(IOURing_t *iour) {
+  if (submit_needs_enter(iour, io_uring_sq_ready(&iour->ring)))
+    iour->stats.enter_calls++;
+  int ret = io_uring_submit(&iour->ring);
+  if (ret > 0) iour->stats.sqes_submitted += ret;
+  return ret;
+}
+
+// Returns the number of unsubmitted SQEs at the tail of the SQ belonging to a
+// link chain that is not yet terminated.
+static inline unsigned sq_open_chain_len(struct io_uring *ring) {
+  unsigned len = 0;
+  unsigned tail = ring->sq.sqe_tail;
+  while (tail - len != ring->sq.sqe_head) {
+    struct io_uring_sqe *sqe = ring->sq.sqes + ((tail - len - 1) & ring->sq.ring_mask);
+    if (!(sqe->flags & SQE_LINK_FLAGS)) break;
+    len++;
+  }
+  return len;
+}
+
+// Submits the SQ to make room for count SQEs. The kernel terminates a link
+// chain at the end of a submission, so an unterminated chain at the tail of
+// the SQ is held back: its SQEs are left in place and added back to the SQ
+// after submitting. The chain is only split if the SQ cannot hold it together
+// with count more SQEs.
+static int submit_for_space(IOURing_t *iour, unsigned count) {
+  struct io_uring *ring = &iour->ring;
+  unsigned open = sq_open_chain_len(ring);
+  if (open + count > ring->sq.ring_entries) open = 0;
+
+  ring->sq.sqe_tail -= open;
+  int ret = ring_submit(iour);
+  ring->sq.sqe_tail += open;
+  iour->unsubmitted_sqes = open;
+  if (ret >= 0 && (ring->flags & IORING_SETUP_SQPOLL))
+    io_uring_sqring_wait(ring);
+  return ret;
+}
+
+// Moves queued SQEs into the SQ, submitting whenever the SQ fills up. Link
+// chains are moved as a whole, so they are not split between submissions. If
+// no progress can be made (e.g. the SQPOLL thread has not yet consumed the
+// SQ), the remaining SQEs are left in the queue.
+static void flush_sqe_queue(IOURing_t *iour) {
+  while (iour->sqe_queue.count) {
+    unsigned len = sqe_queue_chain_len(&iour->sqe_queue);
+    // a chain that doesn't fit in the SQ is split
+    if (len > iour->ring.sq.ring_entries) len = 1;
+
+    if (io_uring_sq_space_left(&iour->ring) < len) {
+      if (submit_for_space(iour, len) <= 0) return;
+      continue;
+    }
+    while (len--) {
+      *io_uring_get_sqe(&iour->ring) = *sqe_queue_peek(&iour->sqe_queue);
+      sqe_queue_shift(&iour->sqe_queue);
+      iour->unsubmitted_sqes++;
+    }
+  }
+}
 
+// Returns an SQE, making sure there's room for count SQEs, so that the SQEs
+// returned by the following count - 1 calls to get_sqe are adjacent to it.
+static inline struct io_uring_sqe *get_sqes(IOURing_t *iour, unsigned count) {
+  iour->stats.sqes_prepped++;
+
+  // once SQEs are queued, subsequent SQEs are queued as well to preserve order
+  if (unlikely(iour->sqe_queue.count))
+    return sqe_queue_push(&iour->sqe_queue);
+
+  if (likely(io_uring_sq_space_left(&iour->ring) >= count))
+    return io_uring_get_sqe(&iour->ring);
+
+  iour->stats.sq_full++;
+  switch (iour->sq_overflow) {
+    case SQ_OVERFLOW_queue:
+      return sqe_queue_push(&iour->sqe_queue);
+    case SQ_OVERFLOW_submit:
+      submit_for_space(iour, count);
+      if (likely(io_uring_sq_space_left(&iour->ring) >= count))
+        return io_uring_get_sqe(&iour->ring);
+      break;
+    default:
+  }
   rb_raise(rb_eRuntimeError, "Failed to get SQE");
+}
 
-  // TODO: retry getting SQE?
+static inline struct io_uring_sqe *get_sqe(IOURing_t *iour) {
+  return get_sqes(iour, 1);
+}
 
-  // if (likely(backend->pending_sqes))
-  //   io_uring_backend_immediate_submit(backend);
-  // else {
-  //   VALUE resume_value = backend_snooze(&backend->base);
-  //   RAISE_IF_EXCEPTION(resume_value);
-  // }
-done:
-  return sqe;
+// Returns an SQE for an op. If the op has a linked timeout, room is made for
+// the timeout SQE, which must immediately follow the op SQE.
+static inline struct io_uring_sqe *get_op_sqe(IOURing_t *iour, VALUE spec) {
+  return get_sqes(iour, NIL_P(rb_hash_aref(spec, SYM_timeout)) ? 1 : 2);
+}
+
+// Returns the value of the :fd or :fixed_fd keyword argument. fixed is set if
+// the given fd is an index into the registered file table.
+static inline VALUE get_fd_kwarg(VALUE spec, int *fixed) {
+  if (TYPE(spec) != T_HASH)
+    rb_raise(rb_eArgError, "Expected keyword arguments");
+
+  VALUE fd = rb_hash_aref(spec, SYM_fd);
+  *fixed = 0;
+  if (NIL_P(fd)) {
+    fd = rb_hash_aref(spec, SYM_fixed_fd);
+    if (NIL_P(fd))
+      rb_raise(rb_eArgError, "Missing :fd value");
+    *fixed = 1;
+  }
+  return fd;
+}
+
+// Returns the file offset given by the given keyword argument, or -1 (use the
+// current file position, as required for pipes and sockets) if not given.
+static inline int64_t get_offset_kwarg(VALUE spec, VALUE sym) {
+  VALUE off = rb_hash_aref(spec, sym);
+  return NIL_P(off) ? -1 : NUM2LL(off);
 }
 
 static inline void get_required_kwargs(VALUE spec, VALUE *values, int argc, ...) {
@@ -165,308 +781,1929 @@ static inline void get_required_kwargs(VALUE spec, VALUE *values, int argc, ...)
   va_end(ptr);
 }
 
-VALUE IOURing_setup_buffer_ring(VALUE self, VALUE opts) {
-  IOURing_t *iour = get_iou(self);
+// Returns a free buffer group id, growing the buffer ring array if needed.
+static unsigned buffer_ring_alloc_id(IOURing_t *iour) {
+  for (unsigned i = 0; i < iour->br_counter; i++)
+    if (!iour->brs[i]) return i;
 
   if (iour->br_counter == BUFFER_RING_MAX_COUNT)
     rb_raise(rb_eRuntimeError, "Cannot setup more than BUFFER_RING_MAX_COUNT buffer rings");
 
+  if (iour->br_counter == iour->br_capacity) {
+    iour->br_capacity = iour->br_capacity ? iour->br_capacity * 2 : BUFFER_RING_INITIAL_CAPACITY;
+    REALLOC_N(iour->brs, struct buf_ring_descriptor *, iour->br_capacity);
+  }
+  iour->brs[iour->br_counter] = NULL;
+  return iour->br_counter++;
+}
+
+// Maps memory for the buffers of the given buffer ring. With hugepages, an
+// explicit huge page mapping is tried first, falling back to transparent huge
+// pages. Returns 0 or a negative errno value.
+static int buffer_ring_alloc_buffers(struct buf_ring_descriptor *desc, int hugepages, int lock) {
+  size_t size = (size_t)desc->buf_count * desc->buf_size;
+  void *mem = MAP_FAILED;
+
+  if (hugepages) {
+    size_t huge_size = (size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+    mem = mmap(NULL, huge_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (mem != MAP_FAILED) size = huge_size;
+  }
+  if (mem == MAP_FAILED) {
+    mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) return -errno;
+    if (hugepages) madvise(mem, size, MADV_HUGEPAGE);
+  }
+
+  if (lock && mlock(mem, size)) {
+    int err = errno;
+    munmap(mem, size);
+    return -err;
+  }
+
+  desc->buf_base = mem;
+  desc->buf_mem_size = size;
+  return 0;
+}
+
+VALUE IOURing_setup_buffer_ring(VALUE self, VALUE opts) {
+  IOURing_t *iour = get_iou(self);
+
   VALUE values[2];
   get_required_kwargs(opts, values, 2, SYM_count, SYM_size);
-  VALUE count = values[0];
-  VALUE size = values[1];
-
-  struct buf_ring_descriptor *desc = iour->brs + iour->br_counter;
-  desc->buf_count = NUM2UINT(count);
-  desc->buf_size = NUM2UINT(size);
-
-  desc->br_size = sizeof(struct io_uring_buf) * desc->buf_count;
-	void *mapped = mmap(
-    NULL, desc->br_size, PROT_READ | PROT_WRITE,
-		MAP_ANONYMOUS | MAP_PRIVATE, 0, 0
-  );
-  if (mapped == MAP_FAILED)
-    rb_raise(rb_eRuntimeError, "Failed to allocate buffer ring");
-
-  desc->br = (struct io_uring_buf_ring *)mapped;
-  io_uring_buf_ring_init(desc->br);
-
-  unsigned bg_id = iour->br_counter;
-  struct io_uring_buf_reg reg = {
-    .ring_addr = (unsigned long)desc->br,
-		.ring_entries = desc->buf_count,
-		.bgid = bg_id
-  };
-	int ret = io_uring_register_buf_ring(&iour->ring, &reg, 0);
-	if (ret) {
-    munmap(desc->br, desc->br_size);
+  unsigned count = NUM2UINT(values[0]);
+  unsigned size = NUM2UINT(values[1]);
+  int send = RTEST(rb_hash_aref(opts, SYM_send));
+  int incremental = RTEST(rb_hash_aref(opts, SYM_incremental));
+  int hugepages = RTEST(rb_hash_aref(opts, SYM_hugepages));
+  int lock = RTEST(rb_hash_aref(opts, SYM_mlock));
+  int kernel_mapped = RTEST(rb_hash_aref(opts, SYM_kernel_mapped));
+
+  unsigned bg_id = buffer_ring_alloc_id(iour);
+  unsigned flags = (incremental ? IOU_PBUF_RING_INC : 0) | (kernel_mapped ? IOU_PBUF_RING_MMAP : 0);
+
+  // with IOU_PBUF_RING_MMAP the ring memory is allocated by the kernel and
+  // mmapped by liburing, otherwise liburing allocates it
+  int ret;
+  struct io_uring_buf_ring *br = io_uring_setup_buf_ring(&iour->ring, count, bg_id, flags, &ret);
+  if (!br)
     rb_syserr_fail(-ret, strerror(-ret));
-	}
 
-  desc->buf_base = malloc(desc->buf_count * desc->buf_size);
-  if (!desc->buf_base) {
-    io_uring_free_buf_ring(&iour->ring, desc->br, desc->buf_count, bg_id);
-    rb_raise(rb_eRuntimeError, "Failed to allocate buffers");
+  struct buf_ring_descriptor *desc = ZALLOC(struct buf_ring_descriptor);
+  desc->br = br;
+  desc->buf_count = count;
+  desc->buf_size = size;
+  desc->send = send;
+  desc->incremental = incremental;
+
+  ret = buffer_ring_alloc_buffers(desc, hugepages, lock);
+  if (ret) {
+    io_uring_free_buf_ring(&iour->ring, br, count, bg_id);
+    xfree(desc);
+    rb_syserr_fail(-ret, strerror(-ret));
+  }
+  iour->brs[bg_id] = desc;
+
+  if (incremental)
+    desc->buf_offsets = ZALLOC_N(unsigned, desc->buf_count);
+
+  // buffers of a send buffer ring are added to the ring by #buffer_ring_push
+  if (send) {
+    desc->free_bids = ALLOC_N(unsigned, desc->buf_count);
+    for (unsigned i = 0; i < desc->buf_count; i++)
+      desc->free_bids[i] = desc->buf_count - 1 - i;
+    desc->free_count = desc->buf_count;
+    return UINT2NUM(bg_id);
   }
 
   int mask = io_uring_buf_ring_mask(desc->buf_count);
 	for (unsigned i = 0; i < desc->buf_count; i++) {
 		io_uring_buf_ring_add(
-      desc->br, desc->buf_base + i * desc->buf_size, desc->buf_size,
+      desc->br, desc->buf_base + (size_t)i * desc->buf_size, desc->buf_size,
       i, mask, i);
 	}
 	io_uring_buf_ring_advance(desc->br, desc->buf_count);
-  iour->br_counter++;
   return UINT2NUM(bg_id);
 }
 
-static inline VALUE setup_op_ctx(IOURing_t *iour, enum op_type type, VALUE op, VALUE id, VALUE spec) {
-  rb_hash_aset(spec, SYM_id, id);
-  rb_hash_aset(spec, SYM_op, op);
-  VALUE block_proc = rb_block_given_p() ? rb_block_proc() : Qnil;
-  if (block_proc != Qnil)
-    rb_hash_aset(spec, SYM_block, block_proc);
-  VALUE ctx = rb_funcall(cOpCtx, rb_intern("new"), 2, spec, block_proc);
-  OpCtx_type_set(ctx, type);
-  rb_hash_aset(iour->pending_ops, id, ctx);
-  return ctx;
+static inline struct buf_ring_descriptor *get_buffer_ring(IOURing_t *iour, unsigned bg_id) {
+  if (bg_id >= iour->br_counter || !iour->brs[bg_id])
+    rb_raise(rb_eArgError, "Invalid buffer group");
+  return iour->brs[bg_id];
 }
 
-static inline void setup_sqe(struct io_uring_sqe *sqe, int id, VALUE spec) {
-  sqe->user_data = id;
-  sqe->flags = 0;
-  if (spec != Qnil && RTEST(rb_hash_aref(spec, SYM_link)))
-    sqe->flags |= IOSQE_IO_LINK;
+// Frees the given buffer ring. The buffer group id may then be reused by a
+// subsequent #setup_buffer_ring.
+VALUE IOURing_free_buffer_ring(VALUE self, VALUE buffer_group) {
+  IOURing_t *iour = get_iou(self);
+  unsigned bg_id = NUM2UINT(buffer_group);
+  struct buf_ring_descriptor *desc = get_buffer_ring(iour, bg_id);
+
+  if (desc->ops || desc->views)
+    rb_raise(rb_eRuntimeError, "Buffer ring is in use");
+
+  buffer_ring_free(iour, bg_id);
+  return self;
 }
 
-VALUE IOURing_emit(VALUE self, VALUE spec) {
+// Copies the given data into free buffers of a send buffer ring, and adds
+// them to the ring, to be sent by #prep_send with bundle: true. Returns the
+// number of bytes added, which is less than the data size if there are not
+// enough free buffers.
+VALUE IOURing_buffer_ring_push(VALUE self, VALUE buffer_group, VALUE data) {
   IOURing_t *iour = get_iou(self);
-  unsigned id_i = ++iour->op_counter;
-  VALUE id = UINT2NUM(id_i);
+  struct buf_ring_descriptor *desc = get_buffer_ring(iour, NUM2UINT(buffer_group));
+  Check_Type(data, T_STRING);
+  if (!desc->send)
+    rb_raise(rb_eArgError, "Not a send buffer group");
 
-  struct io_uring_sqe *sqe = get_sqe(iour);
-  sqe->user_data = id_i;
-  VALUE ctx = setup_op_ctx(iour, OP_emit, SYM_emit, id, spec);
-  if (rb_hash_aref(spec, SYM_signal) == SYM_stop)
-    OpCtx_stop_signal_set(ctx);
+  const char *src = RSTRING_PTR(data);
+  size_t left = RSTRING_LEN(data);
+  int mask = io_uring_buf_ring_mask(desc->buf_count);
+  int added = 0;
+  while (left && desc->free_count) {
+    unsigned bid = desc->free_bids[--desc->free_count];
+    unsigned len = left < desc->buf_size ? left : desc->buf_size;
+    char *dest = desc->buf_base + (size_t)bid * desc->buf_size;
+    memcpy(dest, src, len);
+    io_uring_buf_ring_add(desc->br, dest, len, bid, mask, added++);
+    src += len;
+    left -= len;
+  }
+  io_uring_buf_ring_advance(desc->br, added);
+  RB_GC_GUARD(data);
+  return SIZET2NUM(RSTRING_LEN(data) - left);
+}
 
-  io_uring_prep_nop(sqe);
+// Returns a hash with the buffer ring's size and usage counters. For send
+// buffer rings, in-flight buffers are those added by #buffer_ring_push and not
+// yet sent. For other buffer rings, these are buffers held by views.
+VALUE IOURing_buffer_ring_stats(VALUE self, VALUE buffer_group) {
+  IOURing_t *iour = get_iou(self);
+  struct buf_ring_descriptor *desc = get_buffer_ring(iour, NUM2UINT(buffer_group));
+  unsigned in_flight = desc->send ? desc->buf_count - desc->free_count : desc->views;
+
+  VALUE stats = rb_hash_new();
+  rb_hash_aset(stats, SYM_count, UINT2NUM(desc->buf_count));
+  rb_hash_aset(stats, SYM_size, UINT2NUM(desc->buf_size));
+  rb_hash_aset(stats, SYM_free, UINT2NUM(desc->buf_count - in_flight));
+  rb_hash_aset(stats, SYM_in_flight, UINT2NUM(in_flight));
+  rb_hash_aset(stats, SYM_enobufs, UINT2NUM(desc->enobufs));
+  rb_hash_aset(stats, SYM_parked, UINT2NUM(desc->parked_count));
+  RB_GC_GUARD(stats);
+  return stats;
+}
 
-  // immediately submit
-  io_uring_submit(&iour->ring);
-  iour->unsubmitted_sqes = 0;
+// A bundle spans contiguous buffer ring entries, starting with the buffer given
+// in the CQE flags. That buffer is normally found at the ring head, but the
+// head is advanced to it if entries were skipped. If it's not found, the head is
+// left as is, since raising would leave the CQE unconsumed.
+static inline void bundle_start(struct buf_ring_descriptor *desc, struct io_uring_cqe *cqe) {
+  unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+  int mask = io_uring_buf_ring_mask(desc->buf_count);
+  for (unsigned i = 0; i < desc->buf_count; i++) {
+    unsigned pos = desc->head + i;
+    if (desc->br->bufs[pos & mask].bid == bid) {
+      desc->head = pos;
+      return;
+    }
+  }
+}
 
-  return id;
+// Returns the buffers consumed by a send bundle to the free stack.
+static inline void release_send_buffers(IOURing_t *iour, VALUE ctx, struct io_uring_cqe *cqe) {
+  if (cqe->res <= 0 || !(cqe->flags & IORING_CQE_F_BUFFER)) return;
+
+  struct buf_ring_descriptor *desc = iour->brs[OpCtx_rd_get(ctx)->bg_id];
+  bundle_start(desc, cqe);
+  int mask = io_uring_buf_ring_mask(desc->buf_count);
+  unsigned left = cqe->res;
+  while (left) {
+    struct io_uring_buf *buf = &desc->br->bufs[desc->head++ & mask];
+    desc->free_bids[desc->free_count++] = buf->bid;
+    left -= left < buf->len ? left : buf->len;
+  }
 }
 
-VALUE IOURing_prep_accept(VALUE self, VALUE spec) {
+// Registers a sparse file table with the given number of slots. Slots are
+// allocated by the kernel for direct accepts and with #register_file, and
+// freed by closing the fixed fd or with #unregister_file.
+VALUE IOURing_register_files(VALUE self, VALUE count) {
   IOURing_t *iour = get_iou(self);
-  unsigned id_i = ++iour->op_counter;
-  VALUE id = UINT2NUM(id_i);
+  unsigned count_i = NUM2UINT(count);
 
-  VALUE values[1];
-  get_required_kwargs(spec, values, 1, SYM_fd);
-  VALUE fd = values[0];
-  VALUE multishot = rb_hash_aref(spec, SYM_multishot);
+  if (iour->file_table_size)
+    rb_raise(rb_eRuntimeError, "File table already registered");
 
-  struct io_uring_sqe *sqe = get_sqe(iour);
-  setup_sqe(sqe, id_i, spec);
+  int ret = io_uring_register_files_sparse(&iour->ring, count_i);
+  if (ret < 0)
+    rb_syserr_fail(-ret, strerror(-ret));
 
-  VALUE ctx = setup_op_ctx(iour, OP_accept, SYM_accept, id, spec);
-  struct sa_data *sa = OpCtx_sa_get(ctx);
-  if (RTEST(multishot))
-    io_uring_prep_multishot_accept(sqe, NUM2INT(fd), &sa->addr, &sa->len, 0);
-  else
-    io_uring_prep_accept(sqe, NUM2INT(fd), &sa->addr, &sa->len, 0);
-  iour->unsubmitted_sqes++;
-  return id;
+  ret = io_uring_register_file_alloc_range(&iour->ring, 0, count_i);
+  if (ret < 0) {
+    io_uring_unregister_files(&iour->ring);
+    rb_syserr_fail(-ret, strerror(-ret));
+  }
+
+  iour->file_table_size = count_i;
+  return count;
 }
 
-VALUE prep_cancel_id(IOURing_t *iour, unsigned op_id_i) {
-  unsigned id_i = ++iour->op_counter;
-  VALUE id = UINT2NUM(id_i);
+VALUE IOURing_unregister_files(VALUE self) {
+  IOURing_t *iour = get_iou(self);
+  if (!iour->file_table_size) return self;
 
-  struct io_uring_sqe *sqe = get_sqe(iour);
-  io_uring_prep_cancel64(sqe, op_id_i, 0);
-  sqe->user_data = id_i;
-  iour->unsubmitted_sqes++;
+  int ret = io_uring_unregister_files(&iour->ring);
+  if (ret < 0)
+    rb_syserr_fail(-ret, strerror(-ret));
 
-  return id;
+  iour->file_table_size = 0;
+  return self;
 }
 
-VALUE IOURing_prep_cancel(VALUE self, VALUE spec) {
+// Installs the given fd in a free slot of the registered file table, and
+// returns the slot index, to be used as a fixed fd.
+VALUE IOURing_register_file(VALUE self, VALUE fd) {
   IOURing_t *iour = get_iou(self);
+  int fds[1] = { NUM2INT(fd) };
 
-  if (TYPE(spec) == T_FIXNUM)
-    return prep_cancel_id(iour, NUM2UINT(spec));
-  
-  if (TYPE(spec) != T_HASH)
-    rb_raise(rb_eArgError, "Expected operation id or keyword arguments");
+  if (!iour->file_table_size)
+    rb_raise(rb_eRuntimeError, "File table not registered");
 
-  VALUE id = rb_hash_aref(spec, SYM_id);
-  if (!NIL_P(id))
-    return prep_cancel_id(iour, NUM2UINT(id));
+  int ret = io_uring_register_files_update(&iour->ring, IORING_FILE_INDEX_ALLOC, fds, 1);
+  if (ret < 0)
+    rb_syserr_fail(-ret, strerror(-ret));
 
-  rb_raise(rb_eArgError, "Missing operation id");
+  // the kernel writes the allocated slot index back into fds
+  return INT2NUM(fds[0]);
 }
 
-VALUE IOURing_prep_close(VALUE self, VALUE spec) {
+VALUE IOURing_unregister_file(VALUE self, VALUE fixed_fd) {
   IOURing_t *iour = get_iou(self);
-  unsigned id_i = ++iour->op_counter;
-  VALUE id = UINT2NUM(id_i);
+  int fds[1] = { -1 };
 
-  VALUE values[1];
-  get_required_kwargs(spec, values, 1, SYM_fd);
-  VALUE fd = values[0];
+  if (!iour->file_table_size)
+    rb_raise(rb_eRuntimeError, "File table not registered");
+
+  int ret = io_uring_register_files_update(&iour->ring, NUM2UINT(fixed_fd), fds, 1);
+  if (ret < 0)
+    rb_syserr_fail(-ret, strerror(-ret));
+
+  return self;
+}
+
+// Registers count buffers of the given size with the kernel, and returns an
+// array of IO::Buffer instances for accessing them. The buffers are slices of
+// a single mmapped region, so a size that is a multiple of the page size makes
+// each buffer page-aligned.
+VALUE IOURing_register_buffers(VALUE self, VALUE opts) {
+  IOURing_t *iour = get_iou(self);
+
+  if (iour->fbs.count)
+    rb_raise(rb_eRuntimeError, "Buffers already registered");
+
+  VALUE values[2];
+  get_required_kwargs(opts, values, 2, SYM_count, SYM_size);
+  unsigned count = NUM2UINT(values[0]);
+  unsigned size = NUM2UINT(values[1]);
+  if (!count || !size)
+    rb_raise(rb_eArgError, "Invalid buffer count or size");
+
+  size_t total = (size_t)count * size;
+  VALUE backing = rb_io_buffer_new(NULL, total, RB_IO_BUFFER_MAPPED);
+  void *base;
+  size_t backing_size;
+  rb_io_buffer_get_bytes_for_writing(backing, &base, &backing_size);
+
+  struct iovec *iovecs = ALLOC_N(struct iovec, count);
+  for (unsigned i = 0; i < count; i++) {
+    iovecs[i].iov_base = (char *)base + (size_t)i * size;
+    iovecs[i].iov_len = size;
+  }
+  int ret = io_uring_register_buffers(&iour->ring, iovecs, count);
+  xfree(iovecs);
+  if (ret < 0) {
+    rb_io_buffer_free(backing);
+    rb_syserr_fail(-ret, strerror(-ret));
+  }
+
+  RB_OBJ_WRITE(self, &iour->fbs.backing, backing);
+  iour->fbs.base = base;
+  iour->fbs.count = count;
+  iour->fbs.size = size;
+
+  ID id_slice = rb_intern("slice");
+  VALUE views = rb_ary_new_capa(count);
+  for (unsigned i = 0; i < count; i++)
+    rb_ary_push(views, rb_funcall(backing, id_slice, 2, SIZET2NUM((size_t)i * size), UINT2NUM(size)));
+  RB_GC_GUARD(views);
+  return views;
+}
+
+// Returns a pointer to the region of the registered buffer given by the
+// :buffer_index, :buffer_offset and :len values of the given spec.
+static inline char *get_fixed_buffer(IOURing_t *iour, VALUE spec, unsigned *buf_index, unsigned *len) {
+  *buf_index = NUM2UINT(rb_hash_aref(spec, SYM_buffer_index));
+  if (*buf_index >= iour->fbs.count)
+    rb_raise(rb_eArgError, "Invalid buffer index");
+
+  VALUE buffer_offset = rb_hash_aref(spec, SYM_buffer_offset);
+  unsigned ofs = NIL_P(buffer_offset) ? 0 : NUM2UINT(buffer_offset);
+  VALUE len_v = rb_hash_aref(spec, SYM_len);
+  if (ofs > iour->fbs.size)
+    rb_raise(rb_eArgError, "Buffer offset exceeds buffer size");
+
+  *len = NIL_P(len_v) ? iour->fbs.size - ofs : NUM2UINT(len_v);
+  if (*len > iour->fbs.size - ofs)
+    rb_raise(rb_eArgError, "Length exceeds buffer size");
+
+  return iour->fbs.base + (size_t)*buf_index * iour->fbs.size + ofs;
+}
+
+static inline VALUE store_op_ctx(VALUE self, IOURing_t *iour, enum op_type type, unsigned id, VALUE spec, VALUE proc, __u64 *user_data) {
+  struct op_slot *slot = op_table_acquire(&iour->ops);
+  VALUE ctx = slot->ctx;
+  if (NIL_P(ctx)) {
+    ctx = OpCtx_new(spec, proc);
+    RB_OBJ_WRITE(self, &slot->ctx, ctx);
+  }
+  else
+    OpCtx_initialize(ctx, spec, proc);
+  OpCtx_type_set(ctx, type);
+
+  slot->id = id;
+  *user_data = OP_USER_DATA(id, slot - iour->ops.slots);
+  return ctx;
+}
+
+static inline VALUE setup_op_ctx(VALUE self, IOURing_t *iour, enum op_type type, VALUE op, VALUE id, VALUE spec, __u64 *user_data) {
+  rb_hash_aset(spec, SYM_id, id);
+  rb_hash_aset(spec, SYM_op, op);
+  VALUE block_proc = rb_block_given_p() ? rb_block_proc() : Qnil;
+  if (block_proc != Qnil)
+    rb_hash_aset(spec, SYM_block, block_proc);
+
+  return store_op_ctx(self, iour, type, NUM2UINT(id), spec, block_proc, user_data);
+}
+
+// Sets up an op ctx without a spec hash, for the positional fast-path API.
+// Completions for such ops are yielded as (id, result, flags) values.
+static inline VALUE setup_fast_op_ctx(VALUE self, IOURing_t *iour, enum op_type type, unsigned id, struct io_uring_sqe *sqe) {
+  VALUE block_proc = rb_block_given_p() ? rb_block_proc() : Qnil;
+  return store_op_ctx(self, iour, type, id, Qnil, block_proc, &sqe->user_data);
+}
+
+// Must be called after the io_uring_prep_xxx call, since prep functions reset
+// the SQE flags.
+static inline void setup_sqe(struct io_uring_sqe *sqe, __u64 user_data, VALUE spec) {
+  sqe->user_data = user_data;
+  if (spec != Qnil && RTEST(rb_hash_aref(spec, SYM_link)))
+    sqe->flags |= IOSQE_IO_LINK;
+}
+
+// Links a timeout to the given op SQE, unless the timeout is nil. If the op
+// does not complete in time, it is cancelled and completes with -ECANCELED.
+// The timeout CQE is consumed internally. Must be called after setup_sqe, and
+// after all other SQE flags are set.
+void IOURing_link_timeout(IOURing_t *iour, VALUE ctx, struct io_uring_sqe *sqe, VALUE timeout) {
+  if (NIL_P(timeout)) return;
+
+  struct __kernel_timespec *ts = OpCtx_link_ts_get(ctx);
+  *ts = value_to_timespec(timeout);
+  int link = sqe->flags & IOSQE_IO_LINK;
+  sqe->flags |= IOSQE_IO_LINK;
+
+  // the timeout SQE continues the link chain if the op is linked
+  struct io_uring_sqe *timeout_sqe = get_sqe(iour);
+  io_uring_prep_link_timeout(timeout_sqe, ts, 0);
+  timeout_sqe->user_data = OP_USER_DATA_INTERNAL;
+  if (link) timeout_sqe->flags |= IOSQE_IO_LINK;
+  iour->unsubmitted_sqes++;
+}
+
+static inline void setup_link_timeout(IOURing_t *iour, VALUE ctx, struct io_uring_sqe *sqe, VALUE spec) {
+  IOURing_link_timeout(iour, ctx, sqe, rb_hash_aref(spec, SYM_timeout));
+}
+
+VALUE IOURing_emit(VALUE self, VALUE spec) {
+  IOURing_t *iour = get_iou(self);
+  unsigned id_i = next_op_id(iour);
+  VALUE id = UINT2NUM(id_i);
+
+  struct io_uring_sqe *sqe = get_sqe(iour);
+  VALUE ctx = setup_op_ctx(self, iour, OP_emit, SYM_emit, id, spec, &sqe->user_data);
+  if (rb_hash_aref(spec, SYM_signal) == SYM_stop)
+    OpCtx_stop_signal_set(ctx);
+
+  io_uring_prep_nop(sqe);
+
+  // immediately submit
+  flush_sqe_queue(iour);
+  ring_submit(iour);
+  iour->unsubmitted_sqes = 0;
+
+  return id;
+}
+
+static inline IOURing_t *get_target_iou(VALUE target) {
+  IOURing_t *iour = rb_check_typeddata(target, &IOURing_type);
+  if (!iour->ring_initialized)
+    rb_raise(rb_eRuntimeError, "Target ring was not initialized");
+  return iour;
+}
+
+// Sends a message to the target ring using IORING_OP_MSG_RING. The target ring
+// yields a completion with op :msg, and the given data (a 32-bit integer) as
+// its result. The op completes on this ring once the message is posted.
+VALUE IOURing_send_msg(int argc, VALUE *argv, VALUE self) {
+  IOURing_t *iour = get_iou(self);
+  VALUE target, data;
+
+  rb_scan_args(argc, argv, "11", &target, &data);
+  IOURing_t *target_iour = get_target_iou(target);
+  if (NIL_P(data)) data = INT2FIX(0);
+  int data_i = NUM2INT(data);
+
+  unsigned id_i = next_op_id(iour);
+  VALUE id = UINT2NUM(id_i);
+  VALUE spec = rb_hash_new();
+  rb_hash_aset(spec, SYM_target, target);
+  rb_hash_aset(spec, SYM_data, data);
+
+  struct io_uring_sqe *sqe = get_sqe(iour);
+  __u64 user_data;
+  setup_op_ctx(self, iour, OP_send_msg, SYM_send_msg, id, spec, &user_data);
+
+  io_uring_prep_msg_ring(sqe, target_iour->ring.ring_fd, (unsigned)data_i, OP_USER_DATA(id_i, OP_SLOT_MSG), 0);
+  sqe->user_data = user_data;
+  iour->unsubmitted_sqes++;
+  RB_GC_GUARD(spec);
+  return id;
+}
+
+// Sends a registered file to the target ring using IORING_OP_MSG_RING. The
+// file is installed in a free slot of the target ring's registered file
+// table, and the target ring yields a completion with op :msg_fd, and the
+// slot index as its result. The file remains registered on this ring.
+VALUE IOURing_send_fd(VALUE self, VALUE target, VALUE fixed_fd) {
+  IOURing_t *iour = get_iou(self);
+  IOURing_t *target_iour = get_target_iou(target);
+  int fd_i = NUM2INT(fixed_fd);
+
+  unsigned id_i = next_op_id(iour);
+  VALUE id = UINT2NUM(id_i);
+  VALUE spec = rb_hash_new();
+  rb_hash_aset(spec, SYM_target, target);
+  rb_hash_aset(spec, SYM_fixed_fd, fixed_fd);
+
+  struct io_uring_sqe *sqe = get_sqe(iour);
+  __u64 user_data;
+  setup_op_ctx(self, iour, OP_send_fd, SYM_send_fd, id, spec, &user_data);
+
+  io_uring_prep_msg_ring_fd_alloc(sqe, target_iour->ring.ring_fd, fd_i, OP_USER_DATA(id_i, OP_SLOT_MSG_FD), 0);
+  sqe->user_data = user_data;
+  iour->unsubmitted_sqes++;
+  RB_GC_GUARD(spec);
+  return id;
+}
+
+VALUE IOURing_prep_accept(VALUE self, VALUE spec) {
+  IOURing_t *iour = get_iou(self);
+  unsigned id_i = next_op_id(iour);
+  VALUE id = UINT2NUM(id_i);
+
+  int fixed;
+  VALUE fd = get_fd_kwarg(spec, &fixed);
+  int fd_i = NUM2INT(fd);
+  int multishot = RTEST(rb_hash_aref(spec, SYM_multishot));
+  int direct = RTEST(rb_hash_aref(spec, SYM_direct));
+
+  struct io_uring_sqe *sqe = get_op_sqe(iour, spec);
+  __u64 user_data;
+  VALUE ctx = setup_op_ctx(self, iour, OP_accept, SYM_accept, id, spec, &user_data);
+
+  // with direct: true, the accepted socket is installed in a free slot of the
+  // registered file table, and the slot index is returned as the result. The
+  // peer address is returned only for single-shot accepts, since the address
+  // buffer would be overwritten by subsequent completions of a multishot op.
+  struct sa_data *sa = OpCtx_sa_get(ctx);
+  if (!multishot) sa->len = sizeof(sa->addr);
+  if (direct) {
+    if (multishot)
+      io_uring_prep_multishot_accept_direct(sqe, fd_i, (struct sockaddr *)&sa->addr, &sa->len, 0);
+    else
+      io_uring_prep_accept_direct(sqe, fd_i, (struct sockaddr *)&sa->addr, &sa->len, 0, IORING_FILE_INDEX_ALLOC);
+  }
+  else {
+    if (multishot)
+      io_uring_prep_multishot_accept(sqe, fd_i, (struct sockaddr *)&sa->addr, &sa->len, 0);
+    else
+      io_uring_prep_accept(sqe, fd_i, (struct sockaddr *)&sa->addr, &sa->len, 0);
+  }
+  setup_sqe(sqe, user_data, spec);
+  if (fixed) sqe->flags |= IOSQE_FIXED_FILE;
+  setup_link_timeout(iour, ctx, sqe, spec);
+  iour->unsubmitted_sqes++;
+  return id;
+}
+
+// Re-submits a multishot buffer group op that was terminated with ENOBUFS,
+// using the same user_data, so the op continues under the same id.
+static void rearm_buffer_op(IOURing_t *iour, __u64 user_data) {
+  struct op_slot *slot = op_table_get(&iour->ops, user_data);
+  if (!slot) return;
+
+  VALUE ctx = slot->ctx;
+  struct read_data *rd = OpCtx_rd_get(ctx);
+  struct io_uring_sqe *sqe = get_sqe(iour);
+  enum op_type type = OpCtx_type_get(ctx);
+  if (type == OP_read)
+    io_uring_prep_read_multishot(sqe, rd->fd, 0, -1, rd->bg_id);
+  else if (type == OP_recvmsg) {
+    io_uring_prep_recvmsg_multishot(sqe, rd->fd, &OpCtx_msg_get(ctx)->hdr, 0);
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = rd->bg_id;
+  }
+  else {
+    io_uring_prep_recv_multishot(sqe, rd->fd, NULL, 0, 0);
+    if (rd->bundle)
+      sqe->ioprio |= IORING_RECVSEND_BUNDLE;
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = rd->bg_id;
+  }
+  if (rd->fixed) sqe->flags |= IOSQE_FIXED_FILE;
+  sqe->user_data = user_data;
+  iour->unsubmitted_sqes++;
+}
+
+// Handles a multishot op running out of buffers. If buffers are available
+// (i.e. they were added back to the ring since the kernel ran out), the op is
+// re-armed immediately. Otherwise, it is parked until a view is released.
+static inline void handle_enobufs(IOURing_t *iour, struct buf_ring_descriptor *desc, __u64 user_data) {
+  if (desc->views < desc->buf_count) {
+    rearm_buffer_op(iour, user_data);
+    return;
+  }
+
+  if (desc->parked_count == desc->parked_capacity) {
+    desc->parked_capacity = desc->parked_capacity ? desc->parked_capacity * 2 : 4;
+    REALLOC_N(desc->parked, __u64, desc->parked_capacity);
+  }
+  desc->parked[desc->parked_count++] = user_data;
+}
+
+static inline void rearm_parked_ops(IOURing_t *iour, struct buf_ring_descriptor *desc) {
+  unsigned count = desc->parked_count;
+  desc->parked_count = 0;
+  for (unsigned i = 0; i < count; i++)
+    rearm_buffer_op(iour, desc->parked[i]);
+}
+
+// Re-arms ops parked on buffer rings to which view finalizers returned
+// buffers. Finalizers may run at any point (e.g. while an op is being
+// prepped), so re-arming is deferred to the next submit or process call.
+static inline void rearm_pending_ops(IOURing_t *iour) {
+  if (likely(!iour->rearm_pending)) return;
+
+  iour->rearm_pending = 0;
+  for (unsigned i = 0; i < iour->br_counter; i++) {
+    struct buf_ring_descriptor *desc = iour->brs[i];
+    if (desc && desc->parked_count && desc->views < desc->buf_count)
+      rearm_parked_ops(iour, desc);
+  }
+}
+
+// Removes a parked op, returning 1 if found.
+static int unpark_op(IOURing_t *iour, __u64 user_data) {
+  for (unsigned i = 0; i < iour->br_counter; i++) {
+    struct buf_ring_descriptor *desc = iour->brs[i];
+    if (!desc) continue;
+    for (unsigned j = 0; j < desc->parked_count; j++) {
+      if (desc->parked[j] != user_data) continue;
+
+      desc->parked[j] = desc->parked[--desc->parked_count];
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Posts a completion from userspace, to be processed ahead of the CQEs in the
+// CQ.
+static void post_cqe(IOURing_t *iour, __u64 user_data, int res) {
+  if (iour->posted_count == iour->posted_capacity) {
+    iour->posted_capacity = iour->posted_capacity ? iour->posted_capacity * 2 : 4;
+    REALLOC_N(iour->posted_cqes, struct io_uring_cqe, iour->posted_capacity);
+  }
+  struct io_uring_cqe *cqe = iour->posted_cqes + iour->posted_count++;
+  memset(cqe, 0, sizeof(struct io_uring_cqe));
+  cqe->user_data = user_data;
+  cqe->res = res;
+}
+
+// Removes the first posted completion, copying it to the given CQE.
+static inline void shift_posted_cqe(IOURing_t *iour, struct io_uring_cqe *cqe) {
+  *cqe = iour->posted_cqes[0];
+  iour->posted_count--;
+  memmove(iour->posted_cqes, iour->posted_cqes + 1, iour->posted_count * sizeof(struct io_uring_cqe));
+}
+
+VALUE prep_cancel_id(IOURing_t *iour, unsigned op_id_i) {
+  unsigned id_i = next_op_id(iour);
+  VALUE id = UINT2NUM(id_i);
+
+  __u64 user_data = op_table_user_data_for_id(&iour->ops, op_id_i);
+  struct io_uring_sqe *sqe = get_sqe(iour);
+
+  // a parked op is not known to the kernel, so its final completion is posted
+  // from userspace
+  if (unlikely(unpark_op(iour, user_data))) {
+    post_cqe(iour, user_data, -ECANCELED);
+    io_uring_prep_nop(sqe);
+  }
+  else
+    io_uring_prep_cancel64(sqe, user_data, 0);
+  sqe->user_data = OP_USER_DATA(id_i, OP_SLOT_NONE);
+  iour->unsubmitted_sqes++;
+
+  return id;
+}
+
+// Cancels all pending ops on the given fd.
+VALUE prep_cancel_fd(IOURing_t *iour, int fd, unsigned flags) {
+  unsigned id_i = next_op_id(iour);
+  VALUE id = UINT2NUM(id_i);
+
+  struct io_uring_sqe *sqe = get_sqe(iour);
+  io_uring_prep_cancel_fd(sqe, fd, flags | IORING_ASYNC_CANCEL_ALL);
+  sqe->user_data = OP_USER_DATA(id_i, OP_SLOT_NONE);
+  iour->unsubmitted_sqes++;
+
+  return id;
+}
+
+// Cancels a pending op given its id, or the ops matching the given keyword
+// arguments. Looking up an op by id scans the op table, so its cost is
+// proportional to the number of op slots.
+VALUE IOURing_prep_cancel(VALUE self, VALUE spec) {
+  IOURing_t *iour = get_iou(self);
+
+  if (TYPE(spec) == T_FIXNUM)
+    return prep_cancel_id(iour, NUM2UINT(spec));
+  
+  if (TYPE(spec) != T_HASH)
+    rb_raise(rb_eArgError, "Expected operation id or keyword arguments");
+
+  VALUE id = rb_hash_aref(spec, SYM_id);
+  if (!NIL_P(id))
+    return prep_cancel_id(iour, NUM2UINT(id));
+
+  VALUE fd = rb_hash_aref(spec, SYM_fd);
+  if (!NIL_P(fd))
+    return prep_cancel_fd(iour, NUM2INT(fd), 0);
+
+  fd = rb_hash_aref(spec, SYM_fixed_fd);
+  if (!NIL_P(fd))
+    return prep_cancel_fd(iour, NUM2INT(fd), IORING_ASYNC_CANCEL_FD_FIXED);
+
+  rb_raise(rb_eArgError, "Missing operation id");
+}
+
+VALUE IOURing_prep_close(VALUE self, VALUE spec) {
+  IOURing_t *iour = get_iou(self);
+  unsigned id_i = next_op_id(iour);
+  VALUE id = UINT2NUM(id_i);
+
+  int fixed;
+  VALUE fd = get_fd_kwarg(spec, &fixed);
+  int fd_i = NUM2INT(fd);
+
+  struct io_uring_sqe *sqe = get_sqe(iour);
+  __u64 user_data;
+  setup_op_ctx(self, iour, OP_close, SYM_close, id, spec, &user_data);
+
+  // closing a fixed fd frees its slot in the registered file table
+  if (fixed)
+    io_uring_prep_close_direct(sqe, (unsigned)fd_i);
+  else
+    io_uring_prep_close(sqe, fd_i);
+  setup_sqe(sqe, user_data, spec);
+  iour->unsubmitted_sqes++;
+  return id;
+}
+
+VALUE IOURing_prep_nop(VALUE self) {
+  IOURing_t *iour = get_iou(self);
+  unsigned id_i = next_op_id(iour);
+  VALUE id = UINT2NUM(id_i);
+
+  struct io_uring_sqe *sqe = get_sqe(iour);
+  io_uring_prep_nop(sqe);
+  sqe->user_data = OP_USER_DATA(id_i, OP_SLOT_NONE);
+  iour->unsubmitted_sqes++;
+
+  return id;
+}
+
+static inline void * prepare_read_buffer(VALUE buffer, unsigned len, int ofs) {
+  unsigned current_len = RSTRING_LEN(buffer);
+  if (ofs < 0) ofs = current_len + ofs + 1;
+  unsigned new_len = len + (unsigned)ofs;
+
+  if (current_len < new_len)
+    rb_str_modify_expand(buffer, new_len);
+  else
+    rb_str_modify(buffer);
+  return RSTRING_PTR(buffer) + ofs;
+}
+
+static inline void adjust_read_buffer_len(VALUE buffer, int result, int ofs) {
+  rb_str_modify(buffer);
+  unsigned len = result > 0 ? (unsigned)result : 0;
+  unsigned current_len = RSTRING_LEN(buffer);
+  if (ofs < 0) ofs = current_len + ofs + 1;
+  rb_str_set_len(buffer, len + (unsigned)ofs);
+}
+
+// Marks the op as using its buffer group, which prevents the buffer ring from
+// being freed while the op is pending.
+static inline void buffer_op_acquire(IOURing_t *iour, struct read_data *rd) {
+  rd->uses_bg = 1;
+  iour->brs[rd->bg_id]->ops++;
+}
+
+// Sets the read data needed for re-arming a buffer group op.
+static inline void set_buffer_op_rd(IOURing_t *iour, VALUE ctx, int fd, int fixed, int multishot, int bundle, int view) {
+  struct read_data *rd = OpCtx_rd_get(ctx);
+  rd->fd = fd;
+  rd->fixed = fixed;
+  rd->multishot = multishot;
+  rd->bundle = bundle;
+  rd->view = view;
+  buffer_op_acquire(iour, rd);
+}
+
+// Checks the buffer group of a buffer group op, which must exist and not be
+// a send buffer group.
+static inline void check_buffer_group_op(IOURing_t *iour, unsigned bg_id, int bundle, int view) {
+  struct buf_ring_descriptor *desc = get_buffer_ring(iour, bg_id);
+  if (desc->send)
+    rb_raise(rb_eArgError, "Cannot receive into a send buffer group");
+  if (desc->incremental && (bundle || view))
+    rb_raise(rb_eArgError, "Bundles and views cannot be used with incremental buffer groups");
+}
+
+static inline size_t get_io_buffer_size(VALUE buffer) {
+  const void *base;
+  size_t size;
+  rb_io_buffer_get_bytes_for_reading(buffer, &base, &size);
+  return size;
+}
+
+// Returns a pointer to the region of the given IO::Buffer starting at ofs. IO
+// buffers are used as-is, and are not resized. Mapped buffers are page
+// aligned, making them suitable for I/O on files opened with O_DIRECT.
+static inline void *get_io_buffer_ptr(VALUE buffer, unsigned len, unsigned ofs, int write) {
+  void *base;
+  size_t size;
+  if (write)
+    rb_io_buffer_get_bytes_for_writing(buffer, &base, &size);
+  else
+    rb_io_buffer_get_bytes_for_reading(buffer, (const void **)&base, &size);
+  if ((size_t)ofs + len > size)
+    rb_raise(rb_eArgError, "Length exceeds buffer size");
+  return (char *)base + ofs;
+}
+
+// Reads into a buffer picked by the kernel from the given buffer group. With
+// multishot, the op is repeated until cancelled.
+VALUE prep_read_buffer_group(VALUE self, IOURing_t *iour, VALUE spec) {
+  unsigned id_i = next_op_id(iour);
+  VALUE id = UINT2NUM(id_i);
+
+  int fixed;
+  VALUE fd = get_fd_kwarg(spec, &fixed);
+  VALUE values[1];
+  get_required_kwargs(spec, values, 1, SYM_buffer_group);
+  int fd_i = NUM2INT(fd);
+  unsigned bg_id = NUM2UINT(values[0]);
+  int multishot = RTEST(rb_hash_aref(spec, SYM_multishot));
+  int utf8 = RTEST(rb_hash_aref(spec, SYM_utf8));
+  int view = RTEST(rb_hash_aref(spec, SYM_view));
+  check_buffer_group_op(iour, bg_id, 0, view);
+
+  struct io_uring_sqe *sqe = get_op_sqe(iour, spec);
+  __u64 user_data;
+  VALUE ctx = setup_op_ctx(self, iour, OP_read, SYM_read, id, spec, &user_data);
+  OpCtx_rd_set(ctx, Qnil, 0, bg_id, utf8);
+  set_buffer_op_rd(iour, ctx, fd_i, fixed, multishot, 0, view);
+
+  if (multishot)
+    io_uring_prep_read_multishot(sqe, fd_i, 0, -1, bg_id);
+  else {
+    // a zero length reads up to the size of the selected buffer
+    io_uring_prep_read(sqe, fd_i, NULL, 0, get_offset_kwarg(spec, SYM_offset));
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = bg_id;
+  }
+  setup_sqe(sqe, user_data, spec);
+  if (fixed) sqe->flags |= IOSQE_FIXED_FILE;
+  setup_link_timeout(iour, ctx, sqe, spec);
+  iour->unsubmitted_sqes++;
+  return id;
+}
+
+// Reads into a registered buffer. The data is accessed using the IO::Buffer
+// returned by #register_buffers.
+VALUE prep_read_fixed(VALUE self, IOURing_t *iour, VALUE spec) {
+  unsigned id_i = next_op_id(iour);
+  VALUE id = UINT2NUM(id_i);
+
+  int fixed;
+  int fd_i = NUM2INT(get_fd_kwarg(spec, &fixed));
+  unsigned buf_index, len;
+  char *ptr = get_fixed_buffer(iour, spec, &buf_index, &len);
+
+  struct io_uring_sqe *sqe = get_op_sqe(iour, spec);
+  __u64 user_data;
+  VALUE ctx = setup_op_ctx(self, iour, OP_read, SYM_read, id, spec, &user_data);
+  OpCtx_rd_set(ctx, Qnil, 0, 0, 0);
+
+  io_uring_prep_read_fixed(sqe, fd_i, ptr, len, get_offset_kwarg(spec, SYM_offset), buf_index);
+  setup_sqe(sqe, user_data, spec);
+  if (fixed) sqe->flags |= IOSQE_FIXED_FILE;
+  setup_link_timeout(iour, ctx, sqe, spec);
+  iour->unsubmitted_sqes++;
+  return id;
+}
+
+VALUE IOURing_prep_read(VALUE self, VALUE spec) {
+  IOURing_t *iour = get_iou(self);
+
+  if (RTEST(rb_hash_aref(spec, SYM_multishot)) || !NIL_P(rb_hash_aref(spec, SYM_buffer_group)))
+    return prep_read_buffer_group(self, iour, spec);
+  if (!NIL_P(rb_hash_aref(spec, SYM_buffer_index)))
+    return prep_read_fixed(self, iour, spec);
+
+  unsigned id_i = next_op_id(iour);
+  VALUE id = UINT2NUM(id_i);
+
+  int fixed;
+  VALUE fd = get_fd_kwarg(spec, &fixed);
+  VALUE values[2];
+  get_required_kwargs(spec, values, 2, SYM_buffer, SYM_len);
+
+  VALUE buffer = values[0];
+  VALUE len = values[1];
+  unsigned len_i = NUM2UINT(len);
+
+  VALUE buffer_offset = rb_hash_aref(spec, SYM_buffer_offset);
+  int buffer_offset_i = NIL_P(buffer_offset) ? 0 : NUM2INT(buffer_offset);
+  int utf8 = RTEST(rb_hash_aref(spec, SYM_utf8));
+  int64_t offset = get_offset_kwarg(spec, SYM_offset);
+
+  // the buffer is checked before getting an SQE and an op slot, which would
+  // be left behind if an exception is raised
+  void *ptr = rb_obj_is_kind_of(buffer, rb_cIOBuffer) ?
+    get_io_buffer_ptr(buffer, len_i, buffer_offset_i, 1) :
+    prepare_read_buffer(buffer, len_i, buffer_offset_i);
+
+  struct io_uring_sqe *sqe = get_op_sqe(iour, spec);
+  __u64 user_data;
+  VALUE ctx = setup_op_ctx(self, iour, OP_read, SYM_read, id, spec, &user_data);
+  OpCtx_rd_set(ctx, buffer, buffer_offset_i, 0, utf8);
+
+  io_uring_prep_read(sqe, NUM2INT(fd), ptr, len_i, offset);
+  setup_sqe(sqe, user_data, spec);
+  if (fixed) sqe->flags |= IOSQE_FIXED_FILE;
+  setup_link_timeout(iour, ctx, sqe, spec);
+  iour->unsubmitted_sqes++;
+  return id;
+}
+
+VALUE IOURing_prep_timeout(VALUE self, VALUE spec) {
+  IOURing_t *iour = get_iou(self);
+  unsigned id_i = next_op_id(iour);
+  VALUE id = UINT2NUM(id_i);
+
+  VALUE values[1];
+  get_required_kwargs(spec, values, 1, SYM_interval);
+  VALUE interval = values[0];
+  VALUE multishot = rb_hash_aref(spec, SYM_multishot);
+  unsigned flags = RTEST(multishot) ? IORING_TIMEOUT_MULTISHOT : 0;
+
+  struct io_uring_sqe *sqe = get_sqe(iour);
+  __u64 user_data;
+  VALUE ctx = setup_op_ctx(self, iour, OP_timeout, SYM_timeout, id, spec, &user_data);
+  OpCtx_ts_set(ctx, interval);
+
+  io_uring_prep_timeout(sqe, OpCtx_ts_get(ctx), 0, flags);
+  setup_sqe(sqe, user_data, spec);
+  iour->unsubmitted_sqes++;
+  return id;
+}
+
+// Writes from a registered buffer.
+VALUE prep_write_fixed(VALUE self, IOURing_t *iour, VALUE spec) {
+  unsigned id_i = next_op_id(iour);
+  VALUE id = UINT2NUM(id_i);
+
+  int fixed;
+  int fd_i = NUM2INT(get_fd_kwarg(spec, &fixed));
+  unsigned buf_index, len;
+  char *ptr = get_fixed_buffer(iour, spec, &buf_index, &len);
+
+  struct io_uring_sqe *sqe = get_op_sqe(iour, spec);
+  __u64 user_data;
+  VALUE ctx = setup_op_ctx(self, iour, OP_write, SYM_write, id, spec, &user_data);
+
+  io_uring_prep_write_fixed(sqe, fd_i, ptr, len, get_offset_kwarg(spec, SYM_offset), buf_index);
+  setup_sqe(sqe, user_data, spec);
+  if (fixed) sqe->flags |= IOSQE_FIXED_FILE;
+  setup_link_timeout(iour, ctx, sqe, spec);
+  iour->unsubmitted_sqes++;
+  return id;
+}
+
+VALUE IOURing_prep_write(VALUE self, VALUE spec) {
+  IOURing_t *iour = get_iou(self);
+  if (TYPE(spec) == T_HASH && !NIL_P(rb_hash_aref(spec, SYM_buffer_index)))
+    return prep_write_fixed(self, iour, spec);
+
+  unsigned id_i = next_op_id(iour);
+  VALUE id = UINT2NUM(id_i);
+
+  int fixed;
+  VALUE fd = get_fd_kwarg(spec, &fixed);
+  VALUE values[1];
+  get_required_kwargs(spec, values, 1, SYM_buffer);
+  VALUE buffer = values[0];
+  VALUE len = rb_hash_aref(spec, SYM_len);
+  int64_t offset = get_offset_kwarg(spec, SYM_offset);
+
+  // the buffer is checked before getting an SQE and an op slot, which would
+  // be left behind if an exception is raised
+  void *ptr;
+  unsigned nbytes;
+  if (rb_obj_is_kind_of(buffer, rb_cIOBuffer)) {
+    VALUE buffer_offset = rb_hash_aref(spec, SYM_buffer_offset);
+    unsigned ofs = NIL_P(buffer_offset) ? 0 : NUM2UINT(buffer_offset);
+    size_t size = get_io_buffer_size(buffer);
+    if (ofs > size)
+      rb_raise(rb_eArgError, "Offset exceeds buffer size");
+    nbytes = NIL_P(len) ? size - ofs : NUM2UINT(len);
+    ptr = get_io_buffer_ptr(buffer, nbytes, ofs, 0);
+  }
+  else {
+    ptr = RSTRING_PTR(buffer);
+    nbytes = NIL_P(len) ? RSTRING_LEN(buffer) : NUM2UINT(len);
+  }
+
+  struct io_uring_sqe *sqe = get_op_sqe(iour, spec);
+  __u64 user_data;
+  VALUE ctx = setup_op_ctx(self, iour, OP_write, SYM_write, id, spec, &user_data);
+  // the buffer is held by the ctx, since the spec may be reused while the op
+  // is in flight
+  OpCtx_rd_set(ctx, buffer, 0, 0, 0);
+
+  io_uring_prep_write(sqe, NUM2INT(fd), ptr, nbytes, offset);
+  setup_sqe(sqe, user_data, spec);
+  if (fixed) sqe->flags |= IOSQE_FIXED_FILE;
+  setup_link_timeout(iour, ctx, sqe, spec);
+  iour->unsubmitted_sqes++;
+  return id;
+}
+
+// Checks the buffers given to a vectored op. For reads, len is either an
+// integer, or an array of integers, one per buffer.
+static inline unsigned check_iov_buffers(VALUE buffers, VALUE len, int read) {
+  Check_Type(buffers, T_ARRAY);
+  long count = RARRAY_LEN(buffers);
+  if (count == 0 || count > IOV_MAX)
+    rb_raise(rb_eArgError, "Invalid number of buffers");
+
+  for (long i = 0; i < count; i++) {
+    VALUE buffer = RARRAY_AREF(buffers, i);
+    Check_Type(buffer, T_STRING);
+    if (read) rb_check_frozen(buffer);
+  }
+  if (read) {
+    if (RB_TYPE_P(len, T_ARRAY)) {
+      if (RARRAY_LEN(len) != count)
+        rb_raise(rb_eArgError, "Number of lengths does not match number of buffers");
+      for (long i = 0; i < count; i++) NUM2UINT(RARRAY_AREF(len, i));
+    }
+    else
+      NUM2UINT(len);
+  }
+  return (unsigned)count;
+}
+
+// Fills the ctx iovecs with the given buffers. Buffers read into are expanded
+// as needed.
+static inline struct iovec *setup_iovecs(VALUE ctx, VALUE buffers, unsigned count, VALUE len, int read) {
+  struct iovec *iovecs = OpCtx_iovecs_alloc(ctx, count);
+  for (unsigned i = 0; i < count; i++) {
+    VALUE buffer = RARRAY_AREF(buffers, i);
+    if (read) {
+      unsigned len_i = NUM2UINT(RB_TYPE_P(len, T_ARRAY) ? RARRAY_AREF(len, i) : len);
+      iovecs[i].iov_base = prepare_read_buffer(buffer, len_i, 0);
+      iovecs[i].iov_len = len_i;
+    }
+    else {
+      iovecs[i].iov_base = RSTRING_PTR(buffer);
+      iovecs[i].iov_len = RSTRING_LEN(buffer);
+    }
+  }
+  return iovecs;
+}
+
+// Reads into multiple buffers. The data read is distributed among the buffers
+// in order, and their lengths are adjusted on completion.
+VALUE IOURing_prep_readv(VALUE self, VALUE spec) {
+  IOURing_t *iour = get_iou(self);
+  unsigned id_i = next_op_id(iour);
+  VALUE id = UINT2NUM(id_i);
+
+  int fixed;
+  int fd_i = NUM2INT(get_fd_kwarg(spec, &fixed));
+  VALUE values[2];
+  get_required_kwargs(spec, values, 2, SYM_buffers, SYM_len);
+  VALUE buffers = values[0];
+  unsigned count = check_iov_buffers(buffers, values[1], 1);
+
+  struct io_uring_sqe *sqe = get_op_sqe(iour, spec);
+  __u64 user_data;
+  VALUE ctx = setup_op_ctx(self, iour, OP_readv, SYM_readv, id, spec, &user_data);
+  OpCtx_rd_set(ctx, buffers, 0, 0, 0);
+  struct iovec *iovecs = setup_iovecs(ctx, buffers, count, values[1], 1);
+
+  io_uring_prep_readv(sqe, fd_i, iovecs, count, get_offset_kwarg(spec, SYM_offset));
+  setup_sqe(sqe, user_data, spec);
+  if (fixed) sqe->flags |= IOSQE_FIXED_FILE;
+  setup_link_timeout(iour, ctx, sqe, spec);
+  iour->unsubmitted_sqes++;
+  return id;
+}
+
+// Writes multiple buffers, without concatenating them. The buffers must not
+// be modified until the op is complete.
+VALUE IOURing_prep_writev(VALUE self, VALUE spec) {
+  IOURing_t *iour = get_iou(self);
+  unsigned id_i = next_op_id(iour);
+  VALUE id = UINT2NUM(id_i);
+
+  int fixed;
+  int fd_i = NUM2INT(get_fd_kwarg(spec, &fixed));
+  VALUE values[1];
+  get_required_kwargs(spec, values, 1, SYM_buffers);
+  VALUE buffers = values[0];
+  unsigned count = check_iov_buffers(buffers, Qnil, 0);
+
+  struct io_uring_sqe *sqe = get_op_sqe(iour, spec);
+  __u64 user_data;
+  VALUE ctx = setup_op_ctx(self, iour, OP_writev, SYM_writev, id, spec, &user_data);
+  OpCtx_rd_set(ctx, buffers, 0, 0, 0);
+  struct iovec *iovecs = setup_iovecs(ctx, buffers, count, Qnil, 0);
+
+  io_uring_prep_writev(sqe, fd_i, iovecs, count, get_offset_kwarg(spec, SYM_offset));
+  setup_sqe(sqe, user_data, spec);
+  if (fixed) sqe->flags |= IOSQE_FIXED_FILE;
+  setup_link_timeout(iour, ctx, sqe, spec);
+  iour->unsubmitted_sqes++;
+  return id;
+}
+
+// Returns the value of a splice/tee fd keyword argument, given either as a
+// raw fd (e.g. fd_in:) or as a direct descriptor (e.g. fixed_fd_in:).
+static inline int get_splice_fd_kwarg(VALUE spec, VALUE sym, VALUE fixed_sym, int *fixed) {
+  VALUE fd = rb_hash_aref(spec, sym);
+  *fixed = 0;
+  if (NIL_P(fd)) {
+    fd = rb_hash_aref(spec, fixed_sym);
+    if (NIL_P(fd))
+      rb_raise(rb_eArgError, "Missing %"PRIsVALUE" value", sym);
+    *fixed = 1;
+  }
+  return NUM2INT(fd);
+}
+
+static inline void prep_splice_or_tee(VALUE self, VALUE spec, enum op_type type, VALUE op, VALUE id) {
+  IOURing_t *iour = get_iou(self);
+
+  if (TYPE(spec) != T_HASH)
+    rb_raise(rb_eArgError, "Expected keyword arguments");
+
+  int fixed_in, fixed_out;
+  int fd_in = get_splice_fd_kwarg(spec, SYM_fd_in, SYM_fixed_fd_in, &fixed_in);
+  int fd_out = get_splice_fd_kwarg(spec, SYM_fd_out, SYM_fixed_fd_out, &fixed_out);
+  VALUE values[1];
+  get_required_kwargs(spec, values, 1, SYM_len);
+  unsigned len = NUM2UINT(values[0]);
+  unsigned flags = fixed_in ? SPLICE_F_FD_IN_FIXED : 0;
+
+  struct io_uring_sqe *sqe = get_op_sqe(iour, spec);
+  __u64 user_data;
+  VALUE ctx = setup_op_ctx(self, iour, type, op, id, spec, &user_data);
+
+  if (type == OP_tee)
+    io_uring_prep_tee(sqe, fd_in, fd_out, len, flags);
+  else {
+    int64_t off_in = get_offset_kwarg(spec, SYM_off_in);
+    int64_t off_out = get_offset_kwarg(spec, SYM_off_out);
+    io_uring_prep_splice(sqe, fd_in, off_in, fd_out, off_out, len, flags);
+  }
+  setup_sqe(sqe, user_data, spec);
+  if (fixed_out) sqe->flags |= IOSQE_FIXED_FILE;
+  setup_link_timeout(iour, ctx, sqe, spec);
+  iour->unsubmitted_sqes++;
+}
+
+// Moves data between two fds, at least one of which must be a pipe, without
+// copying it to userspace. The result is the number of bytes moved.
+VALUE IOURing_prep_splice(VALUE self, VALUE spec) {
+  IOURing_t *iour = get_iou(self);
+  VALUE id = UINT2NUM(next_op_id(iour));
+  prep_splice_or_tee(self, spec, OP_splice, SYM_splice, id);
+  return id;
+}
+
+// Duplicates data from one pipe to another, without consuming it.
+VALUE IOURing_prep_tee(VALUE self, VALUE spec) {
+  IOURing_t *iour = get_iou(self);
+  VALUE id = UINT2NUM(next_op_id(iour));
+  prep_splice_or_tee(self, spec, OP_tee, SYM_tee, id);
+  return id;
+}
+
+// Returns a NUL-terminated copy of the given path. The copy is held by the op
+// ctx until the op is complete, so it can be neither modified nor moved.
+static inline VALUE get_path_kwarg(VALUE spec) {
+  VALUE values[1];
+  get_required_kwargs(spec, values, 1, SYM_path);
+  return rb_str_new_cstr(StringValueCStr(values[0]));
+}
+
+static inline int get_dir_fd_kwarg(VALUE spec) {
+  VALUE dir_fd = rb_hash_aref(spec, SYM_dir_fd);
+  return NIL_P(dir_fd) ? AT_FDCWD : NUM2INT(dir_fd);
+}
+
+// Opens the file at the given path, relative to dir_fd: (or the current
+// directory). flags: and mode: are as in open(2). The result is the new fd,
+// or with direct: true, the index of the slot in the registered file table
+// the file was installed in.
+VALUE IOURing_prep_openat(VALUE self, VALUE spec) {
+  IOURing_t *iour = get_iou(self);
+  unsigned id_i = next_op_id(iour);
+  VALUE id = UINT2NUM(id_i);
+
+  if (TYPE(spec) != T_HASH)
+    rb_raise(rb_eArgError, "Expected keyword arguments");
+
+  VALUE path = get_path_kwarg(spec);
+  int dir_fd = get_dir_fd_kwarg(spec);
+  VALUE flags = rb_hash_aref(spec, SYM_flags);
+  int flags_i = NIL_P(flags) ? O_RDONLY : NUM2INT(flags);
+  VALUE mode = rb_hash_aref(spec, SYM_mode);
+  mode_t mode_i = NIL_P(mode) ? 0644 : NUM2UINT(mode);
+  int direct = RTEST(rb_hash_aref(spec, SYM_direct));
+
+  struct io_uring_sqe *sqe = get_op_sqe(iour, spec);
+  __u64 user_data;
+  VALUE ctx = setup_op_ctx(self, iour, OP_openat, SYM_openat, id, spec, &user_data);
+  OpCtx_rd_set(ctx, path, 0, 0, 0);
+
+  // direct descriptors cannot be opened with O_CLOEXEC. Regular fds are
+  // always opened with O_CLOEXEC, as is the case with Ruby's File.open.
+  if (direct)
+    io_uring_prep_openat_direct(sqe, dir_fd, RSTRING_PTR(path), flags_i, mode_i, IORING_FILE_INDEX_ALLOC);
+  else
+    io_uring_prep_openat(sqe, dir_fd, RSTRING_PTR(path), flags_i | O_CLOEXEC, mode_i);
+  setup_sqe(sqe, user_data, spec);
+  setup_link_timeout(iour, ctx, sqe, spec);
+  iour->unsubmitted_sqes++;
+  return id;
+}
+
+// Gets the status of the file at the given path, or of the given fd: if no
+// path is given. On completion, the file status is added to the spec as
+// :stat.
+VALUE IOURing_prep_statx(VALUE self, VALUE spec) {
+  IOURing_t *iour = get_iou(self);
+  unsigned id_i = next_op_id(iour);
+  VALUE id = UINT2NUM(id_i);
+
+  if (TYPE(spec) != T_HASH)
+    rb_raise(rb_eArgError, "Expected keyword arguments");
+
+  VALUE path;
+  int dir_fd;
+  VALUE flags = rb_hash_aref(spec, SYM_flags);
+  int flags_i = NIL_P(flags) ? 0 : NUM2INT(flags);
+  if (NIL_P(rb_hash_aref(spec, SYM_path))) {
+    int fixed;
+    dir_fd = NUM2INT(get_fd_kwarg(spec, &fixed));
+    if (fixed)
+      rb_raise(rb_eArgError, "Cannot stat a direct descriptor");
+    path = rb_str_new_literal("");
+    flags_i |= AT_EMPTY_PATH;
+  }
+  else {
+    path = get_path_kwarg(spec);
+    dir_fd = get_dir_fd_kwarg(spec);
+  }
+  VALUE mask = rb_hash_aref(spec, SYM_mask);
+  unsigned mask_i = NIL_P(mask) ? STATX_BASIC_STATS | STATX_BTIME : NUM2UINT(mask);
+
+  struct io_uring_sqe *sqe = get_op_sqe(iour, spec);
+  __u64 user_data;
+  VALUE ctx = setup_op_ctx(self, iour, OP_statx, SYM_statx, id, spec, &user_data);
+  OpCtx_rd_set(ctx, path, 0, 0, 0);
+
+  io_uring_prep_statx(sqe, dir_fd, RSTRING_PTR(path), flags_i, mask_i, OpCtx_statx_get(ctx));
+  setup_sqe(sqe, user_data, spec);
+  setup_link_timeout(iour, ctx, sqe, spec);
+  iour->unsubmitted_sqes++;
+  return id;
+}
+
+static inline VALUE statx_timestamp_to_time(struct statx_timestamp *ts) {
+  return rb_time_nano_new(ts->tv_sec, ts->tv_nsec);
+}
+
+// Converts the statx buffer of a completed statx op to a hash. Fields not
+// included in the returned mask are left out.
+static inline VALUE statx_to_hash(struct statx *stx) {
+  VALUE hash = rb_hash_new();
+  rb_hash_aset(hash, SYM_mask, UINT2NUM(stx->stx_mask));
+  if (stx->stx_mask & (STATX_TYPE | STATX_MODE))
+    rb_hash_aset(hash, SYM_mode, UINT2NUM(stx->stx_mode));
+  if (stx->stx_mask & STATX_NLINK)
+    rb_hash_aset(hash, SYM_nlink, UINT2NUM(stx->stx_nlink));
+  if (stx->stx_mask & STATX_UID)
+    rb_hash_aset(hash, SYM_uid, UINT2NUM(stx->stx_uid));
+  if (stx->stx_mask & STATX_GID)
+    rb_hash_aset(hash, SYM_gid, UINT2NUM(stx->stx_gid));
+  if (stx->stx_mask & STATX_INO)
+    rb_hash_aset(hash, SYM_ino, ULL2NUM(stx->stx_ino));
+  if (stx->stx_mask & STATX_SIZE)
+    rb_hash_aset(hash, SYM_size, ULL2NUM(stx->stx_size));
+  if (stx->stx_mask & STATX_BLOCKS)
+    rb_hash_aset(hash, SYM_blocks, ULL2NUM(stx->stx_blocks));
+  rb_hash_aset(hash, SYM_blksize, UINT2NUM(stx->stx_blksize));
+  if (stx->stx_mask & STATX_ATIME)
+    rb_hash_aset(hash, SYM_atime, statx_timestamp_to_time(&stx->stx_atime));
+  if (stx->stx_mask & STATX_MTIME)
+    rb_hash_aset(hash, SYM_mtime, statx_timestamp_to_time(&stx->stx_mtime));
+  if (stx->stx_mask & STATX_CTIME)
+    rb_hash_aset(hash, SYM_ctime, statx_timestamp_to_time(&stx->stx_ctime));
+  if (stx->stx_mask & STATX_BTIME)
+    rb_hash_aset(hash, SYM_btime, statx_timestamp_to_time(&stx->stx_btime));
+  return hash;
+}
+
+// Flushes the given fd to disk. With datasync: true, only the data (and the
+// metadata needed to retrieve it) is flushed, as with fdatasync(2).
+VALUE IOURing_prep_fsync(VALUE self, VALUE spec) {
+  IOURing_t *iour = get_iou(self);
+  unsigned id_i = next_op_id(iour);
+  VALUE id = UINT2NUM(id_i);
+
+  int fixed;
+  int fd_i = NUM2INT(get_fd_kwarg(spec, &fixed));
+  int datasync = RTEST(rb_hash_aref(spec, SYM_datasync));
+
+  struct io_uring_sqe *sqe = get_op_sqe(iour, spec);
+  __u64 user_data;
+  VALUE ctx = setup_op_ctx(self, iour, OP_fsync, SYM_fsync, id, spec, &user_data);
+
+  io_uring_prep_fsync(sqe, fd_i, datasync ? IORING_FSYNC_DATASYNC : 0);
+  setup_sqe(sqe, user_data, spec);
+  if (fixed) sqe->flags |= IOSQE_FIXED_FILE;
+  setup_link_timeout(iour, ctx, sqe, spec);
+  iour->unsubmitted_sqes++;
+  return id;
+}
+
+// Allocates len bytes of disk space for the given fd, starting at offset:.
+// mode: is as in fallocate(2).
+VALUE IOURing_prep_fallocate(VALUE self, VALUE spec) {
+  IOURing_t *iour = get_iou(self);
+  unsigned id_i = next_op_id(iour);
+  VALUE id = UINT2NUM(id_i);
+
+  int fixed;
+  int fd_i = NUM2INT(get_fd_kwarg(spec, &fixed));
+  VALUE values[1];
+  get_required_kwargs(spec, values, 1, SYM_len);
+  __u64 len = NUM2ULL(values[0]);
+  VALUE offset = rb_hash_aref(spec, SYM_offset);
+  __u64 offset_i = NIL_P(offset) ? 0 : NUM2ULL(offset);
+  VALUE mode = rb_hash_aref(spec, SYM_mode);
+  int mode_i = NIL_P(mode) ? 0 : NUM2INT(mode);
+
+  struct io_uring_sqe *sqe = get_op_sqe(iour, spec);
+  __u64 user_data;
+  VALUE ctx = setup_op_ctx(self, iour, OP_fallocate, SYM_fallocate, id, spec, &user_data);
+
+  io_uring_prep_fallocate(sqe, fd_i, mode_i, offset_i, len);
+  setup_sqe(sqe, user_data, spec);
+  if (fixed) sqe->flags |= IOSQE_FIXED_FILE;
+  setup_link_timeout(iour, ctx, sqe, spec);
+  iour->unsubmitted_sqes++;
+  return id;
+}
+
+// Removes the file at the given path, relative to dir_fd: (or the current
+// directory). With dir: true, removes a directory.
+VALUE IOURing_prep_unlinkat(VALUE self, VALUE spec) {
+  IOURing_t *iour = get_iou(self);
+  unsigned id_i = next_op_id(iour);
+  VALUE id = UINT2NUM(id_i);
+
+  if (TYPE(spec) != T_HASH)
+    rb_raise(rb_eArgError, "Expected keyword arguments");
+
+  VALUE path = get_path_kwarg(spec);
+  int dir_fd = get_dir_fd_kwarg(spec);
+  int dir = RTEST(rb_hash_aref(spec, SYM_dir));
+
+  struct io_uring_sqe *sqe = get_op_sqe(iour, spec);
+  __u64 user_data;
+  VALUE ctx = setup_op_ctx(self, iour, OP_unlinkat, SYM_unlinkat, id, spec, &user_data);
+  OpCtx_rd_set(ctx, path, 0, 0, 0);
+
+  io_uring_prep_unlinkat(sqe, dir_fd, RSTRING_PTR(path), dir ? AT_REMOVEDIR : 0);
+  setup_sqe(sqe, user_data, spec);
+  setup_link_timeout(iour, ctx, sqe, spec);
+  iour->unsubmitted_sqes++;
+  return id;
+}
+
+struct poll_event {
+  VALUE *sym;
+  unsigned mask;
+};
+
+static const struct poll_event poll_events[] = {
+  {&SYM_in,     POLLIN},
+  {&SYM_out,    POLLOUT},
+  {&SYM_pri,    POLLPRI},
+  {&SYM_err,    POLLERR},
+  {&SYM_hup,    POLLHUP},
+  {&SYM_rdhup,  POLLRDHUP}
+};
+
+#define POLL_EVENT_COUNT (sizeof(poll_events) / sizeof(struct poll_event))
+
+static inline unsigned poll_event_mask(VALUE sym) {
+  for (unsigned i = 0; i < POLL_EVENT_COUNT; i++)
+    if (sym == *poll_events[i].sym) return poll_events[i].mask;
+
+  rb_raise(rb_eArgError, "Invalid poll event %"PRIsVALUE, sym);
+}
+
+// Converts the given events, either an integer mask, a symbol (e.g. :in), or
+// an array of symbols, to a poll mask.
+static inline unsigned get_poll_mask(VALUE events) {
+  switch (TYPE(events)) {
+    case T_FIXNUM:
+      return NUM2UINT(events);
+    case T_SYMBOL:
+      return poll_event_mask(events);
+    case T_ARRAY: {
+      unsigned mask = 0;
+      long len = RARRAY_LEN(events);
+      for (long i = 0; i < len; i++)
+        mask |= poll_event_mask(RARRAY_AREF(events, i));
+      return mask;
+    }
+    default:
+      rb_raise(rb_eArgError, "Invalid poll events");
+  }
+}
+
+// Converts the poll mask returned by a poll op to an array of symbols.
+static inline VALUE poll_mask_to_events(unsigned mask) {
+  VALUE events = rb_ary_new();
+  for (unsigned i = 0; i < POLL_EVENT_COUNT; i++)
+    if (mask & poll_events[i].mask) rb_ary_push(events, *poll_events[i].sym);
+  return events;
+}
+
+// Waits for the given fd to become ready. The result is the mask of events
+// that occurred, which is also put in the spec as :revents, an array of
+// symbols. With multishot: true, the op stays armed and posts a completion
+// each time the fd becomes ready, until cancelled.
+VALUE IOURing_prep_poll(VALUE self, VALUE spec) {
+  IOURing_t *iour = get_iou(self);
+  unsigned id_i = next_op_id(iour);
+  VALUE id = UINT2NUM(id_i);
+
+  int fixed;
+  int fd_i = NUM2INT(get_fd_kwarg(spec, &fixed));
+  VALUE values[1];
+  get_required_kwargs(spec, values, 1, SYM_events);
+  unsigned mask = get_poll_mask(values[0]);
+  int multishot = RTEST(rb_hash_aref(spec, SYM_multishot));
+
+  struct io_uring_sqe *sqe = get_op_sqe(iour, spec);
+  __u64 user_data;
+  VALUE ctx = setup_op_ctx(self, iour, OP_poll, SYM_poll, id, spec, &user_data);
+
+  if (multishot)
+    io_uring_prep_poll_multishot(sqe, fd_i, mask);
+  else
+    io_uring_prep_poll_add(sqe, fd_i, mask);
+  setup_sqe(sqe, user_data, spec);
+  if (fixed) sqe->flags |= IOSQE_FIXED_FILE;
+  setup_link_timeout(iour, ctx, sqe, spec);
+  iour->unsubmitted_sqes++;
+  return id;
+}
+
+// Changes the events waited for by a pending poll op, given by id:, without
+// removing and re-adding it. If the op has already completed, the update op
+// completes with -ENOENT. As with #prep_cancel, looking up the op by id scans
+// the op table.
+VALUE IOURing_prep_poll_update(VALUE self, VALUE spec) {
+  IOURing_t *iour = get_iou(self);
+  unsigned id_i = next_op_id(iour);
+  VALUE id = UINT2NUM(id_i);
+
+  VALUE values[2];
+  get_required_kwargs(spec, values, 2, SYM_id, SYM_events);
+  unsigned mask = get_poll_mask(values[1]);
+  __u64 poll_user_data = op_table_user_data_for_id(&iour->ops, NUM2UINT(values[0]));
+
+  // a multishot poll must stay multishot, since the kernel resets it to
+  // oneshot unless IORING_POLL_ADD_MULTI is given
+  unsigned flags = IORING_POLL_UPDATE_EVENTS;
+  struct op_slot *slot = op_table_get(&iour->ops, poll_user_data);
+  if (slot && OpCtx_type_get(slot->ctx) == OP_poll) {
+    VALUE poll_spec = OpCtx_spec_get(slot->ctx);
+    if (RTEST(rb_hash_aref(poll_spec, SYM_multishot)))
+      flags |= IORING_POLL_ADD_MULTI;
+    rb_hash_aset(poll_spec, SYM_events, values[1]);
+  }
+
+  struct io_uring_sqe *sqe = get_sqe(iour);
+  io_uring_prep_poll_update(sqe, poll_user_data, 0, mask, flags);
+  sqe->user_data = OP_USER_DATA(id_i, OP_SLOT_NONE);
+  iour->unsubmitted_sqes++;
+  return id;
+}
+
+// Creates a socket. domain:, type: and protocol: are as in socket(2). The
+// result is the new fd, or with direct: true, the index of a free slot in the
+// registered file table. To link ops on the new socket (e.g. connect and
+// send), its slot must be known in advance, so it can be given as fixed_fd:.
+VALUE IOURing_prep_socket(VALUE self, VALUE spec) {
+  IOURing_t *iour = get_iou(self);
+  unsigned id_i = next_op_id(iour);
+  VALUE id = UINT2NUM(id_i);
+
+  VALUE values[2];
+  get_required_kwargs(spec, values, 2, SYM_domain, SYM_type);
+  int domain = NUM2INT(values[0]);
+  int type = NUM2INT(values[1]);
+  VALUE protocol = rb_hash_aref(spec, SYM_protocol);
+  int protocol_i = NIL_P(protocol) ? 0 : NUM2INT(protocol);
+  VALUE fixed_fd = rb_hash_aref(spec, SYM_fixed_fd);
+  int direct = RTEST(rb_hash_aref(spec, SYM_direct));
+
+  struct io_uring_sqe *sqe = get_op_sqe(iour, spec);
+  __u64 user_data;
+  VALUE ctx = setup_op_ctx(self, iour, OP_socket, SYM_socket, id, spec, &user_data);
+
+  // direct descriptors cannot be created with SOCK_CLOEXEC. Regular fds are
+  // always created with SOCK_CLOEXEC, as is the case with Ruby's Socket.new.
+  if (!NIL_P(fixed_fd))
+    io_uring_prep_socket_direct(sqe, domain, type, protocol_i, NUM2UINT(fixed_fd), 0);
+  else if (direct)
+    io_uring_prep_socket_direct_alloc(sqe, domain, type, protocol_i, 0);
+  else
+    io_uring_prep_socket(sqe, domain, type | SOCK_CLOEXEC, protocol_i, 0);
+  setup_sqe(sqe, user_data, spec);
+  setup_link_timeout(iour, ctx, sqe, spec);
+  iour->unsubmitted_sqes++;
+  return id;
+}
+
+// Copies the given address, either a packed sockaddr string (as returned by
+// Socket.sockaddr_in) or an Addrinfo, to the given sa_data.
+static inline void set_sa_data(struct sa_data *sa, VALUE address) {
+  if (!RB_TYPE_P(address, T_STRING))
+    address = rb_funcall(address, rb_intern("to_sockaddr"), 0);
+  StringValue(address);
+  long len = RSTRING_LEN(address);
+  if (len <= 0 || (size_t)len > sizeof(sa->addr))
+    rb_raise(rb_eArgError, "Invalid address");
+
+  memcpy(&sa->addr, RSTRING_PTR(address), len);
+  sa->len = (socklen_t)len;
+  RB_GC_GUARD(address);
+}
+
+// Connects the given socket to address:. The address is copied to the op ctx,
+// where it is kept until the op is complete.
+VALUE IOURing_prep_connect(VALUE self, VALUE spec) {
+  IOURing_t *iour = get_iou(self);
+  unsigned id_i = next_op_id(iour);
+  VALUE id = UINT2NUM(id_i);
+
+  int fixed;
+  int fd_i = NUM2INT(get_fd_kwarg(spec, &fixed));
+  VALUE values[1];
+  get_required_kwargs(spec, values, 1, SYM_address);
+  struct sa_data sa;
+  set_sa_data(&sa, values[0]);
+
+  struct io_uring_sqe *sqe = get_op_sqe(iour, spec);
+  __u64 user_data;
+  VALUE ctx = setup_op_ctx(self, iour, OP_connect, SYM_connect, id, spec, &user_data);
+  struct sa_data *ctx_sa = OpCtx_sa_get(ctx);
+  *ctx_sa = sa;
+
+  io_uring_prep_connect(sqe, fd_i, (struct sockaddr *)&ctx_sa->addr, ctx_sa->len);
+  setup_sqe(sqe, user_data, spec);
+  if (fixed) sqe->flags |= IOSQE_FIXED_FILE;
+  setup_link_timeout(iour, ctx, sqe, spec);
+  iour->unsubmitted_sqes++;
+  return id;
+}
+
+// Shuts down the given socket. how: is as in shutdown(2), and defaults to
+// SHUT_RDWR.
+VALUE IOURing_prep_shutdown(VALUE self, VALUE spec) {
+  IOURing_t *iour = get_iou(self);
+  unsigned id_i = next_op_id(iour);
+  VALUE id = UINT2NUM(id_i);
+
+  int fixed;
+  int fd_i = NUM2INT(get_fd_kwarg(spec, &fixed));
+  VALUE how = rb_hash_aref(spec, SYM_how);
+  int how_i = NIL_P(how) ? SHUT_RDWR : NUM2INT(how);
+
+  struct io_uring_sqe *sqe = get_op_sqe(iour, spec);
+  __u64 user_data;
+  VALUE ctx = setup_op_ctx(self, iour, OP_shutdown, SYM_shutdown, id, spec, &user_data);
+
+  io_uring_prep_shutdown(sqe, fd_i, how_i);
+  setup_sqe(sqe, user_data, spec);
+  if (fixed) sqe->flags |= IOSQE_FIXED_FILE;
+  setup_link_timeout(iour, ctx, sqe, spec);
+  iour->unsubmitted_sqes++;
+  return id;
+}
+
+// Receives messages from a socket, typically a UDP socket, using buffers from
+// the given buffer group. The op is always multishot, posting a completion
+// for each message received. control_len: reserves room in each buffer for
+// control messages (e.g. timestamps or the GRO segment size).
+VALUE IOURing_prep_recvmsg(VALUE self, VALUE spec) {
+  IOURing_t *iour = get_iou(self);
+  unsigned id_i = next_op_id(iour);
+  VALUE id = UINT2NUM(id_i);
+
+  int fixed;
+  int fd_i = NUM2INT(get_fd_kwarg(spec, &fixed));
+  VALUE values[1];
+  get_required_kwargs(spec, values, 1, SYM_buffer_group);
+  unsigned bg_id = NUM2UINT(values[0]);
+  int utf8 = RTEST(rb_hash_aref(spec, SYM_utf8));
+  VALUE control_len = rb_hash_aref(spec, SYM_control_len);
+  unsigned control_len_i = NIL_P(control_len) ? 0 : NUM2UINT(control_len);
+
+  check_buffer_group_op(iour, bg_id, 0, 0);
+  struct buf_ring_descriptor *desc = iour->brs[bg_id];
+  if (desc->incremental)
+    rb_raise(rb_eArgError, "Incremental buffer groups cannot be used with recvmsg");
+  if (sizeof(struct io_uring_recvmsg_out) + sizeof(struct sockaddr_storage) + control_len_i >= desc->buf_size)
+    rb_raise(rb_eArgError, "Buffer size too small for message header");
+
+  struct io_uring_sqe *sqe = get_op_sqe(iour, spec);
+  __u64 user_data;
+  VALUE ctx = setup_op_ctx(self, iour, OP_recvmsg, SYM_recvmsg, id, spec, &user_data);
+  OpCtx_rd_set(ctx, Qnil, 0, bg_id, utf8);
+  set_buffer_op_rd(iour, ctx, fd_i, fixed, 1, 0, 0);
+
+  // for multishot recvmsg, only the name and control lengths of the header
+  // are used, determining the layout of each received buffer
+  struct msghdr *msg = &OpCtx_msg_get(ctx)->hdr;
+  memset(msg, 0, sizeof(struct msghdr));
+  msg->msg_namelen = sizeof(struct sockaddr_storage);
+  msg->msg_controllen = control_len_i;
+
+  io_uring_prep_recvmsg_multishot(sqe, fd_i, msg, 0);
+  setup_sqe(sqe, user_data, spec);
+  sqe->flags |= IOSQE_BUFFER_SELECT;
+  sqe->buf_group = bg_id;
+  if (fixed) sqe->flags |= IOSQE_FIXED_FILE;
+  setup_link_timeout(iour, ctx, sqe, spec);
+  iour->unsubmitted_sqes++;
+  return id;
+}
+
+// Sends a message made up of the given buffers (or a single buffer) to the
+// given socket, optionally to address:. With segment_size:, the message is
+// split by the kernel into multiple UDP datagrams of the given size (UDP GSO),
+// sending a batch of datagrams with a single op.
+VALUE IOURing_prep_sendmsg(VALUE self, VALUE spec) {
+  IOURing_t *iour = get_iou(self);
+  unsigned id_i = next_op_id(iour);
+  VALUE id = UINT2NUM(id_i);
+
+  int fixed;
+  int fd_i = NUM2INT(get_fd_kwarg(spec, &fixed));
+  VALUE buffers = rb_hash_aref(spec, SYM_buffers);
+  if (NIL_P(buffers)) {
+    VALUE values[1];
+    get_required_kwargs(spec, values, 1, SYM_buffer);
+    buffers = rb_ary_new_from_values(1, values);
+  }
+  unsigned count = check_iov_buffers(buffers, Qnil, 0);
+  VALUE address = rb_hash_aref(spec, SYM_address);
+  struct sa_data sa;
+  if (!NIL_P(address)) set_sa_data(&sa, address);
+  VALUE segment_size = rb_hash_aref(spec, SYM_segment_size);
+  uint16_t segment_size_i = NIL_P(segment_size) ? 0 : (uint16_t)NUM2USHORT(segment_size);
+
+  struct io_uring_sqe *sqe = get_op_sqe(iour, spec);
+  __u64 user_data;
+  VALUE ctx = setup_op_ctx(self, iour, OP_sendmsg, SYM_sendmsg, id, spec, &user_data);
+  OpCtx_rd_set(ctx, buffers, 0, 0, 0);
+  struct iovec *iovecs = setup_iovecs(ctx, buffers, count, Qnil, 0);
+
+  struct msg_data *msg = OpCtx_msg_get(ctx);
+  memset(&msg->hdr, 0, sizeof(struct msghdr));
+  msg->hdr.msg_iov = iovecs;
+  msg->hdr.msg_iovlen = count;
+  if (!NIL_P(address)) {
+    memcpy(&msg->addr, &sa.addr, sa.len);
+    msg->hdr.msg_name = &msg->addr;
+    msg->hdr.msg_namelen = sa.len;
+  }
+  if (segment_size_i) {
+    msg->hdr.msg_control = msg->control.buf;
+    msg->hdr.msg_controllen = sizeof(msg->control.buf);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg->hdr);
+    cmsg->cmsg_level = SOL_UDP;
+    cmsg->cmsg_type = UDP_SEGMENT;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+    memcpy(CMSG_DATA(cmsg), &segment_size_i, sizeof(uint16_t));
+  }
+
+  io_uring_prep_sendmsg(sqe, fd_i, &msg->hdr, 0);
+  setup_sqe(sqe, user_data, spec);
+  if (fixed) sqe->flags |= IOSQE_FIXED_FILE;
+  setup_link_timeout(iour, ctx, sqe, spec);
+  iour->unsubmitted_sqes++;
+  return id;
+}
+
+// Receives using buffers from the given buffer group. With bundle: true, a
+// single completion may span multiple contiguous buffers.
+VALUE prep_recv_buffer_group(VALUE self, IOURing_t *iour, VALUE spec) {
+  unsigned id_i = next_op_id(iour);
+  VALUE id = UINT2NUM(id_i);
+
+  int fixed;
+  VALUE fd = get_fd_kwarg(spec, &fixed);
+  VALUE values[1];
+  get_required_kwargs(spec, values, 1, SYM_buffer_group);
+  int fd_i = NUM2INT(fd);
+  unsigned bg_id = NUM2UINT(values[0]);
+  int multishot = RTEST(rb_hash_aref(spec, SYM_multishot));
+  int bundle = RTEST(rb_hash_aref(spec, SYM_bundle));
+  int utf8 = RTEST(rb_hash_aref(spec, SYM_utf8));
+  int view = RTEST(rb_hash_aref(spec, SYM_view));
+  if (bundle && view)
+    rb_raise(rb_eArgError, "Buffer views cannot be used with bundles");
+  check_buffer_group_op(iour, bg_id, bundle, view);
+
+  struct io_uring_sqe *sqe = get_op_sqe(iour, spec);
+  __u64 user_data;
+  VALUE ctx = setup_op_ctx(self, iour, OP_recv, SYM_recv, id, spec, &user_data);
+  OpCtx_rd_set(ctx, Qnil, 0, bg_id, utf8);
+  set_buffer_op_rd(iour, ctx, fd_i, fixed, multishot, bundle, view);
+
+  if (multishot)
+    io_uring_prep_recv_multishot(sqe, fd_i, NULL, 0, 0);
+  else
+    io_uring_prep_recv(sqe, fd_i, NULL, 0, 0);
+  if (bundle)
+    sqe->ioprio |= IORING_RECVSEND_BUNDLE;
+  setup_sqe(sqe, user_data, spec);
+  sqe->flags |= IOSQE_BUFFER_SELECT;
+  sqe->buf_group = bg_id;
+  if (fixed) sqe->flags |= IOSQE_FIXED_FILE;
+  setup_link_timeout(iour, ctx, sqe, spec);
+  iour->unsubmitted_sqes++;
+  return id;
+}
+
+VALUE IOURing_prep_recv(VALUE self, VALUE spec) {
+  IOURing_t *iour = get_iou(self);
+
+  if (TYPE(spec) == T_HASH && !NIL_P(rb_hash_aref(spec, SYM_buffer_group)))
+    return prep_recv_buffer_group(self, iour, spec);
+
+  unsigned id_i = next_op_id(iour);
+  VALUE id = UINT2NUM(id_i);
+
+  int fixed;
+  VALUE fd = get_fd_kwarg(spec, &fixed);
+  VALUE values[2];
+  get_required_kwargs(spec, values, 2, SYM_buffer, SYM_len);
+
+  VALUE buffer = values[0];
+  unsigned len_i = NUM2UINT(values[1]);
+  VALUE buffer_offset = rb_hash_aref(spec, SYM_buffer_offset);
+  int buffer_offset_i = NIL_P(buffer_offset) ? 0 : NUM2INT(buffer_offset);
+  int utf8 = RTEST(rb_hash_aref(spec, SYM_utf8));
 
-  struct io_uring_sqe *sqe = get_sqe(iour);
-  setup_sqe(sqe, id_i, spec);
+  // the buffer is prepared (which raises if frozen) before getting an SQE
+  void *ptr = prepare_read_buffer(buffer, len_i, buffer_offset_i);
 
-  setup_op_ctx(iour, OP_close, SYM_close, id, spec);
+  struct io_uring_sqe *sqe = get_op_sqe(iour, spec);
+  __u64 user_data;
+  VALUE ctx = setup_op_ctx(self, iour, OP_recv, SYM_recv, id, spec, &user_data);
+  OpCtx_rd_set(ctx, buffer, buffer_offset_i, 0, utf8);
 
-  io_uring_prep_close(sqe, NUM2INT(fd));
+  io_uring_prep_recv(sqe, NUM2INT(fd), ptr, len_i, 0);
+  setup_sqe(sqe, user_data, spec);
+  if (fixed) sqe->flags |= IOSQE_FIXED_FILE;
+  setup_link_timeout(iour, ctx, sqe, spec);
   iour->unsubmitted_sqes++;
   return id;
 }
 
-VALUE IOURing_prep_nop(VALUE self) {
-  IOURing_t *iour = get_iou(self);
-  unsigned id_i = ++iour->op_counter;
+// Sends the data added to the given send buffer group using
+// #buffer_ring_push, as a single bundle. MSG_WAITALL is used, since the data
+// in a partially sent buffer would be lost.
+VALUE prep_send_bundle(VALUE self, IOURing_t *iour, VALUE spec) {
+  unsigned id_i = next_op_id(iour);
   VALUE id = UINT2NUM(id_i);
 
-  struct io_uring_sqe *sqe = get_sqe(iour);
-  io_uring_prep_nop(sqe);
-  sqe->user_data = id_i;
+  int fixed;
+  VALUE fd = get_fd_kwarg(spec, &fixed);
+  VALUE values[1];
+  get_required_kwargs(spec, values, 1, SYM_buffer_group);
+  int fd_i = NUM2INT(fd);
+  unsigned bg_id = NUM2UINT(values[0]);
+  if (!get_buffer_ring(iour, bg_id)->send)
+    rb_raise(rb_eArgError, "Not a send buffer group");
+
+  struct io_uring_sqe *sqe = get_op_sqe(iour, spec);
+  __u64 user_data;
+  VALUE ctx = setup_op_ctx(self, iour, OP_send, SYM_send, id, spec, &user_data);
+  OpCtx_rd_set(ctx, Qnil, 0, bg_id, 0);
+  OpCtx_rd_get(ctx)->bundle = 1;
+  buffer_op_acquire(iour, OpCtx_rd_get(ctx));
+
+  io_uring_prep_send_bundle(sqe, fd_i, 0, MSG_WAITALL);
+  setup_sqe(sqe, user_data, spec);
+  sqe->flags |= IOSQE_BUFFER_SELECT;
+  sqe->buf_group = bg_id;
+  if (fixed) sqe->flags |= IOSQE_FIXED_FILE;
+  setup_link_timeout(iour, ctx, sqe, spec);
   iour->unsubmitted_sqes++;
-
   return id;
 }
 
-static inline void * prepare_read_buffer(VALUE buffer, unsigned len, int ofs) {
-  unsigned current_len = RSTRING_LEN(buffer);
-  if (ofs < 0) ofs = current_len + ofs + 1;
-  unsigned new_len = len + (unsigned)ofs;
-
-  if (current_len < new_len)
-    rb_str_modify_expand(buffer, new_len);
-  else
-    rb_str_modify(buffer);
-  return RSTRING_PTR(buffer) + ofs;
-}
-
-static inline void adjust_read_buffer_len(VALUE buffer, int result, int ofs) {
-  rb_str_modify(buffer);
-  unsigned len = result > 0 ? (unsigned)result : 0;
-  unsigned current_len = RSTRING_LEN(buffer);
-  if (ofs < 0) ofs = current_len + ofs + 1;
-  rb_str_set_len(buffer, len + (unsigned)ofs);
-}
+VALUE IOURing_prep_send(VALUE self, VALUE spec) {
+  IOURing_t *iour = get_iou(self);
+  if (TYPE(spec) == T_HASH && RTEST(rb_hash_aref(spec, SYM_bundle)))
+    return prep_send_bundle(self, iour, spec);
 
-VALUE prep_read_multishot(IOURing_t *iour, VALUE spec) {
-  unsigned id_i = ++iour->op_counter;
+  unsigned id_i = next_op_id(iour);
   VALUE id = UINT2NUM(id_i);
 
-  VALUE values[2];
-  get_required_kwargs(spec, values, 2, SYM_fd, SYM_buffer_group);
-  int fd = NUM2INT(values[0]);
-  unsigned bg_id = NUM2UINT(values[1]);
-  int utf8 = RTEST(rb_hash_aref(spec, SYM_utf8));
-
-  struct io_uring_sqe *sqe = get_sqe(iour);
-  setup_sqe(sqe, id_i, spec);
+  int fixed;
+  int fd_i = NUM2INT(get_fd_kwarg(spec, &fixed));
+  int zc = RTEST(rb_hash_aref(spec, SYM_zc));
+  VALUE buffer = Qnil;
+  unsigned buf_index = 0;
+  unsigned len;
+  char *ptr;
+
+  // a zero-copy send from a registered buffer uses send_zc_fixed
+  if (!NIL_P(rb_hash_aref(spec, SYM_buffer_index)))
+    ptr = get_fixed_buffer(iour, spec, &buf_index, &len);
+  else {
+    VALUE values[1];
+    get_required_kwargs(spec, values, 1, SYM_buffer);
+    buffer = values[0];
+    Check_Type(buffer, T_STRING);
+    VALUE len_v = rb_hash_aref(spec, SYM_len);
+    len = NIL_P(len_v) ? RSTRING_LEN(buffer) : NUM2UINT(len_v);
+    if (len > RSTRING_LEN(buffer))
+      rb_raise(rb_eArgError, "Length exceeds buffer size");
+    ptr = RSTRING_PTR(buffer);
+  }
 
-  VALUE ctx = setup_op_ctx(iour, OP_read, SYM_read, id, spec);
-  OpCtx_rd_set(ctx, Qnil, 0, bg_id, utf8);
+  struct io_uring_sqe *sqe = get_op_sqe(iour, spec);
+  __u64 user_data;
+  VALUE ctx = setup_op_ctx(self, iour, OP_send, SYM_send, id, spec, &user_data);
+  OpCtx_rd_set(ctx, buffer, 0, 0, 0);
 
-  io_uring_prep_read_multishot(sqe, fd, 0, -1, bg_id);
+  if (!zc)
+    io_uring_prep_send(sqe, fd_i, ptr, len, 0);
+  else if (NIL_P(buffer))
+    io_uring_prep_send_zc_fixed(sqe, fd_i, ptr, len, 0, 0, buf_index);
+  else
+    io_uring_prep_send_zc(sqe, fd_i, ptr, len, 0, 0);
+  setup_sqe(sqe, user_data, spec);
+  if (fixed) sqe->flags |= IOSQE_FIXED_FILE;
+  setup_link_timeout(iour, ctx, sqe, spec);
   iour->unsubmitted_sqes++;
   return id;
 }
 
-VALUE IOURing_prep_read(VALUE self, VALUE spec) {
+VALUE IOURing_prep_accept_fast(VALUE self, VALUE fd) {
   IOURing_t *iour = get_iou(self);
+  unsigned id_i = next_op_id(iour);
+  int fd_i = NUM2INT(fd);
 
-  if (RTEST(rb_hash_aref(spec, SYM_multishot)))
-    return prep_read_multishot(iour, spec);
+  struct io_uring_sqe *sqe = get_sqe(iour);
+  VALUE ctx = setup_fast_op_ctx(self, iour, OP_accept, id_i, sqe);
+  struct sa_data *sa = OpCtx_sa_get(ctx);
+  io_uring_prep_accept(sqe, fd_i, (struct sockaddr *)&sa->addr, &sa->len, 0);
+  iour->unsubmitted_sqes++;
+  return UINT2NUM(id_i);
+}
 
-  unsigned id_i = ++iour->op_counter;
-  VALUE id = UINT2NUM(id_i);
+VALUE IOURing_prep_close_fast(VALUE self, VALUE fd) {
+  IOURing_t *iour = get_iou(self);
+  unsigned id_i = next_op_id(iour);
+  int fd_i = NUM2INT(fd);
 
-  VALUE values[3];
-  get_required_kwargs(spec, values, 3, SYM_fd, SYM_buffer, SYM_len);
+  struct io_uring_sqe *sqe = get_sqe(iour);
+  setup_fast_op_ctx(self, iour, OP_close, id_i, sqe);
+  io_uring_prep_close(sqe, fd_i);
+  iour->unsubmitted_sqes++;
+  return UINT2NUM(id_i);
+}
 
-  VALUE fd = values[0];
-  VALUE buffer = values[1];
-  VALUE len = values[2];
+VALUE IOURing_prep_read_fast(VALUE self, VALUE fd, VALUE buffer, VALUE len) {
+  IOURing_t *iour = get_iou(self);
+  unsigned id_i = next_op_id(iour);
+  int fd_i = NUM2INT(fd);
   unsigned len_i = NUM2UINT(len);
-
-  VALUE buffer_offset = rb_hash_aref(spec, SYM_buffer_offset);
-  int buffer_offset_i = NIL_P(buffer_offset) ? 0 : NUM2INT(buffer_offset);
-  int utf8 = RTEST(rb_hash_aref(spec, SYM_utf8));
+  Check_Type(buffer, T_STRING);
+  // the buffer is prepared (which raises if frozen) before getting an SQE
+  void *ptr = prepare_read_buffer(buffer, len_i, 0);
 
   struct io_uring_sqe *sqe = get_sqe(iour);
-  setup_sqe(sqe, id_i, spec);
+  VALUE ctx = setup_fast_op_ctx(self, iour, OP_read, id_i, sqe);
+  OpCtx_rd_set(ctx, buffer, 0, 0, 0);
 
-  VALUE ctx = setup_op_ctx(iour, OP_read, SYM_read, id, spec);
-  OpCtx_rd_set(ctx, buffer, buffer_offset_i, 0, utf8);
-
-  void *ptr = prepare_read_buffer(buffer, len_i, buffer_offset_i);
-  io_uring_prep_read(sqe, NUM2INT(fd), ptr, len_i, -1);
+  io_uring_prep_read(sqe, fd_i, ptr, len_i, -1);
   iour->unsubmitted_sqes++;
-  return id;
+  return UINT2NUM(id_i);
 }
 
-VALUE IOURing_prep_timeout(VALUE self, VALUE spec) {
+VALUE IOURing_prep_timeout_fast(VALUE self, VALUE interval) {
   IOURing_t *iour = get_iou(self);
-  unsigned id_i = ++iour->op_counter;
-  VALUE id = UINT2NUM(id_i);
-
-  VALUE values[1];
-  get_required_kwargs(spec, values, 1, SYM_interval);
-  VALUE interval = values[0];
-  VALUE multishot = rb_hash_aref(spec, SYM_multishot);
-  unsigned flags = RTEST(multishot) ? IORING_TIMEOUT_MULTISHOT : 0;
+  unsigned id_i = next_op_id(iour);
 
   struct io_uring_sqe *sqe = get_sqe(iour);
-  setup_sqe(sqe, id_i, spec);
-
-  VALUE ctx = setup_op_ctx(iour, OP_timeout, SYM_timeout, id, spec);
+  VALUE ctx = setup_fast_op_ctx(self, iour, OP_timeout, id_i, sqe);
   OpCtx_ts_set(ctx, interval);
-
-  io_uring_prep_timeout(sqe, OpCtx_ts_get(ctx), 0, flags);
+  io_uring_prep_timeout(sqe, OpCtx_ts_get(ctx), 0, 0);
   iour->unsubmitted_sqes++;
-  return id;
+  return UINT2NUM(id_i);
 }
 
-VALUE IOURing_prep_write(VALUE self, VALUE spec) {
+VALUE IOURing_prep_write_fast(int argc, VALUE *argv, VALUE self) {
   IOURing_t *iour = get_iou(self);
-  unsigned id_i = ++iour->op_counter;
-  VALUE id = UINT2NUM(id_i);
+  VALUE fd, buffer, len;
 
-  VALUE values[2];
-  get_required_kwargs(spec, values, 2, SYM_fd, SYM_buffer);
-  VALUE fd = values[0];
-  VALUE buffer = values[1];
-  VALUE len = rb_hash_aref(spec, SYM_len);
+  rb_scan_args(argc, argv, "21", &fd, &buffer, &len);
+  unsigned id_i = next_op_id(iour);
+  int fd_i = NUM2INT(fd);
+  Check_Type(buffer, T_STRING);
   unsigned nbytes = NIL_P(len) ? RSTRING_LEN(buffer) : NUM2UINT(len);
 
   struct io_uring_sqe *sqe = get_sqe(iour);
-  setup_sqe(sqe, id_i, spec);
-
-  setup_op_ctx(iour, OP_write, SYM_write, id, spec);
-
-  io_uring_prep_write(sqe, NUM2INT(fd), RSTRING_PTR(buffer), nbytes, -1);
+  VALUE ctx = setup_fast_op_ctx(self, iour, OP_write, id_i, sqe);
+  OpCtx_rd_set(ctx, buffer, 0, 0, 0);
+  io_uring_prep_write(sqe, fd_i, RSTRING_PTR(buffer), nbytes, -1);
   iour->unsubmitted_sqes++;
-  return id;
+  return UINT2NUM(id_i);
 }
 
 VALUE IOURing_submit(VALUE self) {
   IOURing_t *iour = get_iou(self);
+  rearm_pending_ops(iour);
   if (!iour->unsubmitted_sqes)
     return INT2NUM(0);
 
+  flush_sqe_queue(iour);
   iour->unsubmitted_sqes = 0;
-  int ret = io_uring_submit(&iour->ring);
+  int ret = ring_submit(iour);
   if (ret < 0)
     rb_syserr_fail(-ret, strerror(-ret));
 
@@ -484,16 +2721,132 @@ inline VALUE make_empty_op_with_result(VALUE id, VALUE result) {
 typedef struct {
   IOURing_t *iour;
   struct io_uring_cqe *cqe;
+  unsigned enter_calls;
   int ret;
 }  wait_for_completion_ctx_t;
 
+// Waits for a CQE. io_uring_enter is called directly (rather than using
+// io_uring_wait_cqe) so that enter calls are counted accurately. The count is
+// kept in the ctx, and added to the ring stats once the GVL is reacquired.
 void *wait_for_completion_without_gvl(void *ptr) {
   wait_for_completion_ctx_t *ctx = (wait_for_completion_ctx_t *)ptr;
-  ctx->ret = io_uring_wait_cqe(&ctx->iour->ring, &ctx->cqe);
+  IOURing_t *iour = ctx->iour;
+  struct io_uring *ring = &iour->ring;
+  int fd = ring->ring_fd;
+  unsigned flags = IORING_ENTER_GETEVENTS;
+  if (iour->ring_fd_registered) {
+    fd = ring->enter_ring_fd;
+    flags |= IORING_ENTER_REGISTERED_RING;
+  }
+
+  ctx->enter_calls = 0;
+  while (!io_uring_cq_ready(ring)) {
+    ctx->enter_calls++;
+    int ret = io_uring_enter(fd, 0, 1, flags, NULL);
+    if (ret < 0) {
+      ctx->ret = ret;
+      return NULL;
+    }
+  }
+  ctx->cqe = ring->cq.cqes + (*ring->cq.khead & ring->cq.ring_mask);
+  ctx->ret = 0;
   return NULL;
 }
 
-static inline void update_read_buffer_from_buffer_ring(IOURing_t *iour, VALUE ctx, struct io_uring_cqe *cqe) {
+// Adds a buffer held by a view back to its buffer ring. If the ring has been
+// closed, the buffers are freed once the last view is released. Parked ops are
+// re-armed immediately, unless deferred (when called from a finalizer).
+static void release_buffer_view(IOURing_t *iour, unsigned bg_id, unsigned bid, int defer_rearm) {
+  struct buf_ring_descriptor *desc = iour->brs[bg_id];
+  desc->views--;
+  if (!iour->ring_initialized) {
+    if (!desc->views) {
+      buffer_ring_free_buffers(desc);
+      xfree(desc);
+      iour->brs[bg_id] = NULL;
+    }
+    return;
+  }
+
+  char *src = desc->buf_base + (size_t)desc->buf_size * bid;
+  io_uring_buf_ring_add(desc->br, src, desc->buf_size, bid, io_uring_buf_ring_mask(desc->buf_count), 0);
+  io_uring_buf_ring_advance(desc->br, 1);
+  if (!desc->parked_count) return;
+
+  if (defer_rearm)
+    iour->rearm_pending = 1;
+  else
+    rearm_parked_ops(iour, desc);
+}
+
+// Finalizer for buffer views that were not explicitly released. arg is
+// [ring, bg_id, bid].
+static VALUE buffer_view_finalize(RB_BLOCK_CALL_FUNC_ARGLIST(_obj_id, arg)) {
+  IOURing_t *iour = RTYPEDDATA_DATA(RARRAY_AREF(arg, 0));
+  release_buffer_view(iour, NUM2UINT(RARRAY_AREF(arg, 1)), NUM2UINT(RARRAY_AREF(arg, 2)), 1);
+  return Qnil;
+}
+
+// Returns a read-only IO::Buffer over the given buffer ring buffer. The buffer
+// is not added back to the ring until the view is released, either by calling
+// Ring#release_buffer or when the view is garbage collected.
+static inline VALUE make_buffer_view(IOURing_t *iour, struct buf_ring_descriptor *desc, unsigned bg_id, unsigned bid, unsigned len) {
+  char *src = desc->buf_base + (size_t)desc->buf_size * bid;
+  VALUE view = rb_io_buffer_new(src, len, RB_IO_BUFFER_EXTERNAL | RB_IO_BUFFER_READONLY);
+  VALUE arg = rb_ary_new_from_args(3, iour->self, UINT2NUM(bg_id), UINT2NUM(bid));
+  rb_define_finalizer(view, rb_proc_new(buffer_view_finalize, arg));
+  desc->views++;
+  RB_GC_GUARD(arg);
+  return view;
+}
+
+VALUE IOURing_release_buffer(VALUE self, VALUE view) {
+  IOURing_t *iour = get_iou(self);
+  void *base;
+  size_t size;
+  rb_io_buffer_get_bytes(view, &base, &size);
+
+  for (unsigned i = 0; i < iour->br_counter; i++) {
+    struct buf_ring_descriptor *desc = iour->brs[i];
+    if (!desc) continue;
+    char *start = desc->buf_base;
+    if (!base || (char *)base < start || (char *)base >= start + (size_t)desc->buf_count * desc->buf_size)
+      continue;
+
+    unsigned bid = ((char *)base - start) / desc->buf_size;
+    rb_undefine_finalizer(view);
+    rb_io_buffer_free(view);
+    release_buffer_view(iour, i, bid, 0);
+    return self;
+  }
+  rb_raise(rb_eArgError, "Not a buffer ring view");
+}
+
+// Each buffer of a bundle is copied and then added back to the ring. This is
+// safe, since the ring tail can only reach entries that were already copied.
+static inline VALUE update_read_buffer_from_bundle(struct buf_ring_descriptor *desc, struct read_data *rd, struct io_uring_cqe *cqe) {
+  unsigned len = cqe->res;
+  VALUE buf = rd->utf8_encoding ? rb_utf8_str_new(NULL, 0) : rb_str_new(NULL, 0);
+  rb_str_modify_expand(buf, len);
+
+  bundle_start(desc, cqe);
+  int mask = io_uring_buf_ring_mask(desc->buf_count);
+  unsigned left = len;
+  int count = 0;
+  while (left) {
+    struct io_uring_buf *entry = &desc->br->bufs[desc->head++ & mask];
+    unsigned bid = entry->bid;
+    char *src = desc->buf_base + (size_t)desc->buf_size * bid;
+    unsigned chunk = left < desc->buf_size ? left : desc->buf_size;
+    rb_str_cat(buf, src, chunk);
+    left -= chunk;
+    io_uring_buf_ring_add(desc->br, src, desc->buf_size, bid, mask, count++);
+  }
+  io_uring_buf_ring_advance(desc->br, count);
+  return buf;
+}
+
+static inline VALUE update_read_buffer_from_buffer_ring(IOURing_t *iour, VALUE ctx, struct io_uring_cqe *cqe) {
   VALUE buf = Qnil;
   if (cqe->res == 0) {
     buf = rb_str_new_literal("");
@@ -503,49 +2856,283 @@ static inline void update_read_buffer_from_buffer_ring(IOURing_t *iour, VALUE ct
   struct read_data *rd = OpCtx_rd_get(ctx);
   unsigned buf_idx = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
 
-  struct buf_ring_descriptor *desc = iour->brs + rd->bg_id;
+  struct buf_ring_descriptor *desc = iour->brs[rd->bg_id];
+  int mask = io_uring_buf_ring_mask(desc->buf_count);
+  if (rd->bundle) {
+    buf = update_read_buffer_from_bundle(desc, rd, cqe);
+    goto done;
+  }
+  if (rd->view) {
+    buf = make_buffer_view(iour, desc, rd->bg_id, buf_idx, cqe->res);
+    desc->head++;
+    goto done;
+  }
+
   char *src = desc->buf_base + desc->buf_size * buf_idx;
-  buf = rd->utf8_encoding ? rb_utf8_str_new(src, cqe->res) : rb_str_new(src, cqe->res);
+  if (desc->incremental) {
+    unsigned ofs = desc->buf_offsets[buf_idx];
+    buf = rd->utf8_encoding ? rb_utf8_str_new(src + ofs, cqe->res) : rb_str_new(src + ofs, cqe->res);
+
+    // the buffer is still in use by the kernel
+    if (cqe->flags & IORING_CQE_F_BUF_MORE) {
+      desc->buf_offsets[buf_idx] = ofs + cqe->res;
+      goto done;
+    }
+    desc->buf_offsets[buf_idx] = 0;
+  }
+  else
+    buf = rd->utf8_encoding ? rb_utf8_str_new(src, cqe->res) : rb_str_new(src, cqe->res);
   
   // add buffer back to buffer ring
-  io_uring_buf_ring_add(
-    desc->br, src, desc->buf_size, buf_idx,
-		io_uring_buf_ring_mask(desc->buf_count), 0
-  );
+  io_uring_buf_ring_add(desc->br, src, desc->buf_size, buf_idx, mask, 0);
   io_uring_buf_ring_advance(desc->br, 1);
+  desc->head++;
 done:
-  rb_hash_aset(OpCtx_spec_get(ctx), SYM_buffer, buf);
   RB_GC_GUARD(buf);
-  return;
+  return buf;
 }
 
-static inline void update_read_buffer(IOURing_t *iour, VALUE ctx, struct io_uring_cqe *cqe) {
-  if (cqe->res < 0) return;
+// Returns the buffer read from a buffer ring, or Qundef for normal reads.
+static inline VALUE update_read_buffer(IOURing_t *iour, VALUE ctx, struct io_uring_cqe *cqe) {
+  if (cqe->res < 0) return Qundef;
 
-  if (cqe->flags & IORING_CQE_F_BUFFER) {
-    update_read_buffer_from_buffer_ring(iour, ctx, cqe);
-    return;
-  }
+  if (cqe->flags & IORING_CQE_F_BUFFER)
+    return update_read_buffer_from_buffer_ring(iour, ctx, cqe);
 
-  if (cqe->res == 0) return;
+  if (cqe->res == 0) return Qundef;
 
+  // reads into registered buffers or IO buffers have no buffer to adjust
   struct read_data *rd = OpCtx_rd_get(ctx);
+  if (!RB_TYPE_P(rd->buffer, T_STRING)) return Qundef;
+
   adjust_read_buffer_len(rd->buffer, cqe->res, rd->buffer_offset);
+  return Qundef;
 }
 
-static inline VALUE get_cqe_ctx(IOURing_t *iour, struct io_uring_cqe *cqe, int *stop_flag, VALUE *spec) {
-  VALUE id = UINT2NUM(cqe->user_data);
-  VALUE ctx = rb_hash_aref(iour->pending_ops, id);
-  VALUE result = INT2NUM(cqe->res);
-  if (NIL_P(ctx)) {
-    *spec = make_empty_op_with_result(id, result);
+// Distributes the number of bytes read among the buffers of a readv op.
+static inline void update_readv_buffers(VALUE ctx, int result) {
+  if (result < 0) return;
+
+  VALUE buffers = OpCtx_rd_get(ctx)->buffer;
+  unsigned count;
+  struct iovec *iovecs = OpCtx_iovecs_get(ctx, &count);
+  unsigned left = (unsigned)result;
+  for (unsigned i = 0; i < count; i++) {
+    unsigned len = left < iovecs[i].iov_len ? left : iovecs[i].iov_len;
+    adjust_read_buffer_len(RARRAY_AREF(buffers, i), len, 0);
+    left -= len;
+  }
+}
+
+// Adds the control messages of a received message to the spec. Timestamps
+// and the GRO segment size are decoded, and any other control messages are
+// put in :cmsgs as [level, type, data] tuples.
+static inline void set_recvmsg_cmsgs(VALUE spec, struct io_uring_recvmsg_out *out, struct msghdr *msg) {
+  VALUE cmsgs = Qnil;
+  struct cmsghdr *cmsg = io_uring_recvmsg_cmsg_firsthdr(out, msg);
+  for (; cmsg; cmsg = io_uring_recvmsg_cmsg_nexthdr(out, msg, cmsg)) {
+    void *data = CMSG_DATA(cmsg);
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+      struct timespec ts;
+      memcpy(&ts, data, sizeof(ts));
+      rb_hash_aset(spec, SYM_timestamp, rb_time_nano_new(ts.tv_sec, ts.tv_nsec));
+    }
+    else if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMP) {
+      struct timeval tv;
+      memcpy(&tv, data, sizeof(tv));
+      rb_hash_aset(spec, SYM_timestamp, rb_time_new(tv.tv_sec, tv.tv_usec));
+    }
+    else if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+      int gro_size;
+      memcpy(&gro_size, data, sizeof(gro_size));
+      rb_hash_aset(spec, SYM_gro_size, INT2NUM(gro_size));
+    }
+    else {
+      if (NIL_P(cmsgs)) cmsgs = rb_ary_new();
+      VALUE str = rb_str_new(data, cmsg->cmsg_len - CMSG_LEN(0));
+      rb_ary_push(cmsgs, rb_ary_new_from_args(3, INT2NUM(cmsg->cmsg_level), INT2NUM(cmsg->cmsg_type), str));
+    }
+  }
+  if (!NIL_P(cmsgs)) rb_hash_aset(spec, SYM_cmsgs, cmsgs);
+}
+
+// Parses a message received by a recvmsg op. The message is laid out in the
+// buffer as an io_uring_recvmsg_out header, followed by the peer address, the
+// control messages and the payload. The header, address and control messages
+// are parsed in place, and only the payload is copied before the buffer is
+// added back to the buffer ring. The peer address is put in the spec as
+// :address.
+static inline VALUE update_recvmsg(IOURing_t *iour, VALUE ctx, struct io_uring_cqe *cqe) {
+  if (cqe->res < 0 || !(cqe->flags & IORING_CQE_F_BUFFER)) return Qundef;
+
+  struct read_data *rd = OpCtx_rd_get(ctx);
+  struct msghdr *msg = &OpCtx_msg_get(ctx)->hdr;
+  struct buf_ring_descriptor *desc = iour->brs[rd->bg_id];
+  unsigned buf_idx = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+  char *src = desc->buf_base + (size_t)desc->buf_size * buf_idx;
+  VALUE spec = OpCtx_spec_get(ctx);
+  VALUE buf = Qnil;
+
+  struct io_uring_recvmsg_out *out = io_uring_recvmsg_validate(src, cqe->res, msg);
+  if (out) {
+    char *payload = io_uring_recvmsg_payload(out, msg);
+    unsigned len = io_uring_recvmsg_payload_length(out, cqe->res, msg);
+    buf = rd->utf8_encoding ? rb_utf8_str_new(payload, len) : rb_str_new(payload, len);
+
+    socklen_t namelen = out->namelen < msg->msg_namelen ? out->namelen : msg->msg_namelen;
+    rb_hash_aset(spec, SYM_address, namelen ? rb_str_new(io_uring_recvmsg_name(out), namelen) : Qnil);
+    if (msg->msg_controllen)
+      set_recvmsg_cmsgs(spec, out, msg);
+  }
+
+  int mask = io_uring_buf_ring_mask(desc->buf_count);
+  io_uring_buf_ring_add(desc->br, src, desc->buf_size, buf_idx, mask, 0);
+  io_uring_buf_ring_advance(desc->br, 1);
+  desc->head++;
+  RB_GC_GUARD(buf);
+  return buf;
+}
+
+// Releases a zero-copy send op upon receiving its notification CQE, and calls
+// the :on_release proc given in the op spec, if any.
+static inline void release_send_zc(IOURing_t *iour, struct op_slot *slot) {
+  VALUE spec = OpCtx_spec_get(slot->ctx);
+  VALUE on_release = NIL_P(spec) ? Qnil : rb_hash_aref(spec, SYM_on_release);
+  op_table_release(&iour->ops, slot);
+
+  if (RTEST(on_release))
+    rb_proc_call_with_block_kw(on_release, 1, &spec, Qnil, Qnil);
+  RB_GC_GUARD(spec);
+}
+
+static inline VALUE untracked_op_sym(__u64 user_data) {
+  switch (OP_USER_DATA_SLOT(user_data)) {
+    case OP_SLOT_MSG:     return SYM_msg;
+    case OP_SLOT_MSG_FD:  return SYM_msg_fd;
+    default:              return Qnil;
+  }
+}
+
+static inline VALUE op_type_sym(enum op_type type) {
+  switch (type) {
+    case OP_accept:   return SYM_accept;
+    case OP_close:    return SYM_close;
+    case OP_connect:  return SYM_connect;
+    case OP_emit:     return SYM_emit;
+    case OP_fallocate: return SYM_fallocate;
+    case OP_fsync:    return SYM_fsync;
+    case OP_openat:   return SYM_openat;
+    case OP_poll:     return SYM_poll;
+    case OP_read:     return SYM_read;
+    case OP_readv:    return SYM_readv;
+    case OP_recv:     return SYM_recv;
+    case OP_recvmsg:  return SYM_recvmsg;
+    case OP_send:     return SYM_send;
+    case OP_send_fd:  return SYM_send_fd;
+    case OP_send_msg: return SYM_send_msg;
+    case OP_sendmsg:  return SYM_sendmsg;
+    case OP_shutdown: return SYM_shutdown;
+    case OP_socket:   return SYM_socket;
+    case OP_splice:   return SYM_splice;
+    case OP_statx:    return SYM_statx;
+    case OP_tee:      return SYM_tee;
+    case OP_timeout:  return SYM_timeout;
+    case OP_unlinkat: return SYM_unlinkat;
+    case OP_write:    return SYM_write;
+    case OP_writev:   return SYM_writev;
+    default:          return Qnil;
+  }
+}
+
+// Returns the value to be yielded for the given CQE. Depending on the
+// completion mode, this is the op spec hash, an IOU::Completion, or Qundef if
+// the completion is to be yielded as (id, result, flags[, buffer]) values, in
+// which case the buffer read from a buffer ring (if any) is put in *buffer.
+// For CQEs that are handled internally and not yielded, *value is Qnil.
+static inline VALUE get_cqe_ctx(IOURing_t *iour, struct io_uring_cqe *cqe, int *stop_flag, VALUE *value, VALUE *proc, VALUE *buffer) {
+  unsigned id_i = OP_USER_DATA_ID(cqe->user_data);
+  *buffer = Qundef;
+  if (proc) *proc = Qnil;
+
+  // linked timeout CQEs are not yielded
+  if (unlikely(cqe->user_data == OP_USER_DATA_INTERNAL)) {
+    *value = Qnil;
+    return Qnil;
+  }
+
+  struct op_slot *slot = op_table_get(&iour->ops, cqe->user_data);
+  if (!slot) {
+    // messages from other rings are yielded with op :msg or :msg_fd
+    VALUE op = untracked_op_sym(cqe->user_data);
+    switch (iour->completion_mode) {
+      case CM_object:
+        *value = Completion_new();
+        Completion_update(*value, id_i, op, cqe->res, cqe->flags, Qnil, Qnil);
+        break;
+      case CM_args:
+        *value = Qundef;
+        break;
+      default:
+        *value = make_empty_op_with_result(UINT2NUM(id_i), INT2NUM(cqe->res));
+        if (!NIL_P(op)) rb_hash_aset(*value, SYM_op, op);
+    }
+    return Qnil;
+  }
+  VALUE ctx = slot->ctx;
+  enum op_type type = OpCtx_type_get(ctx);
+
+  // a zero-copy send posts a notification CQE once the kernel is done with
+  // the buffer. The notification is not yielded.
+  if (unlikely(cqe->flags & IORING_CQE_F_NOTIF)) {
+    release_send_zc(iour, slot);
+    *value = Qnil;
     return Qnil;
   }
 
+  // multishot buffer group ops that ran out of buffers are re-armed, and the
+  // ENOBUFS completion is not yielded
+  if (unlikely(cqe->res == -ENOBUFS) && (type == OP_read || type == OP_recv || type == OP_recvmsg)) {
+    struct read_data *rd = OpCtx_rd_get(ctx);
+    iour->brs[rd->bg_id]->enobufs++;
+    iour->stats.enobufs++;
+    if (rd->multishot && !(cqe->flags & IORING_CQE_F_MORE)) {
+      handle_enobufs(iour, iour->brs[rd->bg_id], cqe->user_data);
+      *value = Qnil;
+      return Qnil;
+    }
+  }
+
   // post completion work
-  switch (OpCtx_type_get(ctx)) {
+  switch (type) {
     case OP_read:
-      update_read_buffer(iour, ctx, cqe);
+    case OP_recv:
+      *buffer = update_read_buffer(iour, ctx, cqe);
+      break;
+    case OP_readv:
+      update_readv_buffers(ctx, cqe->res);
+      break;
+    case OP_recvmsg:
+      *buffer = update_recvmsg(iour, ctx, cqe);
+      break;
+    case OP_accept:
+      // the peer address of a single-shot accept
+      if (cqe->res >= 0 && !NIL_P(OpCtx_spec_get(ctx)) && OpCtx_sa_get(ctx)->len) {
+        struct sa_data *sa = OpCtx_sa_get(ctx);
+        rb_hash_aset(OpCtx_spec_get(ctx), SYM_address, rb_str_new((char *)&sa->addr, sa->len));
+      }
+      break;
+    case OP_poll:
+      // polls tracked by the scheduler have no spec
+      if (cqe->res >= 0 && !NIL_P(OpCtx_spec_get(ctx)))
+        rb_hash_aset(OpCtx_spec_get(ctx), SYM_revents, poll_mask_to_events(cqe->res));
+      break;
+    case OP_statx:
+      if (cqe->res >= 0)
+        rb_hash_aset(OpCtx_spec_get(ctx), SYM_stat, statx_to_hash(OpCtx_statx_get(ctx)));
+      break;
+    case OP_send:
+      if (OpCtx_rd_get(ctx)->bundle)
+        release_send_buffers(iour, ctx, cqe);
       break;
     case OP_emit:
       if (stop_flag && OpCtx_stop_signal_p(ctx))
@@ -553,52 +3140,131 @@ static inline VALUE get_cqe_ctx(IOURing_t *iour, struct io_uring_cqe *cqe, int *
       break;
     default:
   }
-  
+
+  VALUE spec = OpCtx_spec_get(ctx);
+  if (proc) *proc = OpCtx_proc_get(ctx);
+
+  switch (iour->completion_mode) {
+    case CM_object: {
+      *value = OpCtx_completion_get(ctx);
+      VALUE buf = *buffer;
+      if (buf == Qundef)
+        buf = (type == OP_read || type == OP_recv) ? OpCtx_rd_get(ctx)->buffer : Qnil;
+      Completion_update(*value, id_i, op_type_sym(type), cqe->res, cqe->flags, spec, buf);
+      break;
+    }
+    case CM_args:
+      *value = Qundef;
+      break;
+    default:
+      // ops prepped using the fast-path API have no spec
+      *value = NIL_P(spec) ? Qundef : spec;
+  }
+
   // for multishot ops, the IORING_CQE_F_MORE flag indicates more completions
-  // will be coming, so we need to keep the spec. Otherwise, we remove it.
-  if (!(cqe->flags & IORING_CQE_F_MORE))
-    rb_hash_delete(iour->pending_ops, id);
+  // will be coming, so we need to keep the spec. Otherwise, we remove it. The
+  // ctx is released for reuse, so it should not be accessed after this point.
+  if (!(cqe->flags & IORING_CQE_F_MORE)) {
+    if ((type == OP_read || type == OP_recv || type == OP_recvmsg || type == OP_send) && OpCtx_rd_get(ctx)->uses_bg)
+      iour->brs[OpCtx_rd_get(ctx)->bg_id]->ops--;
+    op_table_release(&iour->ops, slot);
+  }
 
-  *spec = OpCtx_spec_get(ctx);
-  rb_hash_aset(*spec, SYM_result, result);
+  if (*value == spec) {
+    rb_hash_aset(spec, SYM_result, INT2NUM(cqe->res));
+    if (*buffer != Qundef)
+      rb_hash_aset(spec, SYM_buffer, *buffer);
+  }
   RB_GC_GUARD(ctx);
+  RB_GC_GUARD(spec);
   return ctx;
 }
 
+static inline int cqe_args(struct io_uring_cqe *cqe, VALUE buffer, VALUE *args) {
+  args[0] = UINT2NUM(OP_USER_DATA_ID(cqe->user_data));
+  args[1] = INT2NUM(cqe->res);
+  args[2] = UINT2NUM(cqe->flags);
+  if (buffer == Qundef) return 3;
+
+  args[3] = buffer;
+  return 4;
+}
+
 VALUE IOURing_wait_for_completion(VALUE self) {
   IOURing_t *iour = get_iou(self);
+  rearm_pending_ops(iour);
 
   wait_for_completion_ctx_t cqe_ctx = {
     .iour = iour
   };
 
-  rb_thread_call_without_gvl(wait_for_completion_without_gvl, (void *)&cqe_ctx, RUBY_UBF_IO, 0);
+  struct io_uring_cqe cqe;
+  VALUE value;
+  VALUE buffer;
+
+  // wait until a CQE that is not handled internally is received
+  do {
+    if (unlikely(iour->posted_count)) {
+      shift_posted_cqe(iour, &cqe);
+      IOURing_count_cqes(iour, 1);
+      get_cqe_ctx(iour, &cqe, 0, &value, 0, &buffer);
+      continue;
+    }
 
-  if (unlikely(cqe_ctx.ret < 0)) {
-    rb_syserr_fail(-cqe_ctx.ret, strerror(-cqe_ctx.ret));
-  }
-  io_uring_cqe_seen(&iour->ring, cqe_ctx.cqe);
+    if (io_uring_cq_ready(&iour->ring))
+      wait_for_completion_without_gvl(&cqe_ctx);
+    else {
+      unsigned long long t0 = monotonic_ns();
+      rb_thread_call_without_gvl(wait_for_completion_without_gvl, (void *)&cqe_ctx, RUBY_UBF_IO, 0);
+      iour->stats.wait_ns += monotonic_ns() - t0;
+      iour->stats.enter_calls += cqe_ctx.enter_calls;
+    }
+
+    if (unlikely(cqe_ctx.ret < 0)) {
+      rb_syserr_fail(-cqe_ctx.ret, strerror(-cqe_ctx.ret));
+    }
+
+    // the CQE is copied so it can be marked as seen before it's processed
+    cqe = *cqe_ctx.cqe;
+    io_uring_cqe_seen(&iour->ring, cqe_ctx.cqe);
+    IOURing_count_cqes(iour, 1);
 
-  VALUE spec = Qnil;
-  get_cqe_ctx(iour, cqe_ctx.cqe, 0, &spec);
-  return spec;
+    get_cqe_ctx(iour, &cqe, 0, &value, 0, &buffer);
+  } while (value == Qnil);
+
+  if (value == Qundef) {
+    VALUE args[4];
+    int argc = cqe_args(&cqe, buffer, args);
+    value = rb_ary_new_from_values(argc, args);
+  }
+  return value;
 }
 
 static inline void process_cqe(IOURing_t *iour, struct io_uring_cqe *cqe, int block_given, int *stop_flag) {
   if (stop_flag) *stop_flag = 0;
-  VALUE spec;
-  VALUE ctx = get_cqe_ctx(iour, cqe, stop_flag, &spec);
+  VALUE value;
+  VALUE proc;
+  VALUE buffer;
+  get_cqe_ctx(iour, cqe, stop_flag, &value, &proc, &buffer);
   if (stop_flag && *stop_flag) return;
-
-  if (block_given)
-    rb_yield(spec);
-  else if (ctx != Qnil) {
-    VALUE proc = OpCtx_proc_get(ctx);
-    if (RTEST(proc))
-      rb_proc_call_with_block_kw(proc, 1, &spec, Qnil, Qnil);
+  if (value == Qnil) return;
+
+  if (value == Qundef) {
+    VALUE args[4];
+    int argc = cqe_args(cqe, buffer, args);
+    if (block_given)
+      rb_yield_values2(argc, args);
+    else if (RTEST(proc))
+      rb_proc_call_with_block_kw(proc, argc, args, Qnil, Qnil);
   }
-
-  RB_GC_GUARD(ctx);
+  else if (block_given)
+    rb_yield(value);
+  else if (RTEST(proc))
+    rb_proc_call_with_block_kw(proc, 1, &value, Qnil, Qnil);
+
+  RB_GC_GUARD(value);
+  RB_GC_GUARD(proc);
+  RB_GC_GUARD(buffer);
 }
 
 // copied from liburing/queue.c
@@ -606,98 +3272,243 @@ static inline bool cq_ring_needs_flush(struct io_uring *ring) {
   return IO_URING_READ_ONCE(*ring->sq.kflags) & IORING_SQ_CQ_OVERFLOW;
 }
 
-// adapted from io_uring_peek_batch_cqe in liburing/queue.c
-// this peeks at cqes and handles each available cqe
-static inline int process_ready_cqes(IOURing_t *iour, int block_given, int *stop_flag) {
-  unsigned total_count = 0;
+// Updates the CQE counters with a batch of processed CQEs.
+void IOURing_count_cqes(IOURing_t *iour, unsigned count) {
+  if (!count) return;
 
-iterate:
+  unsigned bucket = 31 - __builtin_clz(count);
+  if (bucket >= STATS_BATCH_BUCKETS) bucket = STATS_BATCH_BUCKETS - 1;
+  iour->stats.cqes_processed += count;
+  iour->stats.cq_batches[bucket]++;
+}
+
+// Handles ready CQEs: first those posted from userspace, then those in the CQ
+// ring, flushing the kernel's CQ overflow list once if needed. Stops after max
+// CQEs, or when the handler returns non-zero. Returns the number of CQEs
+// handled, which are also added to the CQE counters.
+// adapted from io_uring_peek_batch_cqe in liburing/queue.c
+unsigned IOURing_drain_cqes(IOURing_t *iour, unsigned max, cqe_handler_t handler, void *arg) {
+  unsigned total = 0;
   bool overflow_checked = false;
   struct io_uring_cqe *cqe;
   unsigned head;
-  unsigned count = 0;
+  unsigned count;
+  int stop = 0;
+
+  while (unlikely(iour->posted_count) && total < max) {
+    struct io_uring_cqe posted;
+    shift_posted_cqe(iour, &posted);
+    total++;
+    if (handler(iour, &posted, arg)) goto done;
+  }
+
+iterate:
+  count = 0;
   io_uring_for_each_cqe(&iour->ring, head, cqe) {
+    if (total + count == max) break;
     ++count;
-    if (stop_flag) *stop_flag = 0;
-    process_cqe(iour, cqe, block_given, stop_flag);
-    if (stop_flag && *stop_flag)
+    if (handler(iour, cqe, arg)) {
+      stop = 1;
       break;
+    }
   }
   io_uring_cq_advance(&iour->ring, count);
-  total_count += count;
+  total += count;
 
-  if (overflow_checked) goto done;
-  if (stop_flag && *stop_flag) goto done;
+  if (stop || total == max || overflow_checked) goto done;
 
   if (cq_ring_needs_flush(&iour->ring)) {
-    io_uring_enter(iour->ring.ring_fd, 0, 0, IORING_ENTER_GETEVENTS, NULL);
+    iour->stats.cq_overflow_flushes++;
+    iour->stats.enter_calls++;
+    io_uring_get_events(&iour->ring);
     overflow_checked = true;
     goto iterate;
   }
 
 done:
-  return total_count;
+  IOURing_count_cqes(iour, total);
+  return total;
+}
+
+typedef struct {
+  int block_given;
+  int *stop_flag;
+} process_cqe_ctx_t;
+
+static int process_cqe_handler(IOURing_t *iour, struct io_uring_cqe *cqe, void *arg) {
+  process_cqe_ctx_t *ctx = arg;
+  process_cqe(iour, cqe, ctx->block_given, ctx->stop_flag);
+  return ctx->stop_flag && *ctx->stop_flag;
+}
+
+static inline unsigned process_ready_cqes(IOURing_t *iour, unsigned max, int block_given, int *stop_flag) {
+  process_cqe_ctx_t ctx = {
+    .block_given = block_given,
+    .stop_flag = stop_flag
+  };
+  return IOURing_drain_cqes(iour, max, process_cqe_handler, &ctx);
+}
+
+typedef struct {
+  IOURing_t *iour;
+  unsigned wait_nr;
+  struct __kernel_timespec *ts;
+  int ret;
+} submit_and_wait_ctx_t;
+
+void *submit_and_wait_without_gvl(void *ptr) {
+  submit_and_wait_ctx_t *ctx = (submit_and_wait_ctx_t *)ptr;
+  if (ctx->ts) {
+    struct io_uring_cqe *cqe;
+    ctx->ret = io_uring_submit_and_wait_timeout(&ctx->iour->ring, &cqe, ctx->wait_nr, ctx->ts, NULL);
+  }
+  else
+    ctx->ret = io_uring_submit_and_wait(&ctx->iour->ring, ctx->wait_nr);
+  return NULL;
+}
+
+// Submits any unsubmitted SQEs and waits for at least wait_nr completions (or
+// until the given timeout has elapsed) using a single io_uring_enter call,
+// made without holding the GVL.
+static inline void submit_and_wait(IOURing_t *iour, unsigned wait_nr, struct __kernel_timespec *ts) {
+  rearm_pending_ops(iour);
+  if (unlikely(iour->sqe_queue.count))
+    flush_sqe_queue(iour);
+
+  if (wait_nr && io_uring_cq_ready(&iour->ring) + iour->posted_count >= wait_nr)
+    wait_nr = 0;
+
+  if (!wait_nr) {
+    // with DEFER_TASKRUN, completions are posted only when asking for them
+    if (iour->ring.flags & IORING_SETUP_DEFER_TASKRUN) {
+      // always enters the kernel, in order to get events
+      iour->stats.enter_calls++;
+      int ret = io_uring_submit_and_get_events(&iour->ring);
+      if (ret > 0) iour->stats.sqes_submitted += ret;
+    }
+    else if (iour->unsubmitted_sqes)
+      ring_submit(iour);
+    iour->unsubmitted_sqes = 0;
+    return;
+  }
+
+  submit_and_wait_ctx_t ctx = {
+    .iour = iour,
+    .wait_nr = wait_nr,
+    .ts = ts
+  };
+  iour->unsubmitted_sqes = 0;
+  unsigned long long t0 = monotonic_ns();
+  rb_thread_call_without_gvl(submit_and_wait_without_gvl, (void *)&ctx, RUBY_UBF_IO, 0);
+  iour->stats.wait_ns += monotonic_ns() - t0;
+  // the completions waited for were not available, so the kernel is entered
+  iour->stats.enter_calls++;
+  if (ctx.ret > 0) iour->stats.sqes_submitted += ctx.ret;
+  if (unlikely(ctx.ret < 0 && ctx.ret != -ETIME && ctx.ret != -EINTR))
+    rb_syserr_fail(-ctx.ret, strerror(-ctx.ret));
+}
+
+// Parses the wait_nr: and timeout: options. Returns a pointer to the given
+// timespec if a timeout is specified, otherwise NULL.
+static inline struct __kernel_timespec *get_wait_opts(VALUE opts, unsigned *wait_nr, struct __kernel_timespec *ts) {
+  if (NIL_P(opts)) return NULL;
+
+  VALUE wait_nr_v = rb_hash_aref(opts, SYM_wait_nr);
+  if (!NIL_P(wait_nr_v))
+    *wait_nr = NUM2UINT(wait_nr_v);
+
+  VALUE timeout = rb_hash_aref(opts, SYM_timeout);
+  if (NIL_P(timeout)) return NULL;
+
+  if (!*wait_nr) *wait_nr = 1;
+  *ts = value_to_timespec(timeout);
+  return ts;
 }
 
 VALUE IOURing_process_completions(int argc, VALUE *argv, VALUE self) {
   IOURing_t *iour = get_iou(self);
   int block_given = rb_block_given_p();
   VALUE wait;
+  VALUE opts;
 
-  rb_scan_args(argc, argv, "01", &wait);
-  int wait_i = RTEST(wait);
-  unsigned count = 0;
+  rb_scan_args(argc, argv, "01:", &wait, &opts);
+  unsigned wait_nr = RTEST(wait) ? 1 : 0;
+  struct __kernel_timespec ts;
+  struct __kernel_timespec *ts_ptr = get_wait_opts(opts, &wait_nr, &ts);
 
-  // automatically submit any unsubmitted SQEs
-  if (iour->unsubmitted_sqes) {
-    io_uring_submit(&iour->ring);
-    iour->unsubmitted_sqes = 0;
-  }
+  submit_and_wait(iour, wait_nr, ts_ptr);
+  return UINT2NUM(process_ready_cqes(iour, UINT_MAX, block_given, 0));
+}
 
-  if (wait_i) {
-    wait_for_completion_ctx_t ctx = { .iour = iour };
+#define CQE_BATCH_MAX 256
 
-    rb_thread_call_without_gvl(wait_for_completion_without_gvl, (void *)&ctx, RUBY_UBF_IO, 0);
-    if (unlikely(ctx.ret < 0)) {
-      rb_syserr_fail(-ctx.ret, strerror(-ctx.ret));
-    }
-    ++count;
-    io_uring_cqe_seen(&iour->ring, ctx.cqe);
-    process_cqe(iour, ctx.cqe, block_given, 0);
-  }
+VALUE IOURing_process_completions_batch(int argc, VALUE *argv, VALUE self) {
+  IOURing_t *iour = get_iou(self);
+  int block_given = rb_block_given_p();
+  VALUE max;
+  VALUE opts;
+
+  rb_scan_args(argc, argv, "01:", &max, &opts);
+  unsigned max_i = NIL_P(max) ? CQE_BATCH_MAX : NUM2UINT(max);
+  unsigned wait_nr = 0;
+  struct __kernel_timespec ts;
+  struct __kernel_timespec *ts_ptr = get_wait_opts(opts, &wait_nr, &ts);
 
-  count += process_ready_cqes(iour, block_given, 0);
-  return UINT2NUM(count);
+  submit_and_wait(iour, wait_nr, ts_ptr);
+  return UINT2NUM(process_ready_cqes(iour, max_i, block_given, 0));
 }
 
 VALUE IOURing_process_completions_loop(VALUE self) {
   IOURing_t *iour = get_iou(self);
   int block_given = rb_block_given_p();
   int stop_flag = 0;
-  wait_for_completion_ctx_t ctx = { .iour = iour };
 
   while (1) {
-    // automatically submit any unsubmitted SQEs
-    if (iour->unsubmitted_sqes) {
-      io_uring_submit(&iour->ring);
-      iour->unsubmitted_sqes = 0;
-    }
-
-    rb_thread_call_without_gvl(wait_for_completion_without_gvl, (void *)&ctx, RUBY_UBF_IO, 0);
-    if (unlikely(ctx.ret < 0)) {
-      rb_syserr_fail(-ctx.ret, strerror(-ctx.ret));
-    }
-    io_uring_cqe_seen(&iour->ring, ctx.cqe);
-    process_cqe(iour, ctx.cqe, block_given, &stop_flag);
-    if (stop_flag) goto done;
-
-    process_ready_cqes(iour, block_given, &stop_flag);
+    submit_and_wait(iour, 1, NULL);
+    process_ready_cqes(iour, UINT_MAX, block_given, &stop_flag);
     if (stop_flag) goto done;
   }
 done:
   return self;
 }
 
+// The following functions are used by IOU::Scheduler, which preps ops and
+// handles their completions directly, without op specs. The proc of such ops
+// is the fiber waiting for the op.
+
+struct io_uring_sqe *IOURing_get_sqes(IOURing_t *iour, unsigned count) {
+  return get_sqes(iour, count);
+}
+
+VALUE IOURing_track_op(IOURing_t *iour, enum op_type type, VALUE proc, __u64 *user_data) {
+  unsigned id = next_op_id(iour);
+  return store_op_ctx(iour->self, iour, type, id, Qnil, proc, user_data);
+}
+
+// Returns the proc of the given op, or Qundef if the op is not tracked.
+VALUE IOURing_op_proc(IOURing_t *iour, __u64 user_data) {
+  struct op_slot *slot = op_table_get(&iour->ops, user_data);
+  return slot ? OpCtx_proc_get(slot->ctx) : Qundef;
+}
+
+void IOURing_release_op(IOURing_t *iour, __u64 user_data) {
+  struct op_slot *slot = op_table_get(&iour->ops, user_data);
+  if (slot) op_table_release(&iour->ops, slot);
+}
+
+// Cancels the given op and stops tracking it, so its completion is ignored.
+void IOURing_cancel_op(IOURing_t *iour, __u64 user_data) {
+  struct io_uring_sqe *sqe = get_sqe(iour);
+  io_uring_prep_cancel64(sqe, user_data, 0);
+  sqe->user_data = OP_USER_DATA_INTERNAL;
+  iour->unsubmitted_sqes++;
+  IOURing_release_op(iour, user_data);
+}
+
+void IOURing_submit_and_wait(IOURing_t *iour, unsigned wait_nr) {
+  submit_and_wait(iour, wait_nr, NULL);
+}
+
 #define MAKE_SYM(sym) ID2SYM(rb_intern(sym))
 
 void Init_IOURing(void) {
@@ -707,49 +3518,200 @@ void Init_IOURing(void) {
   cRing = rb_define_class_under(mIOU, "Ring", rb_cObject);
   rb_define_alloc_func(cRing, IOURing_allocate);
 
-  rb_define_method(cRing, "initialize", IOURing_initialize, 0);
+  rb_define_method(cRing, "initialize", IOURing_initialize, -1);
   rb_define_method(cRing, "close", IOURing_close, 0);
   rb_define_method(cRing, "closed?", IOURing_closed_p, 0);
+  rb_define_method(cRing, "features", IOURing_features, 0);
+  rb_define_method(cRing, "sq_queue_depth", IOURing_sq_queue_depth, 0);
   rb_define_method(cRing, "pending_ops", IOURing_pending_ops, 0);
+  rb_define_method(cRing, "stats", IOURing_stats, 0);
+  rb_define_method(cRing, "reset_stats", IOURing_reset_stats, 0);
+  rb_define_method(cRing, "completion_mode", IOURing_completion_mode, 0);
+  rb_define_method(cRing, "completion_mode=", IOURing_completion_mode_set, 1);
   rb_define_method(cRing, "setup_buffer_ring", IOURing_setup_buffer_ring, 1);
+  rb_define_method(cRing, "buffer_ring_push", IOURing_buffer_ring_push, 2);
+  rb_define_method(cRing, "release_buffer", IOURing_release_buffer, 1);
+  rb_define_method(cRing, "buffer_ring_stats", IOURing_buffer_ring_stats, 1);
+  rb_define_method(cRing, "free_buffer_ring", IOURing_free_buffer_ring, 1);
+  rb_define_method(cRing, "register_files", IOURing_register_files, 1);
+  rb_define_method(cRing, "unregister_files", IOURing_unregister_files, 0);
+  rb_define_method(cRing, "register_file", IOURing_register_file, 1);
+  rb_define_method(cRing, "unregister_file", IOURing_unregister_file, 1);
+  rb_define_method(cRing, "register_buffers", IOURing_register_buffers, 1);
 
   rb_define_method(cRing, "emit", IOURing_emit, 1);
+  rb_define_method(cRing, "send_msg", IOURing_send_msg, -1);
+  rb_define_method(cRing, "send_fd", IOURing_send_fd, 2);
 
   rb_define_method(cRing, "prep_accept", IOURing_prep_accept, 1);
   rb_define_method(cRing, "prep_cancel", IOURing_prep_cancel, 1);
   rb_define_method(cRing, "prep_close", IOURing_prep_close, 1);
   rb_define_method(cRing, "prep_nop", IOURing_prep_nop, 0);
   rb_define_method(cRing, "prep_read", IOURing_prep_read, 1);
+  rb_define_method(cRing, "prep_recv", IOURing_prep_recv, 1);
+  rb_define_method(cRing, "prep_send", IOURing_prep_send, 1);
   rb_define_method(cRing, "prep_timeout", IOURing_prep_timeout, 1);
   rb_define_method(cRing, "prep_write", IOURing_prep_write, 1);
+  rb_define_method(cRing, "prep_readv", IOURing_prep_readv, 1);
+  rb_define_method(cRing, "prep_writev", IOURing_prep_writev, 1);
+  rb_define_method(cRing, "prep_splice", IOURing_prep_splice, 1);
+  rb_define_method(cRing, "prep_tee", IOURing_prep_tee, 1);
+  rb_define_method(cRing, "prep_openat", IOURing_prep_openat, 1);
+  rb_define_method(cRing, "prep_statx", IOURing_prep_statx, 1);
+  rb_define_method(cRing, "prep_fsync", IOURing_prep_fsync, 1);
+  rb_define_method(cRing, "prep_fallocate", IOURing_prep_fallocate, 1);
+  rb_define_method(cRing, "prep_unlinkat", IOURing_prep_unlinkat, 1);
+  rb_define_method(cRing, "prep_poll", IOURing_prep_poll, 1);
+  rb_define_method(cRing, "prep_poll_update", IOURing_prep_poll_update, 1);
+  rb_define_method(cRing, "prep_socket", IOURing_prep_socket, 1);
+  rb_define_method(cRing, "prep_connect", IOURing_prep_connect, 1);
+  rb_define_method(cRing, "prep_shutdown", IOURing_prep_shutdown, 1);
+  rb_define_method(cRing, "prep_recvmsg", IOURing_prep_recvmsg, 1);
+  rb_define_method(cRing, "prep_sendmsg", IOURing_prep_sendmsg, 1);
+
+  rb_define_method(cRing, "prep_accept_fast", IOURing_prep_accept_fast, 1);
+  rb_define_method(cRing, "prep_close_fast", IOURing_prep_close_fast, 1);
+  rb_define_method(cRing, "prep_read_fast", IOURing_prep_read_fast, 3);
+  rb_define_method(cRing, "prep_timeout_fast", IOURing_prep_timeout_fast, 1);
+  rb_define_method(cRing, "prep_write_fast", IOURing_prep_write_fast, -1);
 
   rb_define_method(cRing, "submit", IOURing_submit, 0);
   rb_define_method(cRing, "wait_for_completion", IOURing_wait_for_completion, 0);
   rb_define_method(cRing, "process_completions", IOURing_process_completions, -1);
+  rb_define_method(cRing, "process_completions_batch", IOURing_process_completions_batch, -1);
   rb_define_method(cRing, "process_completions_loop", IOURing_process_completions_loop, 0);
 
-  SYM_accept        = MAKE_SYM("accept");
-  SYM_block         = MAKE_SYM("block");
-  SYM_buffer        = MAKE_SYM("buffer");
-  SYM_buffer_group  = MAKE_SYM("buffer_group");
-  SYM_buffer_offset = MAKE_SYM("buffer_offset");
-  SYM_close         = MAKE_SYM("close");
-  SYM_count         = MAKE_SYM("count");
-  SYM_emit          = MAKE_SYM("emit");
-  SYM_fd            = MAKE_SYM("fd");
-  SYM_id            = MAKE_SYM("id");
-  SYM_interval      = MAKE_SYM("interval");
-  SYM_len           = MAKE_SYM("len");
-  SYM_link          = MAKE_SYM("link");
-  SYM_multishot     = MAKE_SYM("multishot");
-  SYM_op            = MAKE_SYM("op");
-  SYM_read          = MAKE_SYM("read");
-  SYM_result        = MAKE_SYM("result");
-  SYM_signal        = MAKE_SYM("signal");
-  SYM_size          = MAKE_SYM("size");
-  SYM_spec_data     = MAKE_SYM("spec_data");
-  SYM_stop          = MAKE_SYM("stop");
-  SYM_timeout       = MAKE_SYM("timeout");
-  SYM_utf8          = MAKE_SYM("utf8");
-  SYM_write         = MAKE_SYM("write");
+  SYM_accept           = MAKE_SYM("accept");
+  SYM_address          = MAKE_SYM("address");
+  SYM_args             = MAKE_SYM("args");
+  SYM_atime            = MAKE_SYM("atime");
+  SYM_blksize          = MAKE_SYM("blksize");
+  SYM_block            = MAKE_SYM("block");
+  SYM_blocks           = MAKE_SYM("blocks");
+  SYM_btime            = MAKE_SYM("btime");
+  SYM_buffer           = MAKE_SYM("buffer");
+  SYM_buffer_group     = MAKE_SYM("buffer_group");
+  SYM_buffer_index     = MAKE_SYM("buffer_index");
+  SYM_buffer_offset    = MAKE_SYM("buffer_offset");
+  SYM_buffers          = MAKE_SYM("buffers");
+  SYM_bundle           = MAKE_SYM("bundle");
+  SYM_close            = MAKE_SYM("close");
+  SYM_cmsgs            = MAKE_SYM("cmsgs");
+  SYM_connect          = MAKE_SYM("connect");
+  SYM_control_len      = MAKE_SYM("control_len");
+  SYM_coop_taskrun     = MAKE_SYM("coop_taskrun");
+  SYM_count            = MAKE_SYM("count");
+  SYM_cq_batches       = MAKE_SYM("cq_batches");
+  SYM_cq_entries       = MAKE_SYM("cq_entries");
+  SYM_cq_overflow_flushes = MAKE_SYM("cq_overflow_flushes");
+  SYM_cqes_processed   = MAKE_SYM("cqes_processed");
+  SYM_ctime            = MAKE_SYM("ctime");
+  SYM_data             = MAKE_SYM("data");
+  SYM_datasync         = MAKE_SYM("datasync");
+  SYM_defer_taskrun    = MAKE_SYM("defer_taskrun");
+  SYM_dir              = MAKE_SYM("dir");
+  SYM_dir_fd           = MAKE_SYM("dir_fd");
+  SYM_direct           = MAKE_SYM("direct");
+  SYM_domain           = MAKE_SYM("domain");
+  SYM_emit             = MAKE_SYM("emit");
+  SYM_enobufs          = MAKE_SYM("enobufs");
+  SYM_enter_calls      = MAKE_SYM("enter_calls");
+  SYM_entries          = MAKE_SYM("entries");
+  SYM_err              = MAKE_SYM("err");
+  SYM_events           = MAKE_SYM("events");
+  SYM_fallocate        = MAKE_SYM("fallocate");
+  SYM_fd               = MAKE_SYM("fd");
+  SYM_fd_in            = MAKE_SYM("fd_in");
+  SYM_fd_out           = MAKE_SYM("fd_out");
+  SYM_fixed_fd         = MAKE_SYM("fixed_fd");
+  SYM_fixed_fd_in      = MAKE_SYM("fixed_fd_in");
+  SYM_fixed_fd_out     = MAKE_SYM("fixed_fd_out");
+  SYM_flags            = MAKE_SYM("flags");
+  SYM_free             = MAKE_SYM("free");
+  SYM_fsync            = MAKE_SYM("fsync");
+  SYM_gid              = MAKE_SYM("gid");
+  SYM_gro_size         = MAKE_SYM("gro_size");
+  SYM_hash             = MAKE_SYM("hash");
+  SYM_how              = MAKE_SYM("how");
+  SYM_hugepages        = MAKE_SYM("hugepages");
+  SYM_hup              = MAKE_SYM("hup");
+  SYM_id               = MAKE_SYM("id");
+  SYM_in               = MAKE_SYM("in");
+  SYM_in_flight        = MAKE_SYM("in_flight");
+  SYM_incremental      = MAKE_SYM("incremental");
+  SYM_ino              = MAKE_SYM("ino");
+  SYM_interval         = MAKE_SYM("interval");
+  SYM_kernel_mapped    = MAKE_SYM("kernel_mapped");
+  SYM_len              = MAKE_SYM("len");
+  SYM_link             = MAKE_SYM("link");
+  SYM_mask             = MAKE_SYM("mask");
+  SYM_mlock            = MAKE_SYM("mlock");
+  SYM_mode             = MAKE_SYM("mode");
+  SYM_msg              = MAKE_SYM("msg");
+  SYM_msg_fd           = MAKE_SYM("msg_fd");
+  SYM_mtime            = MAKE_SYM("mtime");
+  SYM_multishot        = MAKE_SYM("multishot");
+  SYM_nlink            = MAKE_SYM("nlink");
+  SYM_object           = MAKE_SYM("object");
+  SYM_off_in           = MAKE_SYM("off_in");
+  SYM_off_out          = MAKE_SYM("off_out");
+  SYM_offset           = MAKE_SYM("offset");
+  SYM_on_release       = MAKE_SYM("on_release");
+  SYM_op               = MAKE_SYM("op");
+  SYM_openat           = MAKE_SYM("openat");
+  SYM_out              = MAKE_SYM("out");
+  SYM_parked           = MAKE_SYM("parked");
+  SYM_path             = MAKE_SYM("path");
+  SYM_pending_ops      = MAKE_SYM("pending_ops");
+  SYM_poll             = MAKE_SYM("poll");
+  SYM_pri              = MAKE_SYM("pri");
+  SYM_protocol         = MAKE_SYM("protocol");
+  SYM_queue            = MAKE_SYM("queue");
+  SYM_raise            = MAKE_SYM("raise");
+  SYM_rdhup            = MAKE_SYM("rdhup");
+  SYM_read             = MAKE_SYM("read");
+  SYM_readv            = MAKE_SYM("readv");
+  SYM_recv             = MAKE_SYM("recv");
+  SYM_recvmsg          = MAKE_SYM("recvmsg");
+  SYM_register_ring_fd = MAKE_SYM("register_ring_fd");
+  SYM_result           = MAKE_SYM("result");
+  SYM_revents          = MAKE_SYM("revents");
+  SYM_segment_size     = MAKE_SYM("segment_size");
+  SYM_send             = MAKE_SYM("send");
+  SYM_send_fd          = MAKE_SYM("send_fd");
+  SYM_send_msg         = MAKE_SYM("send_msg");
+  SYM_sendmsg          = MAKE_SYM("sendmsg");
+  SYM_shutdown         = MAKE_SYM("shutdown");
+  SYM_signal           = MAKE_SYM("signal");
+  SYM_single_issuer    = MAKE_SYM("single_issuer");
+  SYM_size             = MAKE_SYM("size");
+  SYM_socket           = MAKE_SYM("socket");
+  SYM_spec_data        = MAKE_SYM("spec_data");
+  SYM_splice           = MAKE_SYM("splice");
+  SYM_sq_full          = MAKE_SYM("sq_full");
+  SYM_sq_overflow      = MAKE_SYM("sq_overflow");
+  SYM_sq_thread_cpu    = MAKE_SYM("sq_thread_cpu");
+  SYM_sq_thread_idle   = MAKE_SYM("sq_thread_idle");
+  SYM_sqes_prepped     = MAKE_SYM("sqes_prepped");
+  SYM_sqes_submitted   = MAKE_SYM("sqes_submitted");
+  SYM_sqpoll           = MAKE_SYM("sqpoll");
+  SYM_stat             = MAKE_SYM("stat");
+  SYM_statx            = MAKE_SYM("statx");
+  SYM_stop             = MAKE_SYM("stop");
+  SYM_submit           = MAKE_SYM("submit");
+  SYM_submit_all       = MAKE_SYM("submit_all");
+  SYM_target           = MAKE_SYM("target");
+  SYM_tee              = MAKE_SYM("tee");
+  SYM_timeout          = MAKE_SYM("timeout");
+  SYM_timestamp        = MAKE_SYM("timestamp");
+  SYM_type             = MAKE_SYM("type");
+  SYM_uid              = MAKE_SYM("uid");
+  SYM_unlinkat         = MAKE_SYM("unlinkat");
+  SYM_utf8             = MAKE_SYM("utf8");
+  SYM_view             = MAKE_SYM("view");
+  SYM_wait_nr          = MAKE_SYM("wait_nr");
+  SYM_wait_time        = MAKE_SYM("wait_time");
+  SYM_write            = MAKE_SYM("write");
+  SYM_writev           = MAKE_SYM("writev");
+  SYM_zc               = MAKE_SYM("zc");
 }
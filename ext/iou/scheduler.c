@@ -0,0 +1,470 @@
+#include "iou.h"
+#include "ruby/io.h"
+#include "ruby/io/buffer.h"
+#include <sys/eventfd.h>
+#include <poll.h>
+
+VALUE cScheduler;
+
+ID ID_exception;
+
+// user_data of the eventfd read used for waking up the scheduler
+#define WAKEUP_USER_DATA OP_USER_DATA(0, 0)
+
+// file position used by read and write ops for reading / writing at the
+// current position
+#define CURRENT_POSITION ((__u64)-1)
+
+static void Scheduler_mark(void *ptr) {
+  Scheduler_t *s = ptr;
+  rb_gc_mark_movable(s->ring);
+  rb_gc_mark_movable(s->thread);
+  rb_gc_mark_movable(s->runqueue);
+  rb_gc_mark_movable(s->waiting);
+}
+
+static void Scheduler_compact(void *ptr) {
+  Scheduler_t *s = ptr;
+  s->ring = rb_gc_location(s->ring);
+  s->thread = rb_gc_location(s->thread);
+  s->runqueue = rb_gc_location(s->runqueue);
+  s->waiting = rb_gc_location(s->waiting);
+}
+
+static void Scheduler_free(void *ptr) {
+  Scheduler_t *s = ptr;
+  if (s->wakeup_fd >= 0) close(s->wakeup_fd);
+  xfree(s);
+}
+
+static size_t Scheduler_size(const void *ptr) {
+  return sizeof(Scheduler_t);
+}
+
+static const rb_data_type_t Scheduler_type = {
+    "Scheduler",
+    {Scheduler_mark, Scheduler_free, Scheduler_size, Scheduler_compact},
+    0, 0, RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_WB_PROTECTED
+};
+
+static VALUE Scheduler_allocate(VALUE klass) {
+  Scheduler_t *s = ALLOC(Scheduler_t);
+  s->ring = Qnil;
+  s->iour = NULL;
+  s->thread = Qnil;
+  s->runqueue = Qnil;
+  s->waiting = Qnil;
+  s->wakeup_fd = -1;
+  s->wakeup_value = 0;
+
+  return TypedData_Wrap_Struct(klass, &Scheduler_type, s);
+}
+
+static inline Scheduler_t *get_scheduler(VALUE self) {
+  Scheduler_t *s = RTYPEDDATA_DATA(self);
+  if (!s->iour)
+    rb_raise(rb_eRuntimeError, "Scheduler is closed");
+  return s;
+}
+
+static inline void arm_wakeup(Scheduler_t *s) {
+  struct io_uring_sqe *sqe = IOURing_get_sqes(s->iour, 1);
+  io_uring_prep_read(sqe, s->wakeup_fd, &s->wakeup_value, sizeof(s->wakeup_value), 0);
+  sqe->user_data = WAKEUP_USER_DATA;
+  s->iour->unsubmitted_sqes++;
+}
+
+// Creates a scheduler. The given options are passed to IOU::Ring.new.
+VALUE Scheduler_initialize(int argc, VALUE *argv, VALUE self) {
+  Scheduler_t *s = RTYPEDDATA_DATA(self);
+  VALUE opts;
+
+  rb_scan_args(argc, argv, "0:", &opts);
+  VALUE ring = NIL_P(opts) ?
+    rb_class_new_instance(0, NULL, cRing) :
+    rb_class_new_instance_kw(1, &opts, cRing, RB_PASS_KEYWORDS);
+
+  RB_OBJ_WRITE(self, &s->ring, ring);
+  RB_OBJ_WRITE(self, &s->thread, rb_thread_current());
+  RB_OBJ_WRITE(self, &s->runqueue, rb_ary_new());
+  RB_OBJ_WRITE(self, &s->waiting, rb_hash_new());
+  s->iour = get_iou(ring);
+
+  s->wakeup_fd = eventfd(0, EFD_CLOEXEC);
+  if (s->wakeup_fd < 0)
+    rb_syserr_fail(errno, strerror(errno));
+  arm_wakeup(s);
+  return self;
+}
+
+static inline void schedule(Scheduler_t *s, VALUE fiber, VALUE value) {
+  rb_ary_push(s->runqueue, fiber);
+  rb_ary_push(s->runqueue, value);
+}
+
+// Schedules the fiber waiting for the op, if it is still waiting. A fiber that
+// stopped waiting (e.g. because it was raised by #timeout_after) is ignored.
+// The value of an expired #timeout_after timer is the timer itself, which is
+// turned into an exception when the fiber is resumed.
+static inline void handle_cqe(Scheduler_t *s, struct io_uring_cqe *cqe) {
+  if (cqe->user_data == WAKEUP_USER_DATA) {
+    arm_wakeup(s);
+    return;
+  }
+
+  // completions of internal and cancelled ops are ignored
+  VALUE proc = IOURing_op_proc(s->iour, cqe->user_data);
+  if (proc == Qundef) return;
+
+  IOURing_release_op(s->iour, cqe->user_data);
+  if (RB_TYPE_P(proc, T_ARRAY)) {
+    if (cqe->res != -ETIME) return;
+
+    VALUE fiber = RARRAY_AREF(proc, 0);
+    if (NIL_P(rb_hash_delete(s->waiting, fiber))) return;
+    schedule(s, fiber, proc);
+    return;
+  }
+
+  if (NIL_P(rb_hash_delete(s->waiting, proc))) return;
+  schedule(s, proc, INT2NUM(cqe->res));
+}
+
+static int handle_cqe_handler(IOURing_t *iour, struct io_uring_cqe *cqe, void *arg) {
+  handle_cqe((Scheduler_t *)arg, cqe);
+  return 0;
+}
+
+static inline void process_cqes(Scheduler_t *s) {
+  IOURing_drain_cqes(s->iour, UINT_MAX, handle_cqe_handler, s);
+}
+
+// Resumes the fibers that are runnable at the time of the call. Fibers
+// scheduled in the meantime are resumed on the next call.
+static inline void resume_runnable(Scheduler_t *s) {
+  long count = RARRAY_LEN(s->runqueue) / 2;
+  for (long i = 0; i < count; i++) {
+    VALUE fiber = rb_ary_shift(s->runqueue);
+    VALUE value = rb_ary_shift(s->runqueue);
+    if (!RTEST(rb_fiber_alive_p(fiber))) continue;
+
+    if (RB_TYPE_P(value, T_ARRAY)) {
+      VALUE args = RARRAY_AREF(value, 2);
+      VALUE exception = rb_funcallv(RARRAY_AREF(value, 1), ID_exception, RARRAY_LENINT(args), RARRAY_CONST_PTR(args));
+      rb_fiber_raise(fiber, 1, &exception);
+    }
+    else
+      rb_fiber_resume(fiber, 1, &value);
+  }
+}
+
+// Runs the event loop until there are no more runnable or waiting fibers.
+VALUE Scheduler_run(VALUE self) {
+  Scheduler_t *s = get_scheduler(self);
+
+  while (RARRAY_LEN(s->runqueue) || RHASH_SIZE(s->waiting)) {
+    IOURing_submit_and_wait(s->iour, RARRAY_LEN(s->runqueue) ? 0 : 1);
+    process_cqes(s);
+    resume_runnable(s);
+  }
+  return self;
+}
+
+struct wait_ctx {
+  Scheduler_t *s;
+  VALUE fiber;
+  __u64 user_data;
+};
+
+static VALUE wait_yield(VALUE arg) {
+  return rb_fiber_yield(0, NULL);
+}
+
+// If the fiber was resumed by an exception (e.g. by #timeout_after or
+// Fiber#raise), the op it was waiting for is cancelled.
+static VALUE wait_ensure(VALUE arg) {
+  struct wait_ctx *ctx = (struct wait_ctx *)arg;
+  rb_hash_delete(ctx->s->waiting, ctx->fiber);
+  if (ctx->user_data && ctx->s->iour && IOURing_op_proc(ctx->s->iour, ctx->user_data) != Qundef)
+    IOURing_cancel_op(ctx->s->iour, ctx->user_data);
+  return Qnil;
+}
+
+// Suspends the fiber until it is scheduled, either upon completion of the
+// given op, or, if unblockable, by #unblock. Returns the value the fiber was
+// scheduled with: the op result, or true if unblocked.
+static VALUE fiber_wait(Scheduler_t *s, VALUE fiber, __u64 user_data, int unblockable) {
+  rb_hash_aset(s->waiting, fiber, unblockable ? Qtrue : Qfalse);
+  struct wait_ctx ctx = {
+    .s = s,
+    .fiber = fiber,
+    .user_data = user_data
+  };
+  return rb_ensure(wait_yield, (VALUE)&ctx, wait_ensure, (VALUE)&ctx);
+}
+
+// Returns an SQE for an op whose completion schedules the given fiber (or
+// for #timeout_after, raises it). Room is made for sqe_count SQEs.
+static inline struct io_uring_sqe *get_op_sqe(Scheduler_t *s, enum op_type type, VALUE proc, unsigned sqe_count, VALUE *ctx, __u64 *user_data) {
+  struct io_uring_sqe *sqe = IOURing_get_sqes(s->iour, sqe_count);
+  *ctx = IOURing_track_op(s->iour, type, proc, user_data);
+  s->iour->unsubmitted_sqes++;
+  return sqe;
+}
+
+static inline int wait_rw(Scheduler_t *s, VALUE fiber, enum op_type type, int fd, char *ptr, size_t len, __u64 from) {
+  VALUE ctx;
+  __u64 user_data;
+  struct io_uring_sqe *sqe = get_op_sqe(s, type, fiber, 1, &ctx, &user_data);
+  if (type == OP_read)
+    io_uring_prep_read(sqe, fd, ptr, len, from);
+  else
+    io_uring_prep_write(sqe, fd, ptr, len, from);
+  sqe->user_data = user_data;
+  return NUM2INT(fiber_wait(s, fiber, user_data, 0));
+}
+
+// Polls the fd for the given events. Returns the ready events, or -ECANCELED
+// if the timeout has elapsed.
+static inline int wait_poll(Scheduler_t *s, VALUE fiber, int fd, unsigned events, VALUE timeout) {
+  VALUE ctx;
+  __u64 user_data;
+  struct io_uring_sqe *sqe = get_op_sqe(s, OP_poll, fiber, NIL_P(timeout) ? 1 : 2, &ctx, &user_data);
+  io_uring_prep_poll_add(sqe, fd, events);
+  sqe->user_data = user_data;
+  IOURing_link_timeout(s->iour, ctx, sqe, timeout);
+  return NUM2INT(fiber_wait(s, fiber, user_data, 0));
+}
+
+// Waits for the given duration, or until unblocked. Returns true if unblocked.
+static inline VALUE wait_timeout(Scheduler_t *s, VALUE fiber, VALUE duration) {
+  struct __kernel_timespec ts = value_to_timespec(duration);
+  VALUE ctx;
+  __u64 user_data;
+  struct io_uring_sqe *sqe = get_op_sqe(s, OP_timeout, fiber, 1, &ctx, &user_data);
+  *OpCtx_ts_get(ctx) = ts;
+  io_uring_prep_timeout(sqe, OpCtx_ts_get(ctx), 0, 0);
+  sqe->user_data = user_data;
+  return fiber_wait(s, fiber, user_data, 1) == Qtrue ? Qtrue : Qfalse;
+}
+
+// Reads or writes at least length bytes (or once, if length is 0). Ops on
+// non-blocking fds that fail with EAGAIN are retried once the fd is ready.
+// Returns the number of bytes read / written, or -errno.
+static VALUE io_rw(Scheduler_t *s, enum op_type type, VALUE io, char *ptr, size_t size, size_t length, __u64 from) {
+  VALUE fiber = rb_fiber_current();
+  int fd = rb_io_descriptor(io);
+  size_t total = 0;
+
+  while (1) {
+    int res = wait_rw(s, fiber, type, fd, ptr + total, size - total, from);
+    if (res == -EAGAIN) {
+      res = wait_poll(s, fiber, fd, type == OP_read ? POLLIN : POLLOUT, Qnil);
+      if (res < 0) return total ? SIZET2NUM(total) : INT2NUM(res);
+      continue;
+    }
+    if (res == -EINTR) continue;
+    if (res < 0) return total ? SIZET2NUM(total) : INT2NUM(res);
+    if (res == 0) break;
+
+    total += res;
+    if (from != CURRENT_POSITION) from += res;
+    if (total >= length || total == size) break;
+  }
+  return SIZET2NUM(total);
+}
+
+static inline char *get_buffer_ptr(VALUE buffer, VALUE offset, int write, size_t *size) {
+  void *base;
+  if (write)
+    rb_io_buffer_get_bytes_for_writing(buffer, &base, size);
+  else
+    rb_io_buffer_get_bytes_for_reading(buffer, (const void **)&base, size);
+
+  size_t ofs = NUM2SIZET(offset);
+  if (ofs > *size)
+    rb_raise(rb_eArgError, "Offset exceeds buffer size");
+  *size -= ofs;
+  return (char *)base + ofs;
+}
+
+VALUE Scheduler_io_read(VALUE self, VALUE io, VALUE buffer, VALUE length, VALUE offset) {
+  Scheduler_t *s = get_scheduler(self);
+  size_t size;
+  char *ptr = get_buffer_ptr(buffer, offset, 1, &size);
+  return io_rw(s, OP_read, io, ptr, size, NUM2SIZET(length), CURRENT_POSITION);
+}
+
+VALUE Scheduler_io_write(VALUE self, VALUE io, VALUE buffer, VALUE length, VALUE offset) {
+  Scheduler_t *s = get_scheduler(self);
+  size_t size;
+  char *ptr = get_buffer_ptr(buffer, offset, 0, &size);
+  return io_rw(s, OP_write, io, ptr, size, NUM2SIZET(length), CURRENT_POSITION);
+}
+
+VALUE Scheduler_io_pread(VALUE self, VALUE io, VALUE buffer, VALUE from, VALUE length, VALUE offset) {
+  Scheduler_t *s = get_scheduler(self);
+  size_t size;
+  char *ptr = get_buffer_ptr(buffer, offset, 1, &size);
+  return io_rw(s, OP_read, io, ptr, size, NUM2SIZET(length), NUM2ULL(from));
+}
+
+VALUE Scheduler_io_pwrite(VALUE self, VALUE io, VALUE buffer, VALUE from, VALUE length, VALUE offset) {
+  Scheduler_t *s = get_scheduler(self);
+  size_t size;
+  char *ptr = get_buffer_ptr(buffer, offset, 0, &size);
+  return io_rw(s, OP_write, io, ptr, size, NUM2SIZET(length), NUM2ULL(from));
+}
+
+// IO::READABLE, IO::PRIORITY and IO::WRITABLE have the same values as POLLIN,
+// POLLPRI and POLLOUT. Returns the ready events, or false if the timeout has
+// elapsed.
+VALUE Scheduler_io_wait(VALUE self, VALUE io, VALUE events, VALUE timeout) {
+  Scheduler_t *s = get_scheduler(self);
+  unsigned events_i = NUM2UINT(events);
+
+  int res = wait_poll(s, rb_fiber_current(), rb_io_descriptor(io), events_i, timeout);
+  if (res == -ECANCELED) return Qfalse;
+  if (res < 0)
+    rb_syserr_fail(-res, strerror(-res));
+
+  // errors and hangups are reported as readiness, so the following read or
+  // write returns the error
+  if (res & (POLLERR | POLLHUP)) res |= events_i;
+  return UINT2NUM(res & events_i);
+}
+
+VALUE Scheduler_kernel_sleep(int argc, VALUE *argv, VALUE self) {
+  Scheduler_t *s = get_scheduler(self);
+  VALUE duration;
+
+  rb_scan_args(argc, argv, "01", &duration);
+  VALUE fiber = rb_fiber_current();
+  if (NIL_P(duration))
+    fiber_wait(s, fiber, 0, 1);
+  else
+    wait_timeout(s, fiber, duration);
+  return Qtrue;
+}
+
+// Blocks the current fiber until #unblock is called, or until the timeout has
+// elapsed. Returns true if unblocked, false otherwise.
+VALUE Scheduler_block(int argc, VALUE *argv, VALUE self) {
+  Scheduler_t *s = get_scheduler(self);
+  VALUE blocker, timeout;
+
+  rb_scan_args(argc, argv, "11", &blocker, &timeout);
+  VALUE fiber = rb_fiber_current();
+  if (NIL_P(timeout)) {
+    fiber_wait(s, fiber, 0, 1);
+    return Qtrue;
+  }
+  return wait_timeout(s, fiber, timeout);
+}
+
+// Unblocks the given fiber. This may be called from another thread, in which
+// case the scheduler is woken up using its eventfd.
+VALUE Scheduler_unblock(VALUE self, VALUE blocker, VALUE fiber) {
+  Scheduler_t *s = RTYPEDDATA_DATA(self);
+  if (!s->iour) return Qnil;
+  if (rb_hash_lookup2(s->waiting, fiber, Qfalse) != Qtrue) return Qnil;
+
+  rb_hash_delete(s->waiting, fiber);
+  schedule(s, fiber, Qtrue);
+  if (rb_thread_current() != s->thread)
+    eventfd_write(s->wakeup_fd, 1);
+  return Qnil;
+}
+
+struct timer_ctx {
+  Scheduler_t *s;
+  __u64 user_data;
+};
+
+static VALUE timer_yield(VALUE duration) {
+  return rb_yield(duration);
+}
+
+static VALUE timer_ensure(VALUE arg) {
+  struct timer_ctx *ctx = (struct timer_ctx *)arg;
+  if (ctx->s->iour && IOURing_op_proc(ctx->s->iour, ctx->user_data) != Qundef)
+    IOURing_cancel_op(ctx->s->iour, ctx->user_data);
+  return Qnil;
+}
+
+// Runs the given block, raising an exception of the given class in the
+// current fiber if the block does not finish within the given duration.
+VALUE Scheduler_timeout_after(int argc, VALUE *argv, VALUE self) {
+  Scheduler_t *s = get_scheduler(self);
+  VALUE duration, klass, args;
+
+  rb_scan_args(argc, argv, "2*", &duration, &klass, &args);
+  struct __kernel_timespec ts = value_to_timespec(duration);
+  VALUE timer = rb_ary_new_from_args(3, rb_fiber_current(), klass, args);
+
+  VALUE ctx;
+  struct timer_ctx tctx = { .s = s };
+  struct io_uring_sqe *sqe = get_op_sqe(s, OP_timeout, timer, 1, &ctx, &tctx.user_data);
+  *OpCtx_ts_get(ctx) = ts;
+  io_uring_prep_timeout(sqe, OpCtx_ts_get(ctx), 0, 0);
+  sqe->user_data = tctx.user_data;
+
+  VALUE ret = rb_ensure(timer_yield, duration, timer_ensure, (VALUE)&tctx);
+  RB_GC_GUARD(timer);
+  return ret;
+}
+
+static VALUE fiber_body(RB_BLOCK_CALL_FUNC_ARGLIST(_arg, block)) {
+  return rb_proc_call_with_block(block, 0, NULL, Qnil);
+}
+
+// Creates a non-blocking fiber running the given block, and resumes it.
+VALUE Scheduler_fiber(VALUE self) {
+  get_scheduler(self);
+  VALUE fiber = rb_fiber_new(fiber_body, rb_block_proc());
+  rb_fiber_resume(fiber, 0, NULL);
+  return fiber;
+}
+
+// Runs the event loop until all fibers are done, then closes the ring. This is
+// called by Ruby when the scheduler is replaced, or when the thread exits.
+VALUE Scheduler_close(VALUE self) {
+  Scheduler_t *s = RTYPEDDATA_DATA(self);
+  if (!s->iour) return self;
+
+  Scheduler_run(self);
+  s->iour = NULL;
+  rb_funcall(s->ring, rb_intern("close"), 0);
+  close(s->wakeup_fd);
+  s->wakeup_fd = -1;
+  return self;
+}
+
+VALUE Scheduler_closed_p(VALUE self) {
+  Scheduler_t *s = RTYPEDDATA_DATA(self);
+  return s->iour ? Qfalse : Qtrue;
+}
+
+void Init_Scheduler(void) {
+  mIOU = rb_define_module("IOU");
+  cScheduler = rb_define_class_under(mIOU, "Scheduler", rb_cObject);
+  rb_define_alloc_func(cScheduler, Scheduler_allocate);
+
+  rb_define_method(cScheduler, "initialize", Scheduler_initialize, -1);
+  rb_define_method(cScheduler, "run", Scheduler_run, 0);
+  rb_define_method(cScheduler, "close", Scheduler_close, 0);
+  rb_define_method(cScheduler, "closed?", Scheduler_closed_p, 0);
+  rb_define_method(cScheduler, "fiber", Scheduler_fiber, 0);
+
+  rb_define_method(cScheduler, "io_read", Scheduler_io_read, 4);
+  rb_define_method(cScheduler, "io_write", Scheduler_io_write, 4);
+  rb_define_method(cScheduler, "io_pread", Scheduler_io_pread, 5);
+  rb_define_method(cScheduler, "io_pwrite", Scheduler_io_pwrite, 5);
+  rb_define_method(cScheduler, "io_wait", Scheduler_io_wait, 3);
+  rb_define_method(cScheduler, "kernel_sleep", Scheduler_kernel_sleep, -1);
+  rb_define_method(cScheduler, "block", Scheduler_block, -1);
+  rb_define_method(cScheduler, "unblock", Scheduler_unblock, 2);
+  rb_define_method(cScheduler, "timeout_after", Scheduler_timeout_after, -1);
+
+  ID_exception = rb_intern("exception");
+}
@@ -1,3 +1,6 @@
 # frozen_string_literal: true
 
 require_relative './iou_ext'
+require_relative './iou/aligned_buffer'
+require_relative './iou/scheduler'
+require_relative './iou/splice'
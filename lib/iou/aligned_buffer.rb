@@ -0,0 +1,15 @@
+# frozen_string_literal: true
+
+module IOU
+  # Buffer alignment for I/O on files opened with File::DIRECT. Most devices
+  # have a logical block size of 512 bytes, but page alignment works for all.
+  DIRECT_IO_ALIGNMENT = 4096
+
+  # Returns a mapped IO::Buffer for use with File::DIRECT. Mapped buffers are
+  # page aligned, and the size is rounded up to a multiple of the alignment.
+  # The buffer is passed as the buffer: of #prep_read and #prep_write.
+  def self.aligned_buffer(size)
+    size = (size + DIRECT_IO_ALIGNMENT - 1) & ~(DIRECT_IO_ALIGNMENT - 1)
+    IO::Buffer.new(size, IO::Buffer::MAPPED)
+  end
+end
@@ -0,0 +1,15 @@
+# frozen_string_literal: true
+
+require 'socket'
+
+module IOU
+  class Scheduler
+    # io_uring has no op for name resolution, so the address is resolved on a
+    # separate thread, while the current fiber is blocked waiting for it.
+    def address_resolve(hostname)
+      Thread.new do
+        Addrinfo.getaddrinfo(hostname, nil).map(&:ip_address).uniq
+      end.value
+    end
+  end
+end
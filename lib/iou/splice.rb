@@ -0,0 +1,37 @@
+# frozen_string_literal: true
+
+require 'fcntl'
+
+module IOU
+  # Returns a pipe as a pair of IO instances, for use as an intermediate
+  # buffer for splicing. If size is given, the pipe buffer size is set
+  # accordingly (it is rounded up by the kernel to a power of 2 pages).
+  def self.pipe(size: nil)
+    r, w = IO.pipe
+    w.fcntl(Fcntl::F_SETPIPE_SZ, size) if size
+    [r, w]
+  end
+
+  class Ring
+    # Moves len bytes from fd_in to fd_out through the given pipe (as returned
+    # by IOU.pipe), using two linked splice ops, so neither fd needs to be a
+    # pipe. The data never leaves the kernel. Returns the ids of both ops. The
+    # given block is called on completion of the second op.
+    #
+    # The pipe buffer must be big enough to hold len bytes. If the first splice
+    # moves less than len bytes (e.g. on EOF), the link is broken and the
+    # second op completes with -ECANCELED, leaving the data in the pipe.
+    def prep_splice_pipe(pipe:, len:, fd_in: nil, fixed_fd_in: nil, off_in: nil, fd_out: nil, fixed_fd_out: nil, off_out: nil, &block)
+      r, w = pipe
+      id1 = prep_splice(
+        fd_in: fd_in, fixed_fd_in: fixed_fd_in, off_in: off_in,
+        fd_out: w.fileno, len: len, link: true
+      )
+      id2 = prep_splice(
+        fd_in: r.fileno, fd_out: fd_out, fixed_fd_out: fixed_fd_out,
+        off_out: off_out, len: len, &block
+      )
+      [id1, id2]
+    end
+  end
+end
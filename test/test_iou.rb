@@ -2,6 +2,9 @@
 
 require_relative 'helper'
 require 'socket'
+require 'timeout'
+require 'tmpdir'
+require 'fileutils'
 
 class IOURingTest < IOURingBaseTest
   def test_close
@@ -27,6 +30,208 @@ class IOURingTest < IOURingBaseTest
 
     assert_nil ring.pending_ops[id]
   end
+
+  def test_pending_ops_many
+    r, w = IO.pipe
+
+    ids = (1..600).map { ring.prep_write(fd: w.fileno, buffer: 'a') }
+    assert_equal ids, ring.pending_ops.keys.sort
+
+    ring.submit
+    count = 0
+    count += ring.process_completions(true) while count < ids.size
+    assert_equal({}, ring.pending_ops)
+
+    # slots are reused for subsequent ops
+    id = ring.prep_write(fd: w.fileno, buffer: 'b')
+    assert_equal 601, id
+    ring.submit
+    c = ring.wait_for_completion
+    assert_equal id, c[:id]
+    assert_equal :write, c[:op]
+    assert_equal({}, ring.pending_ops)
+
+    w.close
+    assert_equal ('a' * 600) + 'b', r.read
+  end
+end
+
+class RingSetupTest < Minitest::Test
+  def test_default_features
+    ring = IOU::Ring.new
+    f = ring.features
+    assert_equal 1024, f[:entries]
+    assert_equal 2048, f[:cq_entries]
+    assert_equal false, f[:sqpoll]
+    assert_equal false, f[:defer_taskrun]
+    assert_equal false, f[:register_ring_fd]
+  ensure
+    ring&.close
+  end
+
+  def test_entries
+    ring = IOU::Ring.new(entries: 64, cq_entries: 512)
+    f = ring.features
+    assert_equal 64, f[:entries]
+    assert_equal 512, f[:cq_entries]
+  ensure
+    ring&.close
+  end
+
+  def test_invalid_opts
+    assert_raises(TypeError) { IOU::Ring.new(entries: 'foo') }
+    assert_raises(ArgumentError) { IOU::Ring.new(1) }
+  end
+
+  def run_ops(ring)
+    r, w = IO.pipe
+    ring.prep_write(fd: w.fileno, buffer: 'foo')
+    ring.prep_read(fd: r.fileno, buffer: +'', len: 3, link: true)
+    ring.prep_timeout(interval: 0.001)
+    count = 0
+    count += ring.process_completions(true) while count < 3
+    assert_equal 3, count
+    ring.prep_nop
+    assert_equal 1, ring.process_completions(true)
+  end
+
+  def test_defer_taskrun
+    ring = IOU::Ring.new(single_issuer: true, defer_taskrun: true, register_ring_fd: true)
+    f = ring.features
+    if f[:defer_taskrun]
+      assert_equal true, f[:single_issuer]
+      assert_equal false, f[:coop_taskrun]
+    end
+    run_ops(ring)
+  ensure
+    ring&.close
+  end
+
+  def test_sqpoll
+    # SQPOLL may require privileges, in which case it's dropped
+    ring = IOU::Ring.new(sqpoll: true, sq_thread_idle: 10)
+    f = ring.features
+    assert_equal false, f[:coop_taskrun] if f[:sqpoll]
+    run_ops(ring)
+  ensure
+    ring&.close
+  end
+
+  def test_sqpoll_single_issuer
+    ring = IOU::Ring.new(sqpoll: true, single_issuer: true, defer_taskrun: true)
+    f = ring.features
+    if f[:sqpoll]
+      assert_equal true, f[:single_issuer]
+      assert_equal false, f[:defer_taskrun]
+      assert_equal false, f[:coop_taskrun]
+    end
+    run_ops(ring)
+  ensure
+    ring&.close
+  end
+end
+
+class SQOverflowTest < Minitest::Test
+  def prep_many(ring, count)
+    r, w = IO.pipe
+    ids = (1..count).map { |i| ring.prep_write(fd: w.fileno, buffer: 'a') }
+    [r, w, ids]
+  end
+
+  def complete_all(ring, count)
+    done = 0
+    done += ring.process_completions(true) while done < count
+    done
+  end
+
+  def test_raise
+    ring = IOU::Ring.new(entries: 16, sq_overflow: :raise)
+    16.times { ring.prep_nop }
+    assert_raises(RuntimeError) { ring.prep_nop }
+  ensure
+    ring&.close
+  end
+
+  def test_submit
+    ring = IOU::Ring.new(entries: 16, cq_entries: 2048)
+    count = 1000
+    r, w, ids = prep_many(ring, count)
+    assert_equal 0, ring.sq_queue_depth
+    assert_equal count, ids.uniq.size
+
+    assert_equal count, complete_all(ring, count)
+    assert_equal({}, ring.pending_ops)
+    w.close
+    assert_equal 'a' * count, r.read
+  ensure
+    ring&.close
+  end
+
+  def test_queue
+    ring = IOU::Ring.new(entries: 16, cq_entries: 2048, sq_overflow: :queue)
+    count = 1000
+    r, w, ids = prep_many(ring, count)
+    assert_equal count - 16, ring.sq_queue_depth
+    assert_equal count, ring.pending_ops.size
+
+    assert_equal count, complete_all(ring, count)
+    assert_equal 0, ring.sq_queue_depth
+    assert_equal({}, ring.pending_ops)
+    w.close
+    assert_equal 'a' * count, r.read
+  ensure
+    ring&.close
+  end
+
+  def test_queue_submit
+    ring = IOU::Ring.new(entries: 16, cq_entries: 2048, sq_overflow: :queue)
+    ids = (1..100).map { ring.prep_nop }
+    assert_equal 84, ring.sq_queue_depth
+
+    ring.submit
+    assert_equal 0, ring.sq_queue_depth
+
+    cc = []
+    cc << ring.wait_for_completion[:id] while cc.size < 100
+    assert_equal ids, cc
+  ensure
+    ring&.close
+  end
+
+  # preps a link chain crossing the end of the SQ, checking that it's not split
+  # between submissions
+  def check_link_chain(ring)
+    r, w = IO.pipe
+    14.times { ring.prep_nop }
+    id1 = ring.prep_write(fd: r.fileno, buffer: 'foo', link: true)
+    id2 = ring.prep_write(fd: w.fileno, buffer: 'bar', link: true)
+    id3 = ring.prep_write(fd: w.fileno, buffer: 'baz')
+    ring.submit
+
+    results = {}
+    ring.process_completions(true) { |c| results[c[:id]] = c[:result] } while results.size < 17
+    assert_equal (-Errno::EBADF::Errno), results[id1]
+    assert_equal (-Errno::ECANCELED::Errno), results[id2]
+    assert_equal (-Errno::ECANCELED::Errno), results[id3]
+  end
+
+  def test_submit_link_chain
+    ring = IOU::Ring.new(entries: 16, cq_entries: 2048)
+    check_link_chain(ring)
+  ensure
+    ring&.close
+  end
+
+  def test_queue_link_chain
+    ring = IOU::Ring.new(entries: 16, cq_entries: 2048, sq_overflow: :queue)
+    check_link_chain(ring)
+  ensure
+    ring&.close
+  end
+
+  def test_invalid_policy
+    assert_raises(ArgumentError) { IOU::Ring.new(sq_overflow: :foo) }
+  end
 end
 
 class PrepTimeoutTest < IOURingBaseTest
@@ -299,6 +504,61 @@ class ProcessCompletionsTest < IOURingBaseTest
     assert_equal 3, ret
   end
 
+  def test_process_completions_wait_nr
+    ring.prep_timeout(interval: 0.01)
+    ring.prep_timeout(interval: 0.02)
+    ring.prep_timeout(interval: 0.03)
+
+    t0 = monotonic_clock
+    ret = ring.process_completions(wait_nr: 3)
+    elapsed = monotonic_clock - t0
+    assert_equal 3, ret
+    assert_in_range 0.03..0.05, elapsed
+  end
+
+  def test_process_completions_timeout
+    t0 = monotonic_clock
+    ret = ring.process_completions(timeout: 0.02)
+    elapsed = monotonic_clock - t0
+    assert_equal 0, ret
+    assert_in_range 0.02..0.04, elapsed
+
+    ring.prep_timeout(interval: 0.01)
+    ring.prep_timeout(interval: 1)
+    t0 = monotonic_clock
+    ret = ring.process_completions(wait_nr: 2, timeout: 0.03)
+    elapsed = monotonic_clock - t0
+    assert_equal 1, ret
+    assert_in_range 0.03..0.05, elapsed
+  end
+
+  def test_process_completions_batch
+    ids = (1..10).map { ring.prep_nop }
+    ring.submit
+    sleep 0.001
+
+    cc = []
+    ret = ring.process_completions_batch(4) { |c| cc << c[:id] }
+    assert_equal 4, ret
+    assert_equal ids[0..3], cc
+
+    ret = ring.process_completions_batch { |c| cc << c[:id] }
+    assert_equal 6, ret
+    assert_equal ids, cc
+
+    ret = ring.process_completions_batch
+    assert_equal 0, ret
+    assert_equal 10, ring.stats[:cqes_processed]
+  end
+
+  def test_process_completions_batch_wait
+    ring.prep_timeout(interval: 0.01)
+    ring.prep_timeout(interval: 0.02)
+
+    ret = ring.process_completions_batch(wait_nr: 2)
+    assert_equal 2, ret
+  end
+
   def test_process_completions_with_block
     r, w = IO.pipe
 
@@ -594,6 +854,36 @@ class PrepAcceptTest < IOURingBaseTest
     t&.kill rescue nil
   end
 
+  def test_prep_accept_address
+    ring.prep_accept(fd: @server.fileno)
+    ring.submit
+    t = Thread.new { TCPSocket.new('127.0.0.1', @port) }
+
+    c = ring.wait_for_completion
+    assert c[:result] > 0
+    addr = Addrinfo.new(c[:address])
+    assert_equal '127.0.0.1', addr.ip_address
+    assert_equal t.value.local_address.ip_port, addr.ip_port
+  ensure
+    t&.kill rescue nil
+  end
+
+  def test_prep_accept_ipv6_address
+    server = TCPServer.open('::1', 0) rescue skip('IPv6 not available')
+    ring.prep_accept(fd: server.fileno)
+    ring.submit
+    t = Thread.new { TCPSocket.new('::1', server.local_address.ip_port) }
+
+    c = ring.wait_for_completion
+    assert c[:result] > 0
+    addr = Addrinfo.new(c[:address])
+    assert addr.ipv6?
+    assert_equal t.value.local_address.ip_port, addr.ip_port
+  ensure
+    t&.kill rescue nil
+    server&.close
+  end
+
   def test_prep_accept_invalid_args
     assert_raises(ArgumentError) { ring.prep_accept() }
     assert_raises(ArgumentError) { ring.prep_accept(foo: 1) }
@@ -829,6 +1119,254 @@ class OpCtxTest < IOURingBaseTest
   end
 end
 
+class FastPathTest < IOURingBaseTest
+  def test_prep_write_fast
+    r, w = IO.pipe
+
+    cc = nil
+    id = ring.prep_write_fast(w.fileno, 'foobar') { |id, result| cc = [id, result] }
+    assert_equal 1, id
+    assert_nil ring.pending_ops[id].spec
+
+    id2 = ring.prep_write_fast(w.fileno, 'bazbaz', 3)
+    ring.submit
+    ring.process_completions(true)
+    assert_equal [id, 6], cc
+
+    ret = ring.wait_for_completion
+    assert_equal [id2, 3, 0], ret
+
+    w.close
+    assert_equal 'foobarbaz', r.read
+  end
+
+  def test_prep_read_fast_frozen_buffer
+    r, _w = IO.pipe
+    assert_raises(FrozenError) { ring.prep_read_fast(r.fileno, 'foo'.freeze, 16) }
+    assert_equal({}, ring.pending_ops)
+    assert_equal 0, ring.submit
+  end
+
+  def test_prep_read_fast
+    r, w = IO.pipe
+    w << 'foobar'
+
+    buffer = +''
+    cc = nil
+    id = ring.prep_read_fast(r.fileno, buffer, 3) { |id, result| cc = [id, result] }
+    ring.submit
+    ring.process_completions(true)
+
+    assert_equal [id, 3], cc
+    assert_equal 'foo', buffer
+    assert_equal({}, ring.pending_ops)
+  end
+
+  def test_prep_timeout_fast
+    cc = []
+    id = ring.prep_timeout_fast(0.01)
+    ring.submit
+    ring.process_completions(true) { |*args| cc << args }
+    assert_equal [[id, -Errno::ETIME::Errno, 0]], cc
+  end
+
+  def test_prep_close_fast
+    _r, w = IO.pipe
+    fd = w.fileno
+
+    id = ring.prep_close_fast(fd)
+    ring.submit
+    assert_equal [id, 0, 0], ring.wait_for_completion
+    assert_raises(Errno::EBADF) { w << 'fail' }
+  end
+
+  def test_prep_accept_fast
+    port = 9000 + rand(1000)
+    server = TCPServer.open('127.0.0.1', port)
+
+    id = ring.prep_accept_fast(server.fileno)
+    ring.submit
+    t = Thread.new { TCPSocket.new('127.0.0.1', port) }
+
+    cid, fd, _flags = ring.wait_for_completion
+    assert_equal id, cid
+    assert fd > 0
+  ensure
+    t&.kill rescue nil
+    server&.close
+  end
+
+  def test_fast_invalid_args
+    assert_raises(TypeError) { ring.prep_read_fast('foo', +'', 3) }
+    assert_raises(TypeError) { ring.prep_read_fast(0, :foo, 3) }
+    assert_raises(TypeError) { ring.prep_write_fast(1, nil) }
+    assert_raises(ArgumentError) { ring.prep_write_fast(1) }
+  end
+end
+
+class CompletionModeTest < IOURingBaseTest
+  def test_completion_mode
+    assert_equal :hash, ring.completion_mode
+
+    ring.completion_mode = :object
+    assert_equal :object, ring.completion_mode
+
+    ring.completion_mode = :args
+    assert_equal :args, ring.completion_mode
+
+    assert_raises(ArgumentError) { ring.completion_mode = :foo }
+  end
+
+  def test_object_mode
+    ring.completion_mode = :object
+    r, w = IO.pipe
+
+    spec = { fd: w.fileno, buffer: 'foo' }
+    id = ring.prep_write(spec)
+    ring.submit
+    c = ring.wait_for_completion
+
+    assert_kind_of IOU::Completion, c
+    assert_equal id, c.id
+    assert_equal :write, c.op
+    assert_equal 3, c.result
+    assert_equal 0, c.flags
+    assert_equal false, c.more?
+    assert_nil c.buffer
+    assert_same spec, c.spec
+    assert_nil spec[:result]
+
+    buffer = +''
+    id = ring.prep_read(fd: r.fileno, buffer: buffer, len: 8)
+    ring.submit
+    c2 = ring.wait_for_completion
+    assert_equal id, c2.id
+    assert_equal :read, c2.op
+    assert_equal 3, c2.result
+    assert_same buffer, c2.buffer
+    assert_equal 'foo', buffer
+
+    id = ring.prep_nop
+    ring.submit
+    c = ring.wait_for_completion
+    assert_kind_of IOU::Completion, c
+    assert_equal id, c.id
+    assert_nil c.op
+    assert_equal 0, c.result
+  end
+
+  def test_object_mode_multishot
+    ring.completion_mode = :object
+
+    cc = []
+    id = ring.prep_timeout(interval: 0.01, multishot: true) do |c|
+      cc << c
+      assert_equal :timeout, c.op
+      assert_equal (-Errno::ETIME::Errno), c.result
+      assert_equal true, c.more?
+    end
+    ring.submit
+    3.times { ring.process_completions(true) }
+
+    assert_equal 3, cc.size
+    assert_equal 1, cc.uniq.size
+    assert_equal id, cc.first.id
+  ensure
+    ring.prep_cancel(id)
+    ring.submit
+  end
+
+  def test_object_mode_reused_ctx
+    ring.completion_mode = :object
+    r, w = IO.pipe
+
+    spec = { fd: w.fileno, buffer: 'foo' }
+    id1 = ring.prep_write(spec)
+    ring.submit
+    c1 = ring.wait_for_completion
+
+    id2 = ring.prep_write(fd: w.fileno, buffer: 'bar')
+    ring.submit
+    c2 = ring.wait_for_completion
+
+    refute_same c1, c2
+    assert_equal id1, c1.id
+    assert_same spec, c1.spec
+    assert_equal id2, c2.id
+  end
+
+  def test_args_mode
+    ring.completion_mode = :args
+    r, w = IO.pipe
+
+    cc = []
+    id1 = ring.prep_write(fd: w.fileno, buffer: 'foo')
+    id2 = ring.prep_write(fd: w.fileno, buffer: 'bar') { |*args| cc << args }
+    ring.submit
+    sleep 0.01
+    ring.process_completions
+    assert_equal [[id2, 3, 0]], cc
+
+    id3 = ring.prep_nop
+    ring.submit
+    cc = []
+    ring.process_completions(true) { |*args| cc << args }
+    assert_equal [[id3, 0, 0]], cc
+
+    w.close
+    assert_equal 'foobar', r.read
+  end
+end
+
+class OpCtxPoolTest < IOURingBaseTest
+  def test_ctx_reuse
+    r, w = IO.pipe
+
+    id1 = ring.prep_write(fd: w.fileno, buffer: 'foo')
+    ctx1 = ring.pending_ops[id1]
+    ring.submit
+    ring.wait_for_completion
+    assert_nil ctx1.spec
+
+    id2 = ring.prep_write(fd: w.fileno, buffer: 'bar')
+    ctx2 = ring.pending_ops[id2]
+    assert_same ctx1, ctx2
+    assert_equal id2, ctx2.spec[:id]
+
+    ring.submit
+    c = ring.wait_for_completion
+    assert_equal id2, c[:id]
+    assert_equal 3, c[:result]
+
+    w.close
+    assert_equal 'foobar', r.read
+  end
+
+  def test_no_allocations_in_steady_state
+    r, w = IO.pipe
+    spec = { fd: w.fileno, buffer: 'foo' }
+    op = -> {
+      ring.prep_write(spec)
+      ring.submit
+      ring.wait_for_completion
+    }
+
+    # warm up
+    10.times { op.() }
+
+    count = 1000
+    a0 = GC.stat(:total_allocated_objects)
+    count.times { op.() }
+    allocated = GC.stat(:total_allocated_objects) - a0
+
+    assert_in_range 0..(count / 100), allocated
+    assert_equal 3, spec[:result]
+
+    w.close
+    assert_equal 'foo' * (count + 10), r.read
+  end
+end
+
 class LinkTest < IOURingBaseTest
   def test_linked_submissions
     r, w = IO.pipe
@@ -844,6 +1382,1616 @@ class LinkTest < IOURingBaseTest
     w.close
     assert_equal 'foobar', r.read
   end
+
+  def test_linked_submissions_failed
+    r, w = IO.pipe
+    id1 = ring.prep_write(fd: r.fileno, buffer: 'foo', link: true)
+    id2 = ring.prep_write(fd: w.fileno, buffer: 'bar')
+    ring.submit
+
+    results = {}
+    ring.process_completions(true) { |c| results[c[:id]] = c[:result] } while results.size < 2
+
+    assert_equal (-Errno::EBADF::Errno), results[id1]
+    assert_equal (-Errno::ECANCELED::Errno), results[id2]
+  end
+
+  def test_link_timeout_expired
+    r, _w = IO.pipe
+    id = ring.prep_read(fd: r.fileno, buffer: +'', len: 4096, timeout: 0.05)
+    ring.submit
+
+    t0 = monotonic_clock
+    c = ring.wait_for_completion
+    elapsed = monotonic_clock - t0
+    assert_equal id, c[:id]
+    assert_equal (-Errno::ECANCELED::Errno), c[:result]
+    assert_in_range 0.04..0.2, elapsed
+    assert_equal({}, ring.pending_ops)
+  end
+
+  def test_link_timeout_not_expired
+    r, w = IO.pipe
+    w << 'foo'
+    id = ring.prep_read(fd: r.fileno, buffer: +'', len: 4096, timeout: 1)
+    ring.submit
+
+    c = ring.wait_for_completion
+    assert_equal id, c[:id]
+    assert_equal 3, c[:result]
+    assert_equal 'foo', c[:buffer]
+
+    # the timeout CQE is not yielded
+    sleep 0.01
+    yielded = []
+    ring.process_completions { |c| yielded << c }
+    assert_equal [], yielded
+  end
+
+  def test_link_timeout_linked
+    r, w = IO.pipe
+    id1 = ring.prep_read(fd: r.fileno, buffer: +'', len: 4096, timeout: 0.01, link: true)
+    id2 = ring.prep_write(fd: w.fileno, buffer: 'bar')
+    ring.submit
+
+    results = {}
+    ring.process_completions(true) { |c| results[c[:id]] = c[:result] } while results.size < 2
+    assert_equal (-Errno::ECANCELED::Errno), results[id1]
+    assert_equal (-Errno::ECANCELED::Errno), results[id2]
+  end
+end
+
+class FixedFileTest < IOURingBaseTest
+  def test_register_files
+    assert_equal 16, ring.register_files(16)
+    assert_raises(RuntimeError) { ring.register_files(16) }
+
+    ring.unregister_files
+    assert_equal 16, ring.register_files(16)
+  end
+
+  def test_register_file_without_table
+    r, _w = IO.pipe
+    assert_raises(RuntimeError) { ring.register_file(r.fileno) }
+  end
+
+  def test_fixed_fd_write_close
+    r, w = IO.pipe
+    ring.register_files(16)
+    fixed_fd = ring.register_file(w.fileno)
+    assert_kind_of Integer, fixed_fd
+
+    id = ring.prep_write(fixed_fd: fixed_fd, buffer: 'foo')
+    ring.submit
+    c = ring.wait_for_completion
+    assert_equal id, c[:id]
+    assert_equal 3, c[:result]
+
+    id = ring.prep_close(fixed_fd: fixed_fd)
+    ring.submit
+    c = ring.wait_for_completion
+    assert_equal id, c[:id]
+    assert_equal 0, c[:result]
+
+    w.close
+    assert_equal 'foo', r.read
+  end
+
+  def test_unregister_file
+    r, w = IO.pipe
+    ring.register_files(16)
+    fixed_fd = ring.register_file(w.fileno)
+    ring.unregister_file(fixed_fd)
+
+    ring.prep_write(fixed_fd: fixed_fd, buffer: 'foo')
+    ring.submit
+    c = ring.wait_for_completion
+    assert_equal (-Errno::EBADF::Errno), c[:result]
+  end
+
+  def test_accept_direct
+    port = 9000 + rand(1000)
+    server = TCPServer.open('127.0.0.1', port)
+    ring.register_files(16)
+
+    id = ring.prep_accept(fd: server.fileno, direct: true)
+    ring.submit
+    client = TCPSocket.new('127.0.0.1', port)
+
+    c = ring.wait_for_completion
+    assert_equal id, c[:id]
+    fixed_fd = c[:result]
+    assert fixed_fd >= 0
+
+    client << 'foo'
+    ring.prep_read(fixed_fd: fixed_fd, buffer: +'', len: 3)
+    ring.submit
+    c = ring.wait_for_completion
+    assert_equal 3, c[:result]
+    assert_equal 'foo', c[:buffer]
+
+    ring.prep_write(fixed_fd: fixed_fd, buffer: 'bar')
+    ring.submit
+    c = ring.wait_for_completion
+    assert_equal 3, c[:result]
+    assert_equal 'bar', client.read(3)
+
+    ring.prep_close(fixed_fd: fixed_fd)
+    ring.submit
+    c = ring.wait_for_completion
+    assert_equal 0, c[:result]
+    assert_equal '', client.read
+  ensure
+    client&.close
+    server&.close
+  end
+
+  def test_accept_multishot_direct
+    port = 9000 + rand(1000)
+    server = TCPServer.open('127.0.0.1', port)
+    ring.register_files(16)
+
+    id = ring.prep_accept(fd: server.fileno, multishot: true, direct: true)
+    ring.submit
+
+    clients = []
+    fixed_fds = []
+    3.times do
+      clients << TCPSocket.new('127.0.0.1', port)
+      c = ring.wait_for_completion
+      assert_equal id, c[:id]
+      assert c[:result] >= 0
+      fixed_fds << c[:result]
+    end
+    assert_equal 3, fixed_fds.uniq.size
+
+    ring.prep_cancel(id)
+    ring.process_completions
+  ensure
+    clients.each(&:close)
+    server&.close
+  end
+
+  def test_cancel_fd
+    r, _w = IO.pipe
+    id = ring.prep_read(fd: r.fileno, buffer: +'', len: 3)
+    ring.submit
+    ring.prep_cancel(fd: r.fileno)
+    ring.submit
+
+    results = {}
+    ring.process_completions(true) { |c| results[c[:id]] = c[:result] } until results[id]
+    assert_equal (-Errno::ECANCELED::Errno), results[id]
+  end
+end
+
+class FixedBufferTest < IOURingBaseTest
+  def test_register_buffers
+    buffers = ring.register_buffers(count: 4, size: 4096)
+    assert_kind_of Array, buffers
+    assert_equal 4, buffers.size
+    buffers.each do |b|
+      assert_kind_of IO::Buffer, b
+      assert_equal 4096, b.size
+    end
+
+    assert_raises(RuntimeError) { ring.register_buffers(count: 4, size: 4096) }
+  end
+
+  def test_register_buffers_invalid_args
+    assert_raises(ArgumentError) { ring.register_buffers(count: 4) }
+    assert_raises(ArgumentError) { ring.register_buffers(count: 0, size: 4096) }
+  end
+
+  def test_write_fixed
+    r, w = IO.pipe
+    buffers = ring.register_buffers(count: 4, size: 4096)
+    buffers[2].set_string('foobar')
+
+    id = ring.prep_write(fd: w.fileno, buffer_index: 2, len: 6)
+    ring.submit
+    c = ring.wait_for_completion
+    assert_equal id, c[:id]
+    assert_equal :write, c[:op]
+    assert_equal 6, c[:result]
+
+    w.close
+    assert_equal 'foobar', r.read
+  end
+
+  def test_read_fixed
+    r, w = IO.pipe
+    buffers = ring.register_buffers(count: 4, size: 4096)
+
+    w << 'hello'
+    id = ring.prep_read(fd: r.fileno, buffer_index: 1, len: 4096)
+    ring.submit
+    c = ring.wait_for_completion
+    assert_equal id, c[:id]
+    assert_equal :read, c[:op]
+    assert_equal 5, c[:result]
+    assert_equal 'hello', buffers[1].get_string(0, 5)
+
+    w << 'world'
+    ring.prep_read(fd: r.fileno, buffer_index: 1, buffer_offset: 5)
+    ring.submit
+    c = ring.wait_for_completion
+    assert_equal 5, c[:result]
+    assert_equal 'helloworld', buffers[1].get_string(0, 10)
+  end
+
+  def test_fixed_buffer_invalid_args
+    r, w = IO.pipe
+    ring.register_buffers(count: 4, size: 4096)
+
+    assert_raises(ArgumentError) { ring.prep_read(fd: r.fileno, buffer_index: 4) }
+    assert_raises(ArgumentError) { ring.prep_read(fd: r.fileno, buffer_index: 0, len: 4097) }
+    assert_raises(ArgumentError) { ring.prep_write(fd: w.fileno, buffer_index: 0, buffer_offset: 4000, len: 100) }
+    assert_raises(ArgumentError) { ring.prep_write(buffer_index: 0) }
+    assert_equal 0, ring.pending_ops.size
+  end
+end
+
+class PrepSendTest < IOURingBaseTest
+  def setup
+    super
+    @port = 9000 + rand(1000)
+    @server = TCPServer.open('127.0.0.1', @port)
+    @client = TCPSocket.new('127.0.0.1', @port)
+    @conn = @server.accept
+  end
+
+  def teardown
+    @conn.close
+    @client.close
+    @server.close
+    super
+  end
+
+  def test_prep_send
+    id = ring.prep_send(fd: @conn.fileno, buffer: 'foobar')
+    ring.submit
+    c = ring.wait_for_completion
+    assert_equal id, c[:id]
+    assert_equal :send, c[:op]
+    assert_equal 6, c[:result]
+    assert_equal 'foobar', @client.read(6)
+  end
+
+  def test_prep_send_invalid_args
+    assert_raises(ArgumentError) { ring.prep_send(fd: @conn.fileno) }
+    assert_raises(ArgumentError) { ring.prep_send(buffer: 'foo') }
+    assert_raises(ArgumentError) { ring.prep_send(fd: @conn.fileno, buffer: 'foo', len: 4) }
+    assert_raises(TypeError) { ring.prep_send(fd: @conn.fileno, buffer: :foo) }
+  end
+
+  def test_prep_send_zc
+    released = []
+    completions = []
+    id = ring.prep_send(
+      fd: @conn.fileno, buffer: 'foobar', zc: true,
+      on_release: ->(spec) { released << spec[:id] }
+    )
+    ring.submit
+    ring.process_completions(true) { |c| completions << c.dup } while released.empty?
+
+    assert_equal [id], released
+    assert_equal 1, completions.size
+    assert_equal id, completions[0][:id]
+    assert_equal 6, completions[0][:result]
+    assert_equal 'foobar', @client.read(6)
+    assert_nil ring.pending_ops[id]
+  end
+
+  def test_prep_send_zc_wait_for_completion
+    id1 = ring.prep_send(fd: @conn.fileno, buffer: 'foo', zc: true)
+    ring.submit
+    c = ring.wait_for_completion
+    assert_equal id1, c[:id]
+    assert_equal 3, c[:result]
+
+    # the notification CQE for the first op is skipped
+    id2 = ring.prep_nop
+    ring.submit
+    c = ring.wait_for_completion
+    assert_equal id2, c[:id]
+    assert_equal 'foo', @client.read(3)
+  end
+
+  def test_prep_send_zc_fixed
+    buffers = ring.register_buffers(count: 2, size: 4096)
+    buffers[1].set_string('barbaz')
+
+    released = false
+    id = ring.prep_send(
+      fd: @conn.fileno, buffer_index: 1, len: 6, zc: true,
+      on_release: ->(_spec) { released = true }
+    )
+    ring.submit
+    results = []
+    ring.process_completions(true) { |c| results << c[:result] } until released
+
+    assert_equal [6], results
+    assert_equal 'barbaz', @client.read(6)
+  end
+end
+
+class PrepRecvTest < IOURingBaseTest
+  def setup
+    super
+    @port = 9000 + rand(1000)
+    @server = TCPServer.open('127.0.0.1', @port)
+    @client = TCPSocket.new('127.0.0.1', @port)
+    @conn = @server.accept
+  end
+
+  def teardown
+    @conn.close
+    @client.close
+    @server.close
+    super
+  end
+
+  def test_prep_recv
+    @client << 'foo'
+    buffer = +''
+    id = ring.prep_recv(fd: @conn.fileno, buffer: buffer, len: 100)
+    ring.submit
+    c = ring.wait_for_completion
+    assert_equal id, c[:id]
+    assert_equal :recv, c[:op]
+    assert_equal 3, c[:result]
+    assert_equal 'foo', buffer
+  end
+
+  def test_prep_recv_invalid_args
+    assert_raises(ArgumentError) { ring.prep_recv(fd: @conn.fileno) }
+    assert_raises(ArgumentError) { ring.prep_recv(buffer: +'', len: 3) }
+    assert_raises(ArgumentError) { ring.prep_recv(fd: @conn.fileno, buffer_group: 5) }
+  end
+
+  def test_prep_recv_frozen_buffer
+    assert_raises(FrozenError) { ring.prep_recv(fd: @conn.fileno, buffer: 'foo'.freeze, len: 3) }
+    assert_equal({}, ring.pending_ops)
+    assert_equal 0, ring.submit
+  end
+
+  def test_prep_recv_buffer_group
+    bg = ring.setup_buffer_ring(count: 4, size: 16)
+    @client << 'foo'
+    id = ring.prep_recv(fd: @conn.fileno, buffer_group: bg)
+    ring.submit
+    c = ring.wait_for_completion
+    assert_equal id, c[:id]
+    assert_equal 3, c[:result]
+    assert_equal 'foo', c[:buffer]
+  end
+
+  def test_prep_recv_multishot
+    bg = ring.setup_buffer_ring(count: 4, size: 16)
+    id = ring.prep_recv(fd: @conn.fileno, buffer_group: bg, multishot: true)
+    ring.submit
+
+    %w[foo bar baz quux].each do |msg|
+      @client << msg
+      c = ring.wait_for_completion
+      assert_equal id, c[:id]
+      assert_equal msg, c[:buffer]
+      assert ring.pending_ops[id]
+    end
+
+    ring.prep_cancel(id)
+    ring.submit
+    ring.process_completions(true)
+    assert_nil ring.pending_ops[id]
+  end
+
+  def test_prep_recv_bundle
+    bg = ring.setup_buffer_ring(count: 8, size: 4)
+    @client << 'foobarbazquux'
+    id = ring.prep_recv(fd: @conn.fileno, buffer_group: bg, multishot: true, bundle: true)
+    ring.submit
+
+    c = ring.wait_for_completion
+    assert_equal id, c[:id]
+    assert_equal 13, c[:result]
+    assert_equal 'foobarbazquux', c[:buffer]
+
+    # the second bundle wraps around the end of the buffer ring
+    @client << 'abcdefghijklmnopq'
+    data = +''
+    data << ring.wait_for_completion[:buffer] while data.bytesize < 17
+    assert_equal 'abcdefghijklmnopq', data
+
+    ring.prep_cancel(id)
+    ring.submit
+    ring.process_completions(true)
+  end
+
+  def test_prep_send_bundle
+    bg = ring.setup_buffer_ring(count: 8, size: 4, send: true)
+    assert_equal 9, ring.buffer_ring_push(bg, 'foobarbaz')
+
+    id = ring.prep_send(fd: @conn.fileno, buffer_group: bg, bundle: true)
+    ring.submit
+    c = ring.wait_for_completion
+    assert_equal id, c[:id]
+    assert_equal :send, c[:op]
+    assert_equal 9, c[:result]
+    assert_equal 'foobarbaz', @client.read(9)
+
+    # all buffers are free again, but only 32 bytes fit
+    data = 'abcdefghijklmnopqrstuvwxyz0123456789'
+    assert_equal 32, ring.buffer_ring_push(bg, data)
+    ring.prep_send(fd: @conn.fileno, buffer_group: bg, bundle: true)
+    ring.submit
+    c = ring.wait_for_completion
+    assert_equal 32, c[:result]
+    assert_equal data[0, 32], @client.read(32)
+  end
+
+  def test_buffer_ring_push_invalid_args
+    bg = ring.setup_buffer_ring(count: 8, size: 4)
+    assert_raises(ArgumentError) { ring.buffer_ring_push(bg, 'foo') }
+    assert_raises(ArgumentError) { ring.buffer_ring_push(bg + 1, 'foo') }
+    assert_raises(ArgumentError) { ring.prep_send(fd: @conn.fileno, buffer_group: bg, bundle: true) }
+  end
+end
+
+class BufferViewTest < IOURingBaseTest
+  def test_buffer_view
+    r, w = IO.pipe
+    bg = ring.setup_buffer_ring(count: 4, size: 4096)
+    id = ring.prep_read(fd: r.fileno, multishot: true, buffer_group: bg, view: true)
+    ring.submit
+
+    w << 'foo'
+    c = ring.wait_for_completion
+    skip if c[:result] == (-Errno::EINVAL::Errno)
+
+    assert_equal id, c[:id]
+    assert_equal 3, c[:result]
+    view = c[:buffer]
+    assert_kind_of IO::Buffer, view
+    assert view.readonly?
+    assert_equal 3, view.size
+    assert_equal 'foo', view.get_string
+
+    ring.release_buffer(view)
+    assert view.null?
+    assert_raises(ArgumentError) { ring.release_buffer(view) }
+  end
+
+  def test_buffer_view_held
+    r, w = IO.pipe
+    bg = ring.setup_buffer_ring(count: 2, size: 4096)
+    id = ring.prep_read(fd: r.fileno, multishot: true, buffer_group: bg, view: true)
+    ring.submit
+
+    views = %w[foo bar].map do |msg|
+      w << msg
+      c = ring.wait_for_completion
+      skip if c[:result] == (-Errno::EINVAL::Errno)
+      c[:buffer]
+    end
+    assert_equal %w[foo bar], views.map(&:get_string)
+
+    # both buffers are held by views, so the buffer group is exhausted, and the
+    # op is parked until a buffer is released
+    w << 'baz'
+    ring.process_completions(true)
+    stats = ring.buffer_ring_stats(bg)
+    assert_equal 1, stats[:enobufs]
+    assert_equal 1, stats[:parked]
+    assert_equal 2, stats[:in_flight]
+    assert_equal 0, stats[:free]
+
+    views.each { |v| ring.release_buffer(v) }
+    assert_equal 0, ring.buffer_ring_stats(bg)[:parked]
+    ring.submit
+    c = ring.wait_for_completion
+    assert_equal id, c[:id]
+    assert_equal 'baz', c[:buffer].get_string
+  end
+
+  def test_buffer_view_finalized
+    r, w = IO.pipe
+    bg = ring.setup_buffer_ring(count: 2, size: 4096)
+    id = ring.prep_read(fd: r.fileno, multishot: true, buffer_group: bg, view: true)
+    ring.submit
+
+    %w[foo bar].each do |msg|
+      w << msg
+      c = ring.wait_for_completion
+      skip if c[:result] == (-Errno::EINVAL::Errno)
+    end
+    w << 'baz'
+    ring.process_completions(true)
+    assert_equal 1, ring.buffer_ring_stats(bg)[:parked]
+
+    GC.start
+    stats = ring.buffer_ring_stats(bg)
+    skip 'Views were not collected' if stats[:in_flight] == 2
+
+    # re-arming is deferred from the finalizer to the next submit
+    assert_equal 1, stats[:parked]
+    ring.submit
+    assert_equal 0, ring.buffer_ring_stats(bg)[:parked]
+    c = ring.wait_for_completion
+    assert_equal id, c[:id]
+    assert_equal 'baz', c[:buffer].get_string
+  end
+
+  def test_buffer_view_cancel_parked
+    r, w = IO.pipe
+    bg = ring.setup_buffer_ring(count: 1, size: 4096)
+    id = ring.prep_read(fd: r.fileno, multishot: true, buffer_group: bg, view: true)
+    ring.submit
+
+    w << 'foo'
+    c = ring.wait_for_completion
+    skip if c[:result] == (-Errno::EINVAL::Errno)
+    view = c[:buffer]
+
+    w << 'bar'
+    ring.process_completions(true)
+    assert_equal 1, ring.buffer_ring_stats(bg)[:parked]
+
+    ring.prep_cancel(id)
+    ring.submit
+    results = []
+    ring.process_completions(true) { |c| results << c[:result] } while results.empty?
+    assert_equal [-Errno::ECANCELED::Errno], results
+    assert_nil ring.pending_ops[id]
+    ring.release_buffer(view)
+  end
+
+  def test_buffer_view_cancel_parked_wait
+    r, w = IO.pipe
+    bg = ring.setup_buffer_ring(count: 1, size: 4096)
+    id = ring.prep_read(fd: r.fileno, multishot: true, buffer_group: bg, view: true)
+    ring.submit
+
+    w << 'foo'
+    c = ring.wait_for_completion
+    skip if c[:result] == (-Errno::EINVAL::Errno)
+    view = c[:buffer]
+
+    w << 'bar'
+    ring.process_completions(true)
+    assert_equal 1, ring.buffer_ring_stats(bg)[:parked]
+
+    # the completion of the cancelled parked op is posted without the kernel
+    ring.prep_cancel(id)
+    c = ring.wait_for_completion
+    assert_equal id, c[:id]
+    assert_equal (-Errno::ECANCELED::Errno), c[:result]
+    assert_nil ring.pending_ops[id]
+    ring.release_buffer(view)
+  end
+
+  def test_buffer_view_cancel_parked_batch
+    r, w = IO.pipe
+    bg = ring.setup_buffer_ring(count: 1, size: 4096)
+    id = ring.prep_read(fd: r.fileno, multishot: true, buffer_group: bg, view: true)
+    ring.submit
+
+    w << 'foo'
+    c = ring.wait_for_completion
+    skip if c[:result] == (-Errno::EINVAL::Errno)
+    view = c[:buffer]
+
+    w << 'bar'
+    ring.process_completions(true)
+    assert_equal 1, ring.buffer_ring_stats(bg)[:parked]
+
+    ring.prep_cancel(id)
+    cc = []
+    ring.process_completions_batch { |c| cc << c }
+    c = cc.find { _1[:id] == id }
+    refute_nil c
+    assert_equal (-Errno::ECANCELED::Errno), c[:result]
+    assert_nil ring.pending_ops[id]
+    ring.release_buffer(view)
+  end
+
+  def test_buffer_view_invalid_args
+    bg = ring.setup_buffer_ring(count: 2, size: 4096)
+    assert_raises(ArgumentError) { ring.release_buffer(IO::Buffer.new(16)) }
+    assert_raises(ArgumentError) {
+      ring.prep_recv(fd: STDIN.fileno, buffer_group: bg, bundle: true, view: true)
+    }
+  end
+end
+
+class BufferRingExhaustionTest < IOURingBaseTest
+  def test_rearm_on_enobufs
+    r, w = IO.pipe
+    bg = ring.setup_buffer_ring(count: 2, size: 4)
+    id = ring.prep_read(fd: r.fileno, multishot: true, buffer_group: bg)
+
+    w << 'foobarbazquux'
+    data = +''
+    while data.bytesize < 13
+      ring.submit
+      ring.process_completions(true) do |c|
+        skip if c[:result] == (-Errno::EINVAL::Errno)
+        assert_equal id, c[:id]
+        data << c[:buffer]
+      end
+    end
+    assert_equal 'foobarbazquux', data
+    assert ring.pending_ops[id]
+
+    stats = ring.buffer_ring_stats(bg)
+    assert_equal 2, stats[:count]
+    assert_equal 4, stats[:size]
+    assert_equal 2, stats[:free]
+    assert_equal 0, stats[:in_flight]
+    assert_equal 0, stats[:parked]
+  end
+
+  def test_incremental
+    r, w = IO.pipe
+    begin
+      bg = ring.setup_buffer_ring(count: 1, size: 4096, incremental: true)
+    rescue Errno::EINVAL
+      skip 'Incremental buffer consumption is not supported'
+    end
+    id = ring.prep_read(fd: r.fileno, multishot: true, buffer_group: bg)
+    ring.submit
+
+    %w[foo bar bazz].each do |msg|
+      w << msg
+      c = ring.wait_for_completion
+      assert_equal id, c[:id]
+      assert_equal msg, c[:buffer]
+    end
+    assert_equal 0, ring.buffer_ring_stats(bg)[:enobufs]
+  end
+
+  def test_incremental_invalid_args
+    bg = ring.setup_buffer_ring(count: 1, size: 4096, incremental: true)
+    assert_raises(ArgumentError) { ring.prep_read(fd: STDIN.fileno, multishot: true, buffer_group: bg, view: true) }
+    assert_raises(ArgumentError) { ring.prep_recv(fd: STDIN.fileno, buffer_group: bg, bundle: true) }
+  rescue Errno::EINVAL
+    skip 'Incremental buffer consumption is not supported'
+  end
+end
+
+class BufferRingLifecycleTest < IOURingBaseTest
+  def test_many_buffer_rings
+    bgs = 20.times.map { ring.setup_buffer_ring(count: 2, size: 16) }
+    assert_equal (0..19).to_a, bgs
+
+    r, w = IO.pipe
+    w << 'foo'
+    ring.prep_read(fd: r.fileno, buffer_group: bgs.last)
+    ring.submit
+    c = ring.wait_for_completion
+    assert_equal 'foo', c[:buffer]
+  end
+
+  def test_read_buffer_group_enobufs
+    r, w = IO.pipe
+    bg = ring.setup_buffer_ring(count: 1, size: 16)
+    w << 'foo'
+    id1 = ring.prep_read(fd: r.fileno, buffer_group: bg, view: true)
+    ring.submit
+    c = ring.wait_for_completion
+    assert_equal id1, c[:id]
+    view = c[:buffer]
+    assert_equal 'foo', view.get_string
+
+    # single-shot reads are not re-armed when out of buffers
+    w << 'bar'
+    id2 = ring.prep_read(fd: r.fileno, buffer_group: bg)
+    ring.submit
+    c = ring.wait_for_completion
+    assert_equal id2, c[:id]
+    assert_equal (-Errno::ENOBUFS::Errno), c[:result]
+    assert_equal 1, ring.buffer_ring_stats(bg)[:enobufs]
+    ring.release_buffer(view)
+  end
+
+  def test_free_buffer_ring
+    bg1 = ring.setup_buffer_ring(count: 2, size: 16)
+    bg2 = ring.setup_buffer_ring(count: 2, size: 16)
+    assert_equal ring, ring.free_buffer_ring(bg1)
+    assert_raises(ArgumentError) { ring.buffer_ring_stats(bg1) }
+    assert_raises(ArgumentError) { ring.free_buffer_ring(bg1) }
+
+    # freed ids are reused
+    assert_equal bg1, ring.setup_buffer_ring(count: 4, size: 32)
+    assert_equal 4, ring.buffer_ring_stats(bg1)[:count]
+    assert_equal 2, ring.buffer_ring_stats(bg2)[:count]
+  end
+
+  def test_free_buffer_ring_in_use
+    r, w = IO.pipe
+    bg = ring.setup_buffer_ring(count: 2, size: 16)
+    id = ring.prep_read(fd: r.fileno, multishot: true, buffer_group: bg)
+    ring.submit
+    assert_raises(RuntimeError) { ring.free_buffer_ring(bg) }
+
+    ring.prep_cancel(id)
+    ring.submit
+    c = ring.wait_for_completion
+    assert_equal id, c[:id]
+    ring.free_buffer_ring(bg)
+    w.close
+  end
+
+  def test_free_buffer_ring_with_views
+    r, w = IO.pipe
+    bg = ring.setup_buffer_ring(count: 2, size: 16)
+    w << 'foo'
+    ring.prep_read(fd: r.fileno, buffer_group: bg, view: true)
+    ring.submit
+    c = ring.wait_for_completion
+    assert_raises(RuntimeError) { ring.free_buffer_ring(bg) }
+
+    ring.release_buffer(c[:buffer])
+    ring.free_buffer_ring(bg)
+  end
+
+  def test_hugepages_and_mlock
+    r, w = IO.pipe
+    begin
+      bg = ring.setup_buffer_ring(count: 4, size: 4096, hugepages: true, mlock: true)
+    rescue Errno::ENOMEM, Errno::EPERM, Errno::EAGAIN
+      skip 'Locking buffer memory is not permitted'
+    end
+    w << 'foo'
+    ring.prep_read(fd: r.fileno, buffer_group: bg)
+    ring.submit
+    assert_equal 'foo', ring.wait_for_completion[:buffer]
+  end
+
+  def test_kernel_mapped
+    r, w = IO.pipe
+    begin
+      bg = ring.setup_buffer_ring(count: 4, size: 64, kernel_mapped: true)
+    rescue Errno::EINVAL
+      skip 'Kernel-mapped buffer rings are not supported'
+    end
+    w << 'foo'
+    ring.prep_read(fd: r.fileno, buffer_group: bg)
+    ring.submit
+    assert_equal 'foo', ring.wait_for_completion[:buffer]
+    ring.free_buffer_ring(bg)
+  end
+end
+
+class MsgRingTest < IOURingBaseTest
+  def test_send_msg
+    ring2 = IOU::Ring.new
+    id = ring.send_msg(ring2, 42)
+    ring.submit
+    c = ring.wait_for_completion
+    assert_equal id, c[:id]
+    assert_equal :send_msg, c[:op]
+    assert_equal 0, c[:result]
+
+    msgs = []
+    ring2.process_completions(true) { |c2| msgs << c2 }
+    assert_equal [{ id: id, op: :msg, result: 42 }], msgs
+  ensure
+    ring2&.close
+  end
+
+  def test_send_msg_other_thread
+    q = Thread::Queue.new
+    t = Thread.new do
+      ring2 = IOU::Ring.new
+      q << ring2
+      c = ring2.wait_for_completion
+      ring2.close
+      c
+    end
+    ring.send_msg(q.pop, 7)
+    ring.submit
+    c = t.value
+    assert_equal :msg, c[:op]
+    assert_equal 7, c[:result]
+  end
+
+  def test_send_fd
+    ring2 = IOU::Ring.new
+    ring.register_files(4)
+    ring2.register_files(4)
+
+    r, w = IO.pipe
+    fixed_fd = ring.register_file(w.fileno)
+    ring.send_fd(ring2, fixed_fd)
+    ring.submit
+    assert_equal 0, ring.wait_for_completion[:result]
+
+    c = ring2.wait_for_completion
+    assert_equal :msg_fd, c[:op]
+    assert_operator c[:result], :>=, 0
+
+    ring2.prep_write(fixed_fd: c[:result], buffer: 'foo')
+    ring2.submit
+    assert_equal 3, ring2.wait_for_completion[:result]
+    assert_equal 'foo', r.readpartial(3)
+  ensure
+    ring2&.close
+  end
+
+  def test_invalid_target
+    assert_raises(TypeError) { ring.send_msg(:foo, 1) }
+  end
+end
+
+class VectoredIOTest < IOURingBaseTest
+  def test_prep_writev
+    r, w = IO.pipe
+    bufs = ['foo', 'bar', 'baz'.freeze]
+
+    id = ring.prep_writev(fd: w.fileno, buffers: bufs)
+    ring.submit
+    c = ring.wait_for_completion
+
+    assert_equal id, c[:id]
+    assert_equal :writev, c[:op]
+    assert_equal 9, c[:result]
+
+    w.close
+    assert_equal 'foobarbaz', r.read
+  end
+
+  def test_prep_readv
+    r, w = IO.pipe
+    w << 'foobarbaz'
+    a = +''
+    b = +'xyz'
+
+    id = ring.prep_readv(fd: r.fileno, buffers: [a, b], len: [4, 16])
+    ring.submit
+    c = ring.wait_for_completion
+
+    assert_equal id, c[:id]
+    assert_equal :readv, c[:op]
+    assert_equal 9, c[:result]
+    assert_equal 'foob', a
+    assert_equal 'arbaz', b
+  end
+
+  def test_prep_readv_partial
+    r, w = IO.pipe
+    w << 'foo'
+    a = +''
+    b = +'xyz'
+
+    ring.prep_readv(fd: r.fileno, buffers: [a, b], len: 4)
+    ring.submit
+    c = ring.wait_for_completion
+
+    assert_equal 3, c[:result]
+    assert_equal 'foo', a
+    assert_equal '', b
+  end
+
+  def test_prep_readv_invalid_args
+    r, _w = IO.pipe
+    assert_raises(ArgumentError) { ring.prep_readv(fd: r.fileno, buffers: [], len: 4) }
+    assert_raises(ArgumentError) { ring.prep_readv(fd: r.fileno, buffers: [+'', +''], len: [4]) }
+    assert_raises(FrozenError) { ring.prep_readv(fd: r.fileno, buffers: ['foo'.freeze], len: 4) }
+    assert_raises(TypeError) { ring.prep_writev(fd: r.fileno, buffers: [1]) }
+  end
+end
+
+class SpliceTest < IOURingBaseTest
+  def test_prep_splice
+    r1, w1 = IO.pipe
+    r2, w2 = IO.pipe
+    w1 << 'foobar'
+
+    id = ring.prep_splice(fd_in: r1.fileno, fd_out: w2.fileno, len: 6)
+    ring.submit
+    c = ring.wait_for_completion
+
+    assert_equal id, c[:id]
+    assert_equal :splice, c[:op]
+    assert_equal 6, c[:result]
+    w2.close
+    assert_equal 'foobar', r2.read
+  end
+
+  def test_prep_splice_file_offset
+    f = File.open(__FILE__, 'r')
+    r, w = IO.pipe
+
+    ring.prep_splice(fd_in: f.fileno, off_in: 3, fd_out: w.fileno, len: 3)
+    ring.submit
+    c = ring.wait_for_completion
+
+    assert_equal 3, c[:result]
+    w.close
+    assert_equal IO.read(__FILE__, 3, 3), r.read
+  ensure
+    f&.close
+  end
+
+  def test_prep_tee
+    r1, w1 = IO.pipe
+    r2, w2 = IO.pipe
+    w1 << 'foobar'
+
+    id = ring.prep_tee(fd_in: r1.fileno, fd_out: w2.fileno, len: 6)
+    ring.submit
+    c = ring.wait_for_completion
+
+    assert_equal id, c[:id]
+    assert_equal :tee, c[:op]
+    assert_equal 6, c[:result]
+    w1.close
+    w2.close
+    assert_equal 'foobar', r1.read
+    assert_equal 'foobar', r2.read
+  end
+
+  def test_prep_splice_pipe
+    f = File.open(__FILE__, 'r')
+    s1, s2 = UNIXSocket.pair
+    pipe = IOU.pipe(size: 65536)
+
+    completions = []
+    ids = ring.prep_splice_pipe(pipe: pipe, fd_in: f.fileno, off_in: 0, fd_out: s1.fileno, len: 9) do |c|
+      completions << c
+    end
+    assert_equal 2, ids.size
+
+    ring.submit
+    ring.process_completions(true) while completions.empty?
+
+    assert_equal ids[1], completions[0][:id]
+    assert_equal 9, completions[0][:result]
+    assert_equal IO.read(__FILE__, 9), s2.recv(9)
+  ensure
+    f&.close
+    pipe&.each(&:close)
+  end
+
+  def test_prep_splice_missing_args
+    r, w = IO.pipe
+    assert_raises(ArgumentError) { ring.prep_splice(fd_out: w.fileno, len: 6) }
+    assert_raises(ArgumentError) { ring.prep_splice(fd_in: r.fileno, len: 6) }
+    assert_raises(ArgumentError) { ring.prep_tee(fd_in: r.fileno, fd_out: w.fileno) }
+  end
+end
+
+class FileOpsTest < IOURingBaseTest
+  def setup
+    super
+    @dir = Dir.mktmpdir
+    @fn = File.join(@dir, 'foo')
+  end
+
+  def teardown
+    FileUtils.rm_rf(@dir)
+    super
+  end
+
+  def complete
+    ring.submit
+    ring.wait_for_completion
+  end
+
+  def test_prep_openat
+    id = ring.prep_openat(path: @fn, flags: File::CREAT | File::WRONLY, mode: 0o600)
+    c = complete
+    assert_equal id, c[:id]
+    assert_equal :openat, c[:op]
+    fd = c[:result]
+    assert fd > 0
+
+    ring.prep_write(fd: fd, buffer: 'foobar')
+    assert_equal 6, complete[:result]
+    IO.for_fd(fd).close
+    assert_equal 'foobar', IO.read(@fn)
+    assert_equal 0o600, File.stat(@fn).mode & 0o777
+  end
+
+  def test_prep_openat_missing_file
+    ring.prep_openat(path: @fn)
+    assert_equal(-Errno::ENOENT::Errno, complete[:result])
+  end
+
+  def test_prep_read_write_offset
+    IO.write(@fn, 'foobarbaz')
+    f = File.open(@fn, 'r+')
+
+    ring.prep_write(fd: f.fileno, buffer: 'BAR', offset: 3)
+    assert_equal 3, complete[:result]
+    assert_equal 'fooBARbaz', IO.read(@fn)
+
+    buf = +''
+    ring.prep_read(fd: f.fileno, buffer: buf, len: 3, offset: 6)
+    assert_equal 3, complete[:result]
+    assert_equal 'baz', buf
+
+    # file position is unaffected by positional I/O
+    assert_equal 0, f.pos
+  ensure
+    f&.close
+  end
+
+  def test_prep_statx
+    IO.write(@fn, 'foobar')
+
+    id = ring.prep_statx(path: @fn)
+    c = complete
+    assert_equal id, c[:id]
+    assert_equal :statx, c[:op]
+    assert_equal 0, c[:result]
+
+    stat = File.stat(@fn)
+    assert_equal 6, c[:stat][:size]
+    assert_equal stat.mode, c[:stat][:mode]
+    assert_equal stat.ino, c[:stat][:ino]
+    assert_equal stat.mtime, c[:stat][:mtime]
+  end
+
+  def test_prep_statx_fd
+    IO.write(@fn, 'foobar')
+    f = File.open(@fn, 'r')
+
+    ring.prep_statx(fd: f.fileno)
+    c = complete
+    assert_equal 0, c[:result]
+    assert_equal 6, c[:stat][:size]
+  ensure
+    f&.close
+  end
+
+  def test_prep_fsync_fallocate
+    f = File.open(@fn, 'w')
+
+    id = ring.prep_fallocate(fd: f.fileno, len: 4096)
+    c = complete
+    assert_equal id, c[:id]
+    assert_equal :fallocate, c[:op]
+    assert_equal 0, c[:result]
+    assert_equal 4096, File.size(@fn)
+
+    ring.prep_fsync(fd: f.fileno, datasync: true)
+    c = complete
+    assert_equal :fsync, c[:op]
+    assert_equal 0, c[:result]
+  ensure
+    f&.close
+  end
+
+  def test_prep_unlinkat
+    IO.write(@fn, 'foobar')
+    Dir.mkdir(File.join(@dir, 'bar'))
+
+    ring.prep_unlinkat(path: @fn)
+    c = complete
+    assert_equal :unlinkat, c[:op]
+    assert_equal 0, c[:result]
+    refute File.exist?(@fn)
+
+    ring.prep_unlinkat(path: 'bar', dir_fd: Dir.new(@dir).fileno, dir: true)
+    assert_equal 0, complete[:result]
+    refute File.exist?(File.join(@dir, 'bar'))
+  end
+
+  def test_io_buffer
+    buffer = IOU.aligned_buffer(10)
+    assert_equal IOU::DIRECT_IO_ALIGNMENT, buffer.size
+
+    buffer.set_string('foobar')
+    f = File.open(@fn, 'w+')
+    ring.prep_write(fd: f.fileno, buffer: buffer, len: 6, offset: 0)
+    assert_equal 6, complete[:result]
+    assert_equal 'foobar', IO.read(@fn)
+
+    buffer.clear
+    ring.prep_read(fd: f.fileno, buffer: buffer, buffer_offset: 2, len: 6, offset: 0)
+    assert_equal 6, complete[:result]
+    assert_equal 'foobar', buffer.get_string(2, 6)
+
+    assert_raises(ArgumentError) {
+      ring.prep_read(fd: f.fileno, buffer: buffer, buffer_offset: 4096, len: 1)
+    }
+    assert_raises(ArgumentError) {
+      ring.prep_write(fd: f.fileno, buffer: buffer, buffer_offset: 4097)
+    }
+    # no op or SQE is left behind
+    assert_equal({}, ring.pending_ops)
+    assert_equal 0, ring.submit
+  ensure
+    f&.close
+  end
+end
+
+class PollTest < IOURingBaseTest
+  def test_prep_poll
+    r, w = IO.pipe
+
+    id = ring.prep_poll(fd: r.fileno, events: :in)
+    ring.submit
+    assert_equal 0, ring.process_completions
+
+    w << 'foo'
+    c = ring.wait_for_completion
+    assert_equal id, c[:id]
+    assert_equal :poll, c[:op]
+    assert_equal IO::READABLE, c[:result] & IO::READABLE
+    assert_equal [:in], c[:revents]
+  end
+
+  def test_prep_poll_events
+    r, w = IO.pipe
+    w.close
+
+    ring.prep_poll(fd: r.fileno, events: [:in, :rdhup])
+    ring.submit
+    c = ring.wait_for_completion
+    assert_includes c[:revents], :hup
+
+    assert_raises(ArgumentError) { ring.prep_poll(fd: r.fileno, events: :foo) }
+    assert_raises(ArgumentError) { ring.prep_poll(fd: r.fileno) }
+  end
+
+  def test_prep_poll_multishot
+    r, w = IO.pipe
+
+    completions = []
+    id = ring.prep_poll(fd: r.fileno, events: :in, multishot: true) do |c|
+      next if c[:result] < 0
+
+      completions << c[:revents].dup
+      r.read_nonblock(16)
+    end
+    ring.submit
+
+    w << 'foo'
+    ring.process_completions(true)
+    w << 'bar'
+    ring.process_completions(true)
+    assert_equal [[:in], [:in]], completions
+    assert ring.pending_ops.has_key?(id)
+
+    ring.prep_cancel(id)
+    ring.submit
+    ring.process_completions(true) while ring.pending_ops.has_key?(id)
+  end
+
+  def test_prep_poll_update
+    r, w = IO.pipe
+
+    completions = []
+    id = ring.prep_poll(fd: w.fileno, events: :in, multishot: true) do |c|
+      completions << c
+    end
+    ring.submit
+    ring.process_completions
+    assert_equal [], completions
+
+    ring.prep_poll_update(id: id, events: :out)
+    ring.submit
+    ring.process_completions(true) while completions.empty?
+    assert_equal id, completions.first[:id]
+    assert_equal [:out], completions.first[:revents]
+    assert ring.pending_ops.has_key?(id)
+  end
+
+  def test_prep_poll_update_missing_op
+    ring.prep_poll_update(id: 1234, events: :in)
+    ring.submit
+    c = ring.wait_for_completion
+    assert_equal(-Errno::ENOENT::Errno, c[:result])
+  end
+end
+
+class SocketOpsTest < IOURingBaseTest
+  def setup
+    super
+    @server = TCPServer.open('127.0.0.1', 0)
+    @port = @server.local_address.ip_port
+  end
+
+  def teardown
+    @server.close
+    super
+  end
+
+  def complete
+    ring.submit
+    ring.wait_for_completion
+  end
+
+  def test_prep_socket_connect
+    id = ring.prep_socket(domain: Socket::AF_INET, type: Socket::SOCK_STREAM)
+    c = complete
+    assert_equal id, c[:id]
+    assert_equal :socket, c[:op]
+    fd = c[:result]
+    assert fd > 0
+
+    id = ring.prep_connect(fd: fd, address: Socket.sockaddr_in(@port, '127.0.0.1'))
+    c = complete
+    assert_equal id, c[:id]
+    assert_equal :connect, c[:op]
+    assert_equal 0, c[:result]
+
+    conn = @server.accept
+    ring.prep_send(fd: fd, buffer: 'foo')
+    assert_equal 3, complete[:result]
+    assert_equal 'foo', conn.recv(3)
+
+    id = ring.prep_shutdown(fd: fd, how: Socket::SHUT_WR)
+    c = complete
+    assert_equal :shutdown, c[:op]
+    assert_equal 0, c[:result]
+    assert_equal '', conn.read
+  ensure
+    conn&.close
+    IO.for_fd(fd).close if fd && fd > 0
+  end
+
+  def test_prep_connect_addrinfo
+    sock = Socket.new(:INET, :STREAM)
+    ring.prep_connect(fd: sock.fileno, address: Addrinfo.tcp('127.0.0.1', @port))
+    assert_equal 0, complete[:result]
+  ensure
+    sock&.close
+  end
+
+  def test_prep_connect_refused
+    port = @port
+    @server.close
+    @server = TCPServer.open('127.0.0.1', 0)
+    sock = Socket.new(:INET, :STREAM)
+    ring.prep_connect(fd: sock.fileno, address: Socket.sockaddr_in(port, '127.0.0.1'))
+    assert_equal(-Errno::ECONNREFUSED::Errno, complete[:result])
+  ensure
+    sock&.close
+  end
+
+  def test_linked_socket_connect_send
+    ring.register_files(16)
+    ring.prep_socket(domain: Socket::AF_INET, type: Socket::SOCK_STREAM, fixed_fd: 3, link: true)
+    ring.prep_connect(fixed_fd: 3, address: Socket.sockaddr_in(@port, '127.0.0.1'), link: true)
+    ring.prep_send(fixed_fd: 3, buffer: 'foobar')
+    ring.submit
+
+    results = 3.times.map { ring.wait_for_completion }.sort_by { |c| c[:id] }
+    assert_equal [:socket, :connect, :send], results.map { |c| c[:op] }
+    assert_equal [0, 0, 6], results.map { |c| c[:result] }
+
+    conn = @server.accept
+    assert_equal 'foobar', conn.recv(6)
+  ensure
+    conn&.close
+  end
+
+  def test_prep_connect_invalid_args
+    assert_raises(ArgumentError) { ring.prep_connect(fd: 1) }
+    assert_raises(ArgumentError) { ring.prep_connect(fd: 1, address: '') }
+    assert_raises(ArgumentError) { ring.prep_socket(domain: Socket::AF_INET) }
+  end
+end
+
+class MsgTest < IOURingBaseTest
+  def setup
+    super
+    @server = UDPSocket.new
+    @server.bind('127.0.0.1', 0)
+    @port = @server.local_address.ip_port
+    @client = UDPSocket.new
+    @client.bind('127.0.0.1', 0)
+  end
+
+  def teardown
+    @client.close
+    @server.close
+    super
+  end
+
+  def test_prep_recvmsg
+    bg_id = ring.setup_buffer_ring(count: 4, size: 1024)
+    msgs = []
+    id = ring.prep_recvmsg(fd: @server.fileno, buffer_group: bg_id) do |c|
+      msgs << [c[:buffer], Addrinfo.new(c[:address])] if c[:result] > 0
+    end
+    ring.submit
+
+    @client.send('foo', 0, '127.0.0.1', @port)
+    @client.send('barbaz', 0, '127.0.0.1', @port)
+    ring.process_completions(true) while msgs.size < 2
+
+    assert_equal ['foo', 'barbaz'], msgs.map(&:first)
+    assert_equal [@client.local_address.ip_port] * 2, msgs.map { |m| m[1].ip_port }
+    assert ring.pending_ops.has_key?(id)
+
+    # buffers are added back to the buffer ring
+    6.times { |i| @client.send("#{i}", 0, '127.0.0.1', @port) }
+    ring.process_completions(true) while msgs.size < 8
+    assert_equal %w{0 1 2 3 4 5}, msgs[2..].map(&:first)
+  end
+
+  def test_prep_recvmsg_timestamp
+    @server.setsockopt(Socket::SOL_SOCKET, Socket::SO_TIMESTAMPNS, 1)
+    bg_id = ring.setup_buffer_ring(count: 4, size: 1024)
+    c = nil
+    ring.prep_recvmsg(fd: @server.fileno, buffer_group: bg_id, control_len: 64) do |cc|
+      c = cc
+    end
+    ring.submit
+
+    t0 = Time.now
+    @client.send('foo', 0, '127.0.0.1', @port)
+    ring.process_completions(true) while !c
+
+    assert_equal 'foo', c[:buffer]
+    assert_kind_of Time, c[:timestamp]
+    assert_in_delta t0, c[:timestamp], 1
+  end
+
+  def test_prep_recvmsg_invalid_args
+    bg_id = ring.setup_buffer_ring(count: 4, size: 128)
+    assert_raises(ArgumentError) { ring.prep_recvmsg(fd: @server.fileno) }
+    assert_raises(ArgumentError) { ring.prep_recvmsg(fd: @server.fileno, buffer_group: bg_id) }
+  end
+
+  def test_prep_sendmsg
+    id = ring.prep_sendmsg(
+      fd: @client.fileno, buffers: ['foo', 'bar'],
+      address: Socket.sockaddr_in(@port, '127.0.0.1')
+    )
+    ring.submit
+    c = ring.wait_for_completion
+    assert_equal id, c[:id]
+    assert_equal :sendmsg, c[:op]
+    assert_equal 6, c[:result]
+
+    msg, addr = @server.recvfrom(16)
+    assert_equal 'foobar', msg
+    assert_equal @client.local_address.ip_port, addr[1]
+  end
+
+  def test_prep_sendmsg_segment_size
+    @client.connect('127.0.0.1', @port)
+    ring.prep_sendmsg(fd: @client.fileno, buffer: 'foobarbaz', segment_size: 3)
+    ring.submit
+    c = ring.wait_for_completion
+    skip 'UDP GSO not supported' if c[:result] == -Errno::EIO::Errno || c[:result] == -Errno::EINVAL::Errno
+    assert_equal 9, c[:result]
+
+    assert_equal %w{foo bar baz}, 3.times.map { @server.recv(16) }
+  end
+end
+
+class StatsTest < IOURingBaseTest
+  def test_initial_stats
+    stats = ring.stats
+    assert_equal 0, stats[:sqes_prepped]
+    assert_equal 0, stats[:sqes_submitted]
+    assert_equal 0, stats[:enter_calls]
+    assert_equal 0, stats[:cqes_processed]
+    assert_equal [0] * 8, stats[:cq_batches]
+    assert_equal 0, stats[:cq_overflow_flushes]
+    assert_equal 0, stats[:enobufs]
+    assert_equal 0, stats[:sq_full]
+    assert_equal 0, stats[:pending_ops]
+    assert_equal 0.0, stats[:wait_time]
+  end
+
+  def test_op_counters
+    3.times { ring.prep_nop }
+    stats = ring.stats
+    assert_equal 3, stats[:sqes_prepped]
+    assert_equal 0, stats[:sqes_submitted]
+    assert_equal 3, stats[:pending_ops]
+
+    ring.submit
+    stats = ring.stats
+    assert_equal 3, stats[:sqes_submitted]
+    assert_equal 1, stats[:enter_calls]
+
+    count = 0
+    count += ring.process_completions(true) while count < 3
+    stats = ring.stats
+    assert_equal 3, stats[:cqes_processed]
+    assert_equal 0, stats[:pending_ops]
+    assert_operator stats[:cq_batches].sum, :>=, 1
+  end
+
+  def test_wait_time
+    ring.prep_timeout(interval: 0.05)
+    ring.submit
+    ring.wait_for_completion
+    stats = ring.stats
+    assert_in_range 0.04..0.5, stats[:wait_time]
+    assert_operator stats[:enter_calls], :>=, 2
+  end
+
+  def test_enter_calls
+    ring.prep_nop
+    ring.submit
+    sleep 0.01
+    enter_calls = ring.stats[:enter_calls]
+
+    # a CQE is already available, so the kernel is not entered
+    ring.wait_for_completion
+    assert_equal enter_calls, ring.stats[:enter_calls]
+  end
+
+  def test_enter_calls_registered_ring_fd
+    ring = IOU::Ring.new(register_ring_fd: true)
+    ring.prep_timeout(interval: 0.01)
+    ring.submit
+    enter_calls = ring.stats[:enter_calls]
+
+    c = ring.wait_for_completion
+    assert_equal (-Errno::ETIME::Errno), c[:result]
+    assert_operator ring.stats[:enter_calls], :>, enter_calls
+  ensure
+    ring&.close
+  end
+
+  def test_sq_full
+    ring = IOU::Ring.new(entries: 16, cq_entries: 2048)
+    20.times { ring.prep_nop }
+    stats = ring.stats
+    assert_equal 1, stats[:sq_full]
+    assert_equal 16, stats[:sqes_submitted]
+  ensure
+    ring&.close
+  end
+
+  def test_enobufs
+    r, w = IO.pipe
+    bg = ring.setup_buffer_ring(count: 2, size: 4)
+    ring.prep_read(fd: r.fileno, multishot: true, buffer_group: bg)
+
+    w << 'foobarbazquux'
+    len = 0
+    while len < 13
+      ring.submit
+      ring.process_completions(true) do |c|
+        skip if c[:result] == (-Errno::EINVAL::Errno)
+        len += c[:result]
+      end
+    end
+    enobufs = ring.stats[:enobufs]
+    assert_operator enobufs, :>, 0
+    assert_equal ring.buffer_ring_stats(bg)[:enobufs], enobufs
+  end
+
+  def test_reset_stats
+    ring.prep_nop
+    ring.submit
+    ring.process_completions(true)
+    refute_equal 0, ring.stats[:cqes_processed]
+
+    assert_equal ring, ring.reset_stats
+    stats = ring.stats
+    assert_equal 0, stats[:sqes_prepped]
+    assert_equal 0, stats[:cqes_processed]
+    assert_equal [0] * 8, stats[:cq_batches]
+  end
+end
+
+class SchedulerTest < Minitest::Test
+  def run_scheduler(&block)
+    Thread.new do
+      Fiber.set_scheduler(IOU::Scheduler.new)
+      block.call
+    end.join
+  end
+
+  def test_pipe_read_write
+    r, w = IO.pipe
+    buf = nil
+    run_scheduler do
+      Fiber.schedule { buf = r.read(6) }
+      Fiber.schedule do
+        w << 'foo'
+        sleep 0.01
+        w << 'bar'
+      end
+    end
+    assert_equal 'foobar', buf
+  end
+
+  def test_sleep
+    t0 = monotonic_clock
+    count = 0
+    run_scheduler do
+      10.times { Fiber.schedule { sleep 0.05; count += 1 } }
+    end
+    assert_equal 10, count
+    assert_in_range 0.04..0.2, monotonic_clock - t0
+  end
+
+  def test_io_wait_timeout
+    r, _w = IO.pipe
+    ret = :unset
+    run_scheduler do
+      Fiber.schedule { ret = r.wait_readable(0.01) }
+    end
+    assert_nil ret
+  end
+
+  def test_timeout
+    r, w = IO.pipe
+    error = nil
+    run_scheduler do
+      Fiber.schedule do
+        Timeout.timeout(0.02) { r.read(1) }
+      rescue Timeout::Error => e
+        error = e
+      end
+    end
+    assert_kind_of Timeout::Error, error
+
+    # the cancelled read does not consume data
+    w << 'foo'
+    assert_equal 'foo', r.read_nonblock(3)
+  end
+
+  def test_queue
+    q = Thread::Queue.new
+    values = []
+    run_scheduler do
+      Fiber.schedule { 3.times { values << q.pop } }
+      Fiber.schedule { 3.times { |i| sleep 0.001; q << i } }
+    end
+    assert_equal [0, 1, 2], values
+  end
+
+  def test_unblock_from_other_thread
+    q = Thread::Queue.new
+    value = nil
+    run_scheduler do
+      Fiber.schedule { value = q.pop }
+      Thread.new { sleep 0.01; q << :foo }
+    end
+    assert_equal :foo, value
+  end
+
+  def test_tcp_echo
+    server = TCPServer.new('127.0.0.1', 0)
+    port = server.addr[1]
+    response = nil
+    run_scheduler do
+      Fiber.schedule do
+        conn = server.accept
+        conn.write(conn.readpartial(4096))
+        conn.close
+      end
+      Fiber.schedule do
+        client = TCPSocket.new('127.0.0.1', port)
+        client.write('hello')
+        response = client.read
+        client.close
+      end
+    end
+    assert_equal 'hello', response
+  ensure
+    server&.close
+  end
+
+  def test_address_resolve
+    addrs = nil
+    run_scheduler do
+      Fiber.schedule { addrs = Addrinfo.getaddrinfo('localhost', 80) }
+    end
+    refute_empty addrs
+  end
+
+  def test_close
+    scheduler = IOU::Scheduler.new
+    refute scheduler.closed?
+    scheduler.close
+    assert scheduler.closed?
+  end
 end
 
 class RactorTest < Minitest::Test